@@ -22,9 +22,10 @@
 
 /*
  * This example shows how to use the function classes stx::PipeSource and
- * stx::PipeFunction to insert custom processing into a pipe sequence. The
+ * stx::PipeSink to insert custom processing into a pipe sequence. The
  * application calls tar to create an archive, calculates the SHA1 digest of
- * the uncompressed tarball and then pipes the data into gzip for compression.
+ * the uncompressed tarball with an observer stage and then pipes the data into
+ * gzip for compression.
  */
 
 #include "stx-execpipe.h"
@@ -51,13 +52,19 @@ public:
     {
     }
 
-    // Send one file name each time polled.
-    virtual bool poll()
+    using stx::PipeSource::poll;
+
+    // Send as many file names as fit into the pipe each time polled.
+    virtual bool poll(unsigned int hint)
     {
-	if (m_pos < m_list.size())
+	unsigned int wrote = 0;
+
+	while (m_pos < m_list.size() && wrote < hint)
 	{
 	    write(m_list[m_pos].data(), m_list[m_pos].size());
 	    write("\n", 1);
+
+	    wrote += m_list[m_pos].size() + 1;
 	    ++m_pos;
 	}
 
@@ -65,7 +72,7 @@ public:
     }
 };
 
-class Sha1Function : public stx::PipeFunction
+class Sha1Observer : public stx::PipeSink
 {
 public:
 
@@ -75,17 +82,16 @@ public:
     // Finished digest generated in eof().
     std::string m_digest;
 
-    Sha1Function()
+    Sha1Observer()
     {
 	SHA1_Init(&m_ctx);
     }
 
-    // Update the sha1 digest context and pass on unmodified data.
+    // Update the sha1 digest context. The data is passed on to the next stage
+    // by the library without copying.
     virtual void process(const void* data, unsigned int datalen)
     {
 	SHA1_Update(&m_ctx, data, datalen);
-
-	write(data, datalen);
     }
 
     // Calculate final SHA1 digest once the data stream closes.
@@ -139,11 +145,11 @@ int main()
 
     ep.add_execp(&tarargs);
 
-    // insert an intermediate processing stage to save the SHA1 sum of the
+    // insert an intermediate observer stage to save the SHA1 sum of the
     // uncompressed tarball.
-    Sha1Function sha1tar;
+    Sha1Observer sha1tar;
 
-    ep.add_function(&sha1tar);
+    ep.add_observer(&sha1tar);
 
     // add compression stage
     ep.add_execp("gzip", "-9");
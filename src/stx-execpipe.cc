@@ -29,8 +29,13 @@
 #include <stdexcept>
 #include <sstream>
 #include <iostream>
+#include <algorithm>
+#include <map>
+#include <deque>
+#include <list>
 
 #include <assert.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -39,6 +44,80 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/select.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <limits.h>
+#include <sched.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+// pidfds are used to notice child exits in the event loop and to reap exactly
+// the pipe's own children on Linux 5.4 and later.
+#if defined(__linux__) && defined(SYS_pidfd_open) && !defined(STX_EXECPIPE_NO_PIDFD)
+#define STX_EXECPIPE_HAVE_PIDFD 1
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
+#endif
+
+// splice() and tee() are used for zero-copy data paths on Linux, other systems
+// copy the data through the parent process.
+#if defined(__linux__)
+#define STX_EXECPIPE_HAVE_SPLICE 1
+#endif
+
+/// Minimum remaining input string length for which vmsplice() is used. Below
+/// this threshold the page pinning costs more than a plain write() copy.
+static const size_t VMSPLICE_MINIMUM = 64 * 1024;
+
+// posix_spawn() is used to launch exec stages without copying the parent's
+// page tables, unless disabled at build time by defining STX_EXECPIPE_NO_SPAWN.
+#if !defined(STX_EXECPIPE_NO_SPAWN)
+#define STX_EXECPIPE_HAVE_SPAWN 1
+#include <spawn.h>
+#endif
+
+/// environment passed to exec stages without an explicit environment.
+extern char** environ;
+
+// function stages, sources and sinks may run on worker threads, unless
+// disabled at build time by defining STX_EXECPIPE_NO_THREADS. Then they always
+// run inline.
+#if !defined(STX_EXECPIPE_NO_THREADS)
+#define STX_EXECPIPE_HAVE_THREADS 1
+#include <pthread.h>
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#endif
+#endif
+
+// epoll() is used as event loop backend on Linux, unless disabled at build
+// time by defining STX_EXECPIPE_NO_EPOLL.
+#if defined(__linux__) && !defined(STX_EXECPIPE_NO_EPOLL)
+#define STX_EXECPIPE_HAVE_EPOLL 1
+#include <sys/epoll.h>
+#endif
+
+// io_uring is available as optional event loop backend on Linux. It is driven
+// directly via system calls, thus liburing is not required. Define
+// STX_EXECPIPE_NO_IO_URING to disable it at build time.
+#if defined(__linux__) && !defined(STX_EXECPIPE_NO_IO_URING)
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) \
+    && defined(__NR_io_uring_register)
+#define STX_EXECPIPE_HAVE_IO_URING 1
+#include <sys/mman.h>
+#include <poll.h>
+#include <linux/io_uring.h>
+#endif
+#endif
 
 #define LOG_OUTPUT(msg, level)                           \
     do {                                                 \
@@ -164,6 +243,21 @@ public:
 	    : (m_size);
     }
 
+    /**
+     * Return a pointer to the unread bytes wrapped around to the buffer's
+     * start, which follow the bottomsize() bytes at bottom().
+     */
+    inline char* wrapped() const
+    {
+	return m_data;
+    }
+
+    /// Return the number of unread bytes at the wrapped() place.
+    inline unsigned int wrappedsize() const
+    {
+	return m_size - bottomsize();
+    }
+
     /**
      * Advance the internal read pointer n bytes, thus marking that amount of
      * data as read.
@@ -248,1449 +342,7929 @@ public:
 
 #endif // _STX_RINGBUFFER_H_
 
+/// namespace containing helper functions for pipe setup
+namespace {
+
 /**
- * \brief Main library implementation (internal object)
- *
- * Implementation class for stx::ExecPipe. See the documentation of the
- * front-end class for detailed information.
+ * Return the maximum pipe capacity an unprivileged process may request, as
+ * configured in /proc/sys/fs/pipe-max-size, or zero if unknown.
  */
-class ExecPipeImpl
+unsigned int read_pipe_max_size()
 {
-private:
+    unsigned int maxsize = 0;
 
-    /// reference counter
-    unsigned int	m_refs;
+    FILE* f = fopen("/proc/sys/fs/pipe-max-size", "re");
+    if (!f) return 0;
 
-private:
+    if (fscanf(f, "%u", &maxsize) != 1)
+	maxsize = 0;
 
-    // *** Debugging Output ***
-    
-    /// currently set debug level
-    enum ExecPipe::DebugLevel	m_debug_level;
+    fclose(f);
+    return maxsize;
+}
 
-    /// current debug line output function
-    void		(*m_debug_output)(const char* line);
+/**
+ * Return the milliseconds elapsed on the monotonic clock, which is not
+ * affected by changes of the wall-clock time.
+ */
+long long monotonic_msec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<long long>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
 
-public:
+/**
+ * Create a pipe with both ends marked close-on-exec, such that children
+ * launched concurrently by other threads do not inherit them. Returns the
+ * result of pipe().
+ */
+int pipe_cloexec(int pipefd[2])
+{
+#if defined(__linux__)
+    return pipe2(pipefd, O_CLOEXEC);
+#else
+    if (pipe(pipefd) != 0) return -1;
+
+    // not atomic: another thread may fork() in between.
+    fcntl(pipefd[0], F_SETFD, FD_CLOEXEC);
+    fcntl(pipefd[1], F_SETFD, FD_CLOEXEC);
+    return 0;
+#endif
+}
 
-    /// Change the current debug level. The default is DL_ERROR.
-    void set_debug_level(enum ExecPipe::DebugLevel dl)
-    {
-	m_debug_level = dl;
-    }
+/**
+ * Close all file descriptors from minfd upwards in a forked child, except
+ * keepfd1 and keepfd2 if they are not -1. Returns false if not supported by
+ * the kernel.
+ */
+bool close_from(int minfd, int keepfd1, int keepfd2 = -1)
+{
+#if defined(__linux__) && defined(SYS_close_range)
+    if (keepfd1 > keepfd2) std::swap(keepfd1, keepfd2);
 
-    /// Change output function for debug messages. If set to NULL (the default)
-    /// the debug lines are printed to stdout.
-    void set_debug_output(void (*output)(const char *line))
+    const int keep[2] = { keepfd1, keepfd2 };
+
+    for (unsigned int k = 0; k < 2; ++k)
     {
-	m_debug_output = output;
+	if (keep[k] < minfd) continue;
+
+	if (keep[k] > minfd &&
+	    syscall(SYS_close_range, minfd, keep[k] - 1, 0) != 0)
+	    return false;
+
+	minfd = keep[k] + 1;
     }
 
-private:
+    return (syscall(SYS_close_range, minfd, ~0U, 0) == 0);
+#else
+    (void)minfd; (void)keepfd1; (void)keepfd2;
+    return false;
+#endif
+}
 
-    /// Enumeration describing the currently set input or output stream type
-    enum StreamType
-    {
-	ST_NONE = 0,	///< no special redirection requested
-	ST_FD,		///< redirection to existing fd
-	ST_FILE,	///< redirection to file path
-	ST_STRING,	///< input/output directed by/to string
-	ST_OBJECT	///< input/output attached to program object
-    };
+/**
+ * Fill the signal set with only SIGPIPE.
+ */
+void sigpipe_set(sigset_t& set)
+{
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+}
 
-    /// describes the currently set input stream type
-    StreamType		m_input;
+/**
+ * Change the calling thread's signal mask. The effect of sigprocmask() in a
+ * multi-threaded process is unspecified, thus pthread_sigmask() is used if
+ * the threading library is linked anyway.
+ */
+void thread_sigmask(int how, const sigset_t* set, sigset_t* oldset)
+{
+#if STX_EXECPIPE_HAVE_THREADS
+    pthread_sigmask(how, set, oldset);
+#else
+    sigprocmask(how, set, oldset);
+#endif
+}
 
-    // *** Input Stream ***
+#if STX_EXECPIPE_HAVE_SPAWN
+/**
+ * Return the calling thread's signal mask with SIGPIPE unblocked, which is
+ * the mask children are launched with while SigPipeGuard is active.
+ */
+void child_sigmask(sigset_t& mask)
+{
+    thread_sigmask(SIG_SETMASK, NULL, &mask);
+    sigdelset(&mask, SIGPIPE);
+}
+#endif
 
-    /// for ST_FD the input fd given by the user. for ST_STRING and ST_FUNCTION
-    /// the pipe write fd of the parent process.
-    int			m_input_fd;
+/**
+ * Blocks SIGPIPE in the calling thread while a pipe runs, such that writes
+ * into pipes closed early by their reader fail with EPIPE instead of killing
+ * the process. A SIGPIPE left pending by such writes is discarded when the
+ * original mask is restored. Other threads keep their masks, thus pipes may
+ * run concurrently.
+ */
+class SigPipeGuard
+{
+private:
+    /// signal mask before blocking SIGPIPE
+    sigset_t	m_oldmask;
 
-    /// for ST_FILE the path of the input file.
-    const char* 	m_input_file;
+public:
+    SigPipeGuard()
+    {
+	sigset_t set;
+	sigpipe_set(set);
+	thread_sigmask(SIG_BLOCK, &set, &m_oldmask);
+    }
 
-    /// for ST_STRING a pointer to the user-supplied std::string input stream
-    /// object.
-    const std::string*	m_input_string;
+    ~SigPipeGuard()
+    {
+	// leave SIGPIPE untouched if the caller had already blocked it.
+	if (sigismember(&m_oldmask, SIGPIPE)) return;
 
-    /// for ST_STRING the current position in the input stream object.
-    std::string::size_type m_input_string_pos;
+	sigset_t set, pending;
+	sigpipe_set(set);
 
-    /// for ST_OBJECT the input stream source object
-    PipeSource*		m_input_source;
+	if (sigpending(&pending) == 0 && sigismember(&pending, SIGPIPE))
+	{
+	    struct timespec zero = { 0, 0 };
+	    while (sigtimedwait(&set, NULL, &zero) < 0 && errno == EINTR) { }
+	}
 
-    /// for ST_OBJECT the input stream ring buffer
-    RingBuffer		m_input_rbuffer;
+	thread_sigmask(SIG_SETMASK, &m_oldmask, NULL);
+    }
+};
 
-    // *** Output Stream ***
+/**
+ * Report errno via the error pipe of a forked child, whose exec() or setup
+ * failed, and terminate the child with return code 255.
+ */
+void exit_errno(int errfd) __attribute__((noreturn));
 
-    /// describes the currently set input stream type
-    StreamType		m_output;
+void exit_errno(int errfd)
+{
+    int err = errno;
+    ssize_t wb = write(errfd, &err, sizeof(err));
+    (void)wb;
+    _exit(255);
+}
 
-    /// for ST_FD the output fd given by the user. for ST_STRING and
-    /// ST_FUNCTION the pipe read fd of the parent process.
-    int			m_output_fd;
+/**
+ * Minimal spin lock for the process-wide singletons, whose critical sections
+ * are short and rarely contended. Uses GCC's atomic builtins, thus no
+ * threading library is required.
+ */
+class SpinLock
+{
+private:
+    volatile int	m_lock;
 
-    /// for ST_FILE the path of the output file.
-    const char*		m_output_file;
+public:
+    SpinLock()
+	: m_lock(0)
+    {
+    }
 
-    /// for ST_FILE the permission used in the open() call.
-    int			m_output_file_mode;
+    void lock()
+    {
+	while (__sync_lock_test_and_set(&m_lock, 1))
+	    sched_yield();
+    }
 
-    /// for ST_STRING a pointer to the user-supplied std::string output stream
-    /// object.
-    std::string*	m_output_string;
+    void unlock()
+    {
+	__sync_lock_release(&m_lock);
+    }
+};
 
-    /// for ST_OBJECT the output stream source object
-    PipeSink*		m_output_sink;
+} // namespace <anonymous>
 
-    // *** Pipe Stages ***
+/// namespace containing the executable resolution cache
+namespace {
 
-    /**
-     * Structure representing each stage in the pipe. Contains arguments,
-     * buffers and output variables.
-     */
-    struct Stage
+/**
+ * ExecCache resolves program names of execp() stages to paths by searching
+ * the PATH variable like execvp() does, and caches the results process-wide.
+ *
+ * A cached entry stays valid as long as PATH is unchanged and none of the
+ * directories searched up to and including the one containing the program
+ * was modified, which is checked using the directories' mtimes. Optionally, an
+ * O_PATH file descriptor of each binary is kept open for fexecve().
+ *
+ * The cache is protected by a simple spin lock, as lookups are short and
+ * contention is rare.
+ */
+class ExecCache
+{
+private:
+    /// identification of a directory's state when it was searched.
+    struct DirStamp
     {
-	/// List of program and arguments copied from simple add_exec() calls.
-	std::vector<std::string>	args;
+	bool		exists;
+	ino_t		ino;
+	time_t		mtime;
+	long		mtime_nsec;
 
-	/// Character pointer to program path called
-	const char*			prog;
+	/// Stat the directory and fill in its current state.
+	void stamp(const std::string& dir)
+	{
+	    struct stat st;
+
+	    exists = (stat(dir.c_str(), &st) == 0);
+	    ino = exists ? st.st_ino : 0;
+	    mtime = exists ? st.st_mtime : 0;
+#if defined(__linux__)
+	    mtime_nsec = exists ? st.st_mtim.tv_nsec : 0;
+#else
+	    mtime_nsec = 0;
+#endif
+	}
 
-	/// Pointer to user list of program and arguments.
-	const std::vector<std::string>* argsp;
+	/// Compare two states of a directory.
+	bool operator==(const DirStamp& o) const
+	{
+	    return exists == o.exists && ino == o.ino
+		&& mtime == o.mtime && mtime_nsec == o.mtime_nsec;
+	}
+    };
 
-	/// Pointer to environment list supplied by user.
-	const std::vector<std::string>* envp;
+    /// cached resolution of one program name.
+    struct Entry
+    {
+	/// resolved path of the program.
+	std::string		path;
 
-	/// Pipe stage function object.
-	PipeFunction*			func;
+	/// O_PATH file descriptor of the program or -1.
+	int			fd;
 
-	/// Output stream buffer for function object.
-	RingBuffer			outbuffer;
+	/// state of the PATH directories searched up to the program's.
+	std::vector<DirStamp>	dirs;
+    };
 
-	// *** Exec Stages Variables ***
+    typedef std::map<std::string, Entry> entrymap_type;
 
-	/// Call execp() variants.
-	bool	withpath;
+    /// spin lock protecting all members, also taken by the const mode().
+    mutable SpinLock	m_lock;
 
-	/// Pid of the running child process
-	pid_t	pid;
+    /// PATH variable the cache entries were resolved with.
+    std::string		m_path;
 
-	/// Return status of wait() after child exit.
-	int	retstatus;
-	
-	/// File descriptor for child stdin. This is dup2()-ed to STDIN.
-	int	stdin_fd;
+    /// cached entries by program name.
+    entrymap_type	m_entries;
 
-	/// File descriptor for child stdout. This is dup2()-ed to STDOUT.
-	int	stdout_fd;
+    /// cache mode.
+    ExecPipe::ExecCacheMode	m_mode;
 
-	/// Constructor reseting all variables.
-	Stage()
-	    : prog(NULL), argsp(NULL), envp(NULL), func(NULL),
-	      withpath(false), pid(0), retstatus(0),
-	      stdin_fd(-1), stdout_fd(-1)
-	{
-	}
-    };
+    /// Split the PATH variable into its directories. Empty elements denote
+    /// the current directory.
+    static std::vector<std::string> split_path(const std::string& path)
+    {
+	std::vector<std::string> dirs;
+	std::string::size_type p = 0;
 
-    /// typedef of list of pipe stages.
-    typedef std::vector<Stage> stagelist_type;
+	while (1)
+	{
+	    std::string::size_type q = path.find(':', p);
+	    std::string dir = path.substr(p, q == std::string::npos ? std::string::npos : q - p);
 
-    /// list of pipe stages.
-    stagelist_type	m_stages;
+	    dirs.push_back(dir.empty() ? "." : dir);
 
-    /// general buffer used for read() and write() calls.
-    char		m_buffer[4096];
+	    if (q == std::string::npos) break;
+	    p = q + 1;
+	}
 
-public:
+	return dirs;
+    }
 
-    /// Create a new pipe implementation with zero reference counter.
-    ExecPipeImpl()
-	: m_refs(0),
-	  m_debug_level(ExecPipe::DL_ERROR),
-	  m_debug_output(NULL),
-	  m_input(ST_NONE),
-	  m_input_fd(-1),
-	  m_output(ST_NONE),
-	  m_output_fd(-1)
+    /// Return true if the file is a regular file executable by us.
+    static bool is_executable(const std::string& file)
     {
+	struct stat st;
+
+	if (stat(file.c_str(), &st) != 0) return false;
+	if (!S_ISREG(st.st_mode)) return false;
+
+	return (access(file.c_str(), X_OK) == 0);
     }
 
-    /// Return writable reference to counter.
-    unsigned int& refs()
+    /// Open an O_PATH descriptor of a binary, or return -1 for interpreter
+    /// scripts, which cannot be run via fexecve() on a close-on-exec file
+    /// descriptor.
+    static int open_binary(const std::string& file)
     {
-	return m_refs;
+#if defined(__linux__) && defined(O_PATH)
+	int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return -1;
+
+	char magic[2] = { 0, 0 };
+	ssize_t rb = read(fd, magic, sizeof(magic));
+	close(fd);
+
+	if (rb == 2 && magic[0] == '#' && magic[1] == '!')
+	    return -1;
+
+	return open(file.c_str(), O_PATH | O_CLOEXEC);
+#else
+	(void)file;
+	return -1;
+#endif
     }
 
-    // *** Input Selectors ***
+    /// Close the file descriptor of all entries and clear the cache.
+    void clear_entries()
+    {
+	for (entrymap_type::iterator it = m_entries.begin();
+	     it != m_entries.end(); ++it)
+	{
+	    if (it->second.fd >= 0) close(it->second.fd);
+	}
 
-    ///@{ \name Input Selectors
+	m_entries.clear();
+    }
 
-    /**
-     * Assign an already opened file descriptor as input stream for the first
-     * exec stage.
-     */
-    void set_input_fd(int fd)
+    /// Check that the cached directory states are still current.
+    bool is_valid(const Entry& e, const std::vector<std::string>& dirs) const
     {
-	assert(m_input == ST_NONE);
-	if (m_input != ST_NONE) return;
+	for (unsigned int i = 0; i < e.dirs.size(); ++i)
+	{
+	    DirStamp ds;
+	    ds.stamp(dirs[i]);
 
-	m_input = ST_FD;
-	m_input_fd = fd;
+	    if (!(ds == e.dirs[i])) return false;
+	}
+
+	return true;
     }
 
-    /**
-     * Assign a file as input stream source. This file will be opened read-only
-     * and read by the first exec stage.
-     */
-    void set_input_file(const char* path)
+    /// Search the PATH directories for the program and fill the entry.
+    bool search(const std::string& prog, const std::vector<std::string>& dirs,
+		Entry& e) const
     {
-	assert(m_input == ST_NONE);
-	if (m_input != ST_NONE) return;
+	e.dirs.clear();
+	e.fd = -1;
 
-	m_input = ST_FILE;
-	m_input_file = path;
-    }    
+	for (unsigned int i = 0; i < dirs.size(); ++i)
+	{
+	    DirStamp ds;
+	    ds.stamp(dirs[i]);
+	    e.dirs.push_back(ds);
 
-    /**
-     * Assign a std::string as input stream source. The contents of the string
-     * will be written to the first exec stage. The string object is not copied
-     * and must still exist when run() is called.
-     */
-    void set_input_string(const std::string* input)
-    {
-	assert(m_input == ST_NONE);
-	if (m_input != ST_NONE) return;
+	    std::string file = dirs[i] + "/" + prog;
 
-	m_input = ST_STRING;
-	m_input_string = input;
-	m_input_string_pos = 0;
+	    if (is_executable(file))
+	    {
+		e.path = file;
+
+		if (m_mode == ExecPipe::EC_FD)
+		    e.fd = open_binary(file);
+
+		return true;
+	    }
+	}
+
+	return false;
     }
 
-    /**
-     * Assign a PipeSource as input stream source. The object will be queried
-     * via the read() function for data which is then written to the first exec
-     * stage.
-     */
-    void set_input_source(PipeSource* source)
+public:
+    ExecCache()
+	: m_mode(ExecPipe::EC_PATH)
     {
-	assert(m_input == ST_NONE);
-	if (m_input != ST_NONE) return;
+    }
 
-	m_input = ST_OBJECT;
-	m_input_source = source;
-	source->m_impl = this;
+    ~ExecCache()
+    {
+	clear_entries();
     }
 
-    ///@}
-    
-    /**
-     * Function called by PipeSource::write() to push data into the ring
-     * buffer.
-     */
-    void input_source_write(const void* data, unsigned int datalen)
+    /// Return the process-wide cache instance.
+    static ExecCache& instance()
     {
-	m_input_rbuffer.write(data, datalen);
+	static ExecCache cache;
+	return cache;
     }
 
-    // *** Output Selectors ***
+    /// Return the current cache mode.
+    ExecPipe::ExecCacheMode mode() const
+    {
+	m_lock.lock();
+	ExecPipe::ExecCacheMode mode = m_mode;
+	m_lock.unlock();
 
-    ///@{ \name Output Selectors
+	return mode;
+    }
 
-    /**
-     * Assign an already opened file descriptor as output stream for the last
-     * exec stage.
-     */
-    void set_output_fd(int fd)
+    /// Change the cache mode, which drops all cached entries.
+    void set_mode(ExecPipe::ExecCacheMode mode)
     {
-	assert(m_output == ST_NONE);
-	if (m_output != ST_NONE) return;
+	m_lock.lock();
+	clear_entries();
+	m_mode = mode;
+	m_lock.unlock();
+    }
 
-	m_output = ST_FD;
-	m_output_fd = fd;
+    /// Drop all cached entries.
+    void clear()
+    {
+	m_lock.lock();
+	clear_entries();
+	m_lock.unlock();
     }
 
     /**
-     * Assign a file as output stream destination. This file will be created or
-     * truncated write-only and written by the last exec stage.
+     * Resolve a program name via PATH. Returns false if it was not found.
+     * Otherwise path is set and, in EC_FD mode, fd to a close-on-exec
+     * duplicate of the binary's descriptor, which must be closed by the
+     * caller, or to -1. Program names containing a slash are not resolved.
      */
-    void set_output_file(const char* path, int mode = 0666)
+    bool resolve(const char* prog, std::string& path, int& fd)
     {
-	assert(m_output == ST_NONE);
-	if (m_output != ST_NONE) return;
+	fd = -1;
 
-	m_output = ST_FILE;
-	m_output_file = path;
-	m_output_file_mode = mode;
-    }    
+	if (strchr(prog, '/'))
+	{
+	    path = prog;
+	    return true;
+	}
 
-    /**
-     * Assign a std::string as output stream destination. The output of the
-     * last exec stage will be stored as the contents of the string. The string
-     * object is not copied and must still exist when run() is called.
-     */
-    void set_output_string(std::string* output)
-    {
-	assert(m_output == ST_NONE);
-	if (m_output != ST_NONE) return;
+	// same default as execvp() if PATH is unset.
+	const char* envpath = getenv("PATH");
+	std::string pathvar = envpath ? envpath : "/bin:/usr/bin";
+	std::vector<std::string> dirs = split_path(pathvar);
 
-	m_output = ST_STRING;
-	m_output_string = output;
-    }
+	m_lock.lock();
 
-    /**
-     * Assign a PipeSink as output stream destination. The object will receive
-     * data via the process() function and is informed via eof()
-     */
-    void set_output_sink(PipeSink* sink)
-    {
-	assert(m_output == ST_NONE);
-	if (m_output != ST_NONE) return;
+	if (pathvar != m_path)
+	{
+	    clear_entries();
+	    m_path = pathvar;
+	}
 
-	m_output = ST_OBJECT;
-	m_output_sink = sink;
-    }
+	entrymap_type::iterator it = m_entries.find(prog);
 
-    ///@}
+	if (it != m_entries.end() && !is_valid(it->second, dirs))
+	{
+	    if (it->second.fd >= 0) close(it->second.fd);
+	    m_entries.erase(it);
+	    it = m_entries.end();
+	}
 
-    // *** Pipe Stages ***
+	if (it == m_entries.end())
+	{
+	    Entry e;
 
-    ///@{ \name Add Pipe Stages
+	    if (!search(prog, dirs, e))
+	    {
+		m_lock.unlock();
+		return false;
+	    }
 
-    /**
-     * Return the number of pipe stages added.
-     */
-    unsigned int size() const
-    {
-	return m_stages.size();
-    }
+	    it = m_entries.insert(std::make_pair(std::string(prog), e)).first;
+	}
 
-    /**
-     * Add an exec() stage to the pipe with given arguments. Note that argv[0]
-     * is set to prog.
-     */
-    void add_exec(const char* prog)
-    {
-	struct Stage newstage;
-	newstage.prog = prog;
-	newstage.args.push_back(prog);
-	m_stages.push_back(newstage);
-    }
+	path = it->second.path;
 
-    /**
-     * Add an exec() stage to the pipe with given arguments. Note that argv[0]
-     * is set to prog.
-     */
-    void add_exec(const char* prog, const char* arg1)
-    {
-	struct Stage newstage;
-	newstage.prog = prog;
-	newstage.args.push_back(prog);
-	newstage.args.push_back(arg1);
-	m_stages.push_back(newstage);
+	if (it->second.fd >= 0)
+	    fd = fcntl(it->second.fd, F_DUPFD_CLOEXEC, 0);
+
+	m_lock.unlock();
+	return true;
     }
+};
 
-    /**
-     * Add an exec() stage to the pipe with given arguments. Note that argv[0]
-     * is set to prog.
-     */
-    void add_exec(const char* prog, const char* arg1, const char* arg2)
+} // namespace <anonymous>
+
+/// namespace containing the fork server
+namespace {
+
+/**
+ * ForkServer is an optional helper process, which is forked once while the
+ * parent process is still small and single-threaded, and then launches exec
+ * stages on behalf of all pipes. This avoids copying the page tables of a
+ * large parent and fork()ing a multi-threaded process.
+ *
+ * Requests are sent over a SOCK_SEQPACKET unix socketpair, one message per
+ * launch. A request carries the program, arguments, environment and working
+ * directory, and passes the stage's stdin, stdout and a status pipe's write
+ * end via SCM_RIGHTS. The server replies with the child's pid, or the errno
+ * of a failed exec(), which it detects via a close-on-exec error pipe. When
+ * the child exits, the server writes the wait() status into the status pipe
+ * and closes it, which the parent's event loop watches like a pidfd.
+ */
+class ForkServer
+{
+private:
+    /// spin lock serializing requests.
+    SpinLock		m_lock;
+
+    /// parent's end of the socketpair, or -1 if not running.
+    int			m_sock;
+
+    /// pid of the server process.
+    pid_t		m_pid;
+
+    /// request flags
+    enum { F_STDIN = 1, F_STDOUT = 2, F_PATH = 4 };
+
+    // *** Message Encoding ***
+
+    static void put_u32(std::string& m, unsigned int v)
     {
-	struct Stage newstage;
-	newstage.prog = prog;
-	newstage.args.push_back(prog);
-	newstage.args.push_back(arg1);
-	newstage.args.push_back(arg2);
-	m_stages.push_back(newstage);
+	m.append(reinterpret_cast<const char*>(&v), sizeof(v));
     }
 
-    /**
-     * Add an exec() stage to the pipe with given arguments. Note that argv[0]
-     * is set to prog.
-     */
-    void add_exec(const char* prog, const char* arg1, const char* arg2, const char* arg3)
+    /// Append a string including its zero terminator, such that the server
+    /// can use it in place.
+    static void put_str(std::string& m, const char* str)
     {
-	struct Stage newstage;
-	newstage.prog = prog;
-	newstage.args.push_back(prog);
-	newstage.args.push_back(arg1);
-	newstage.args.push_back(arg2);
-	newstage.args.push_back(arg3);
-	m_stages.push_back(newstage);
+	unsigned int len = strlen(str) + 1;
+	put_u32(m, len);
+	m.append(str, len);
     }
 
-    /**
-     * Add an exec() stage to the pipe with given arguments. The vector of
-     * arguments is not copied, so it must still exist when run() is
-     * called. Note that the program called is args[0].
-     */
-    void add_exec(const std::vector<std::string>* args)
+    /// Sequential reader of a received request message.
+    struct Reader
     {
-	assert(args->size() > 0);
-	if (args->size() == 0) return;
+	const char*	p;
+	const char*	end;
 
-	struct Stage newstage;
-	newstage.prog = (*args)[0].c_str();
-	newstage.argsp = args;
-	m_stages.push_back(newstage);
-    }
+	bool get_u32(unsigned int& v)
+	{
+	    if (end - p < static_cast<ssize_t>(sizeof(v))) return false;
+	    memcpy(&v, p, sizeof(v));
+	    p += sizeof(v);
+	    return true;
+	}
 
-    /**
-     * Add an execp() stage to the pipe with given arguments. The PATH variable
-     * is search for programs not containing a slash / character. Note that
-     * argv[0] is set to prog.
-     */
-    void add_execp(const char* prog)
-    {
-	struct Stage newstage;
-	newstage.prog = prog;
-	newstage.args.push_back(prog);
-	newstage.withpath = true;
-	m_stages.push_back(newstage);
-    }
+	/// Append pointers to the next n zero-terminated strings to list.
+	bool get_strlist(std::vector<char*>& list, unsigned int n)
+	{
+	    for (unsigned int i = 0; i < n; ++i)
+	    {
+		unsigned int len;
+		if (!get_u32(len) || len == 0 || end - p < static_cast<ssize_t>(len))
+		    return false;
+		if (p[len-1] != 0) return false;
+		list.push_back(const_cast<char*>(p));
+		p += len;
+	    }
+	    return true;
+	}
+    };
 
-    /**
-     * Add an execp() stage to the pipe with given arguments. The PATH variable
-     * is search for programs not containing a slash / character. Note that
-     * argv[0] is set to prog.
-     */
-    void add_execp(const char* prog, const char* arg1)
-    {
-	struct Stage newstage;
-	newstage.prog = prog;
-	newstage.args.push_back(prog);
-	newstage.args.push_back(arg1);
-	newstage.withpath = true;
-	m_stages.push_back(newstage);
-    }
+    // *** Server Process ***
 
-    /**
-     * Add an execp() stage to the pipe with given arguments. The PATH variable
-     * is search for programs not containing a slash / character. Note that
-     * argv[0] is set to prog.
-     */
-    void add_execp(const char* prog, const char* arg1, const char* arg2)
+    /// write end of the server's SIGCHLD self-pipe.
+    static int& sigchld_fd()
     {
-	struct Stage newstage;
-	newstage.prog = prog;
-	newstage.args.push_back(prog);
-	newstage.args.push_back(arg1);
-	newstage.args.push_back(arg2);
-	newstage.withpath = true;
-	m_stages.push_back(newstage);
+	static int fd = -1;
+	return fd;
     }
 
-    /**
-     * Add an execp() stage to the pipe with given arguments. The PATH variable
-     * is search for programs not containing a slash / character. Note that
-     * argv[0] is set to prog.
-     */
-    void add_execp(const char* prog, const char* arg1, const char* arg2, const char* arg3)
+    static void sigchld_handler(int)
     {
-	struct Stage newstage;
-	newstage.prog = prog;
-	newstage.args.push_back(prog);
-	newstage.args.push_back(arg1);
-	newstage.args.push_back(arg2);
-	newstage.args.push_back(arg3);
-	newstage.withpath = true;
-	m_stages.push_back(newstage);
+	int saved_errno = errno;
+	char c = 0;
+	if (write(sigchld_fd(), &c, 1) < 0) { }
+	errno = saved_errno;
     }
 
-    /**
-     * Add an execp() stage to the pipe with given arguments. The PATH variable
-     * is search for programs not containing a slash / character. The vector of
-     * arguments is not copied, so it must still exist when run() is
-     * called. Note that the program called is args[0].
-     */
-    void add_execp(const std::vector<std::string>* args)
+    /// Launch one stage in the server process and send the reply.
+    static void serve_request(int sock, std::vector<char>& msg, ssize_t len,
+			      int* fds, unsigned int nfds,
+			      std::map<pid_t,int>& children)
     {
-	assert(args->size() > 0);
-	if (args->size() == 0) return;
+	Reader rd;
+	rd.p = &msg[0];
+	rd.end = &msg[0] + len;
 
-	struct Stage newstage;
-	newstage.prog = (*args)[0].c_str();
-	newstage.argsp = args;
-	newstage.withpath = true;
-	m_stages.push_back(newstage);
-    }
+	unsigned int flags = 0, argc = 0, envc = 0;
+	std::vector<char*> strs;
 
-    /**
-     * Add an exece() stage to the pipe with the given arguments and
-     * environments. This is the most flexible exec() call. The vector of
-     * arguments and environment variables is not copied, so it must still
-     * exist when run() is called. The env vector pointer may be NULL, the args
-     * vector must not be NULL. The args[0] is _not_ override with path, so you
-     * can fake program name calls.
-     */
-    void add_exece(const char* path,
-		   const std::vector<std::string>* argsp,
-		   const std::vector<std::string>* envp)
+	int reply[2] = { -1, EINVAL };
+
+	// message: flags, prog, cwd, argc, args, envc, env.
+	if (!rd.get_u32(flags) || !rd.get_strlist(strs, 2) ||
+	    !rd.get_u32(argc) || !rd.get_strlist(strs, argc) ||
+	    !rd.get_u32(envc) || !rd.get_strlist(strs, envc) ||
+	    nfds != 1u + ((flags & F_STDIN) ? 1u : 0u) + ((flags & F_STDOUT) ? 1u : 0u))
+	{
+	    for (unsigned int i = 0; i < nfds; ++i) close(fds[i]);
+	    send(sock, reply, sizeof(reply), MSG_NOSIGNAL);
+	    return;
+	}
+
+	std::vector<char*> argv(strs.begin() + 2, strs.begin() + 2 + argc);
+	argv.push_back(NULL);
+
+	std::vector<char*> envv(strs.begin() + 2 + argc, strs.end());
+	envv.push_back(NULL);
+
+	int statusfd = fds[0];
+	int stdin_fd = (flags & F_STDIN) ? fds[1] : -1;
+	int stdout_fd = (flags & F_STDOUT) ? fds[(flags & F_STDIN) ? 2 : 1] : -1;
+
+	int errpipe[2];
+	if (pipe_cloexec(errpipe) != 0)
+	{
+	    reply[1] = errno;
+	    for (unsigned int i = 0; i < nfds; ++i) close(fds[i]);
+	    send(sock, reply, sizeof(reply), MSG_NOSIGNAL);
+	    return;
+	}
+
+	pid_t child = fork();
+	if (child == 0)
+	{
+	    signal(SIGPIPE, SIG_DFL);
+	    signal(SIGCHLD, SIG_DFL);
+
+	    if (stdin_fd >= 0) {
+		if (stdin_fd == STDIN_FILENO) fcntl(STDIN_FILENO, F_SETFD, 0);
+		else if (dup2(stdin_fd, STDIN_FILENO) == -1) _exit(255);
+	    }
+	    if (stdout_fd >= 0) {
+		if (stdout_fd == STDOUT_FILENO) fcntl(STDOUT_FILENO, F_SETFD, 0);
+		else if (dup2(stdout_fd, STDOUT_FILENO) == -1) _exit(255);
+	    }
+
+	    close_from(STDERR_FILENO + 1, errpipe[1]);
+
+	    int err = 0;
+	    if (chdir(strs[1]) != 0) err = errno;
+
+	    if (!err)
+	    {
+		environ = &envv[0];
+
+		if (flags & F_PATH)
+		    execvp(strs[0], &argv[0]);
+		else
+		    execv(strs[0], &argv[0]);
+
+		err = errno;
+	    }
+
+	    if (write(errpipe[1], &err, sizeof(err)) < 0) { }
+	    _exit(255);
+	}
+
+	close(errpipe[1]);
+	if (stdin_fd >= 0) close(stdin_fd);
+	if (stdout_fd >= 0) close(stdout_fd);
+
+	if (child < 0)
+	{
+	    reply[1] = errno;
+	    close(errpipe[0]);
+	    close(statusfd);
+	    send(sock, reply, sizeof(reply), MSG_NOSIGNAL);
+	    return;
+	}
+
+	// the error pipe is closed by a successful exec().
+	int err = 0;
+	ssize_t rb;
+	while ((rb = read(errpipe[0], &err, sizeof(err))) < 0 && errno == EINTR) { }
+	close(errpipe[0]);
+
+	if (rb > 0)
+	{
+	    int status;
+	    while (waitpid(child, &status, 0) < 0 && errno == EINTR) { }
+	    close(statusfd);
+
+	    reply[0] = -1;
+	    reply[1] = err;
+	}
+	else
+	{
+	    children[child] = statusfd;
+
+	    reply[0] = child;
+	    reply[1] = 0;
+	}
+
+	send(sock, reply, sizeof(reply), MSG_NOSIGNAL);
+    }
+
+    /// Collect exited children and report their status.
+    static void reap_children(std::map<pid_t,int>& children)
     {
-	assert(path && argsp);
-	assert(argsp->size() > 0);
-	if (argsp->size() == 0) return;
+	int status;
+	pid_t p;
 
-	struct Stage newstage;
-	newstage.prog = path;
-	newstage.argsp = argsp;
-	newstage.envp = envp;
-	m_stages.push_back(newstage);
+	while ((p = waitpid(-1, &status, WNOHANG)) > 0)
+	{
+	    std::map<pid_t,int>::iterator it = children.find(p);
+	    if (it == children.end()) continue;
+
+	    if (write(it->second, &status, sizeof(status)) < 0) { }
+	    close(it->second);
+
+	    children.erase(it);
+	}
     }
 
-    /**
-     * Add a function stage to the pipe. This function object will be called in
-     * the parent process with data passing through the stage. See PipeFunction
-     * for more information.
-     */
-    void add_function(PipeFunction* func)
+    /// Main loop of the server process. Exits once the parent closed the
+    /// socket and all children were reaped.
+    static void serve(int sock)
     {
-	assert(func);
-	if (!func) return;
+	close_from(STDERR_FILENO + 1, sock);
 
-	func->m_impl = this;
-	func->m_stageid = m_stages.size();
+	int selfpipe[2];
+	if (pipe_cloexec(selfpipe) != 0) _exit(1);
 
-	struct Stage newstage;
-	newstage.func = func;
-	m_stages.push_back(newstage);
+	fcntl(selfpipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(selfpipe[1], F_SETFL, O_NONBLOCK);
+	sigchld_fd() = selfpipe[1];
+
+	signal(SIGPIPE, SIG_IGN);
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sigchld_handler;
+	sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	sigaction(SIGCHLD, &sa, NULL);
+
+	sigset_t empty;
+	sigemptyset(&empty);
+	sigprocmask(SIG_SETMASK, &empty, NULL);
+
+	std::map<pid_t,int> children;
+	std::vector<char> msg;
+
+	while (sock >= 0 || !children.empty())
+	{
+	    struct pollfd pfd[2];
+	    pfd[0].fd = selfpipe[0];
+	    pfd[0].events = POLLIN;
+	    pfd[1].fd = sock;
+	    pfd[1].events = POLLIN;
+
+	    if (poll(pfd, sock >= 0 ? 2 : 1, -1) < 0)
+	    {
+		if (errno == EINTR) continue;
+		_exit(1);
+	    }
+
+	    if (pfd[0].revents)
+	    {
+		char buf[64];
+		while (read(selfpipe[0], buf, sizeof(buf)) > 0) { }
+
+		reap_children(children);
+	    }
+
+	    if (sock >= 0 && pfd[1].revents)
+	    {
+		// peek at the message's length and receive it with its fds.
+		ssize_t len = recv(sock, NULL, 0, MSG_PEEK | MSG_TRUNC);
+		if (len <= 0)
+		{
+		    if (len < 0 && errno == EINTR) continue;
+
+		    // parent closed the socket.
+		    close(sock);
+		    sock = -1;
+		    reap_children(children);
+		    continue;
+		}
+
+		msg.resize(len + 1);
+
+		struct iovec iov;
+		iov.iov_base = &msg[0];
+		iov.iov_len = len;
+
+		union {
+		    struct cmsghdr	align;
+		    char		buf[CMSG_SPACE(3 * sizeof(int))];
+		} control;
+
+		struct msghdr mh;
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_iov = &iov;
+		mh.msg_iovlen = 1;
+		mh.msg_control = control.buf;
+		mh.msg_controllen = sizeof(control.buf);
+
+		len = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+		if (len < 0) continue;
+
+		int fds[3];
+		unsigned int nfds = 0;
+
+		for (struct cmsghdr* c = CMSG_FIRSTHDR(&mh); c; c = CMSG_NXTHDR(&mh, c))
+		{
+		    if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) continue;
+
+		    unsigned int n = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		    for (unsigned int i = 0; i < n && nfds < 3; ++i)
+			memcpy(&fds[nfds++], CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+		}
+
+		serve_request(sock, msg, len, fds, nfds, children);
+	    }
+	}
+
+	_exit(0);
     }
 
-    ///@}
+public:
+    ForkServer()
+	: m_sock(-1), m_pid(0)
+    {
+    }
 
-    /**
-     * Function called by PipeSource::write() to push data into the ring
-     * buffer.
-     */
-    void stage_function_write(unsigned int st, const void* data, unsigned int datalen)
+    /// Return the process-wide server instance.
+    static ForkServer& instance()
     {
-	assert(st < m_stages.size());
+	static ForkServer server;
+	return server;
+    }
 
-	return m_stages[st].outbuffer.write(data, datalen);
+    /// Return true if the server process was started.
+    bool running() const
+    {
+	return (m_sock >= 0);
     }
 
-    // *** Run Pipe ***
+    /// Fork the server process. Returns false with errno set on error.
+    bool start()
+    {
+	m_lock.lock();
 
-    /**
-     * Run the configured pipe sequence and wait for all children processes to
-     * complete. Returns a reference to *this for chaining.
-     *
-     * This function call should be wrapped into a try-catch block as it will
-     * throw() if a system call fails.
-     */
-    void run();
+	if (m_sock >= 0) {
+	    m_lock.unlock();
+	    return true;
+	}
 
-    // *** Inspection After Pipe Execution ***
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) != 0) {
+	    m_lock.unlock();
+	    return false;
+	}
 
-    ///@{ \name Inspect Return Codes
+	pid_t pid = fork();
+	if (pid < 0)
+	{
+	    int err = errno;
+	    close(sv[0]); close(sv[1]);
+	    m_lock.unlock();
+	    errno = err;
+	    return false;
+	}
+	else if (pid == 0)
+	{
+	    close(sv[0]);
+	    serve(sv[1]);
+	}
 
-    /**
-     * Get the return status of exec() stage's program run after pipe execution
-     * as indicated by wait().
-     */
-    int get_return_status(unsigned int stageid) const
-    {
-	assert(stageid < m_stages.size());
-	assert(!m_stages[stageid].func);
+	close(sv[1]);
 
-	return m_stages[stageid].retstatus;
+	m_sock = sv[0];
+	m_pid = pid;
+
+	m_lock.unlock();
+	return true;
     }
 
-    /**
-     * Get the return code of exec() stage's program run after pipe execution,
-     * or -1 if the program terminated abnormally.
-     */
-    int get_return_code(unsigned int stageid) const
+    /// Close the socket and wait for the server to finish its children.
+    void stop()
     {
-	assert(stageid < m_stages.size());
-	assert(!m_stages[stageid].func);
+	m_lock.lock();
 
-	if (WIFEXITED(m_stages[stageid].retstatus))
-	    return WEXITSTATUS(m_stages[stageid].retstatus);
-	else
-	    return -1;
+	if (m_sock >= 0)
+	{
+	    close(m_sock);
+	    m_sock = -1;
+
+	    int status;
+	    while (waitpid(m_pid, &status, 0) < 0 && errno == EINTR) { }
+	    m_pid = 0;
+	}
+
+	m_lock.unlock();
     }
 
     /**
-     * Get the signal of the abnormally terminated exec() stage's program run
-     * after pipe execution, or -1 if the program terminated normally.
+     * Ask the server to launch a program. The stdin_fd and stdout_fd are
+     * dup2()ed to the child's stdin and stdout if not -1. Returns the
+     * child's pid and the read end of its status pipe, or -1 with errno set.
      */
-    int get_return_signal(unsigned int stageid) const
+    pid_t spawn(const char* prog, bool withpath,
+		const char* const* argv, const char* const* envp,
+		int stdin_fd, int stdout_fd, int& statusfd)
     {
-	assert(stageid < m_stages.size());
-	assert(!m_stages[stageid].func);
+	statusfd = -1;
 
-	if (WIFSIGNALED(m_stages[stageid].retstatus))
-	    return WTERMSIG(m_stages[stageid].retstatus);
+	char cwd[PATH_MAX];
+	if (!getcwd(cwd, sizeof(cwd)))
+	    return -1;
+
+	// encode request: flags, prog, cwd, argc, args, envc, env.
+	std::string m;
+	put_u32(m, (stdin_fd >= 0 ? F_STDIN : 0) | (stdout_fd >= 0 ? F_STDOUT : 0)
+		| (withpath ? F_PATH : 0));
+
+	put_str(m, prog);
+	put_str(m, cwd);
+
+	unsigned int argc = 0, envc = 0;
+	while (argv[argc]) ++argc;
+	while (envp[envc]) ++envc;
+
+	put_u32(m, argc);
+	for (unsigned int i = 0; i < argc; ++i)
+	    put_str(m, argv[i]);
+
+	put_u32(m, envc);
+	for (unsigned int i = 0; i < envc; ++i)
+	    put_str(m, envp[i]);
+
+	int statuspipe[2];
+	if (pipe_cloexec(statuspipe) != 0)
+	    return -1;
+
+	int fds[3];
+	unsigned int nfds = 0;
+	fds[nfds++] = statuspipe[1];
+	if (stdin_fd >= 0) fds[nfds++] = stdin_fd;
+	if (stdout_fd >= 0) fds[nfds++] = stdout_fd;
+
+	struct iovec iov;
+	iov.iov_base = const_cast<char*>(m.data());
+	iov.iov_len = m.size();
+
+	union {
+	    struct cmsghdr	align;
+	    char		buf[CMSG_SPACE(3 * sizeof(int))];
+	} control;
+	memset(&control, 0, sizeof(control));
+
+	struct msghdr mh;
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = control.buf;
+	mh.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+
+	struct cmsghdr* c = CMSG_FIRSTHDR(&mh);
+	c->cmsg_level = SOL_SOCKET;
+	c->cmsg_type = SCM_RIGHTS;
+	c->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+	memcpy(CMSG_DATA(c), fds, nfds * sizeof(int));
+
+	int reply[2] = { -1, EPIPE };
+
+	m_lock.lock();
+
+	ssize_t r = -1;
+	if (m_sock >= 0)
+	{
+	    while ((r = sendmsg(m_sock, &mh, MSG_NOSIGNAL)) < 0 && errno == EINTR) { }
+
+	    if (r >= 0)
+	    {
+		while ((r = recv(m_sock, reply, sizeof(reply), 0)) < 0 && errno == EINTR) { }
+		if (r != sizeof(reply)) { r = -1; errno = EPIPE; }
+	    }
+	}
 	else
+	{
+	    errno = ESRCH;
+	}
+
+	m_lock.unlock();
+
+	int err = errno;
+	close(statuspipe[1]);
+
+	if (r < 0 || reply[0] < 0)
+	{
+	    close(statuspipe[0]);
+	    errno = (r < 0) ? err : reply[1];
 	    return -1;
+	}
+
+	statusfd = statuspipe[0];
+	return reply[0];
     }
+};
 
-    /**
-     * Return true if the return code of all exec() stages were zero.
-     */
-    bool all_return_codes_zero() const
+} // namespace <anonymous>
+
+/// namespace containing the event loop backends
+namespace {
+
+/**
+ * Poller is the abstract event loop backend used by ExecPipeImpl::run() to
+ * wait for file descriptors.
+ *
+ * The run() loop declares the events it is interested in for each file
+ * descriptor via watch(). The backend keeps this interest set persistently
+ * between calls and only has to update its state when the interest of a file
+ * descriptor actually changes. After wait() returns, the events ready on a
+ * file descriptor are queried using ready().
+ *
+ * A file descriptor must be removed from the interest set using watch(fd, 0)
+ * before it is closed, otherwise a recycled descriptor number would inherit
+ * the stale interest.
+ */
+class Poller
+{
+public:
+    /// Event flags used in watch() and ready().
+    enum { PL_READ = ExecPipe::PL_READ, PL_WRITE = ExecPipe::PL_WRITE };
+
+protected:
+    /// current interest mask indexed by file descriptor.
+    std::vector<unsigned char>	m_interest;
+
+    /// ready events indexed by file descriptor, valid after wait().
+    std::vector<unsigned char>	m_ready;
+
+    /// list of file descriptors marked in m_ready by the last wait().
+    std::vector<int>		m_readylist;
+
+    /// Update the interest mask and return the previous one.
+    inline int set_interest(int fd, int events)
     {
-	for (unsigned int i = 0; i < m_stages.size(); ++i)
+	assert(fd >= 0);
+
+	if (static_cast<unsigned int>(fd) >= m_interest.size())
 	{
-	    if (m_stages[i].func) continue;
+	    if (events == 0) return 0;
+	    m_interest.resize(fd + 1, 0);
+	    m_ready.resize(fd + 1, 0);
+	}
 
-	    if (get_return_code(i) != 0)
-		return false;
+	int old = m_interest[fd];
+	m_interest[fd] = events;
+	m_ready[fd] = 0;
+	return old;
+    }
+
+    /// Clear all ready marks of the previous wait().
+    inline void clear_ready()
+    {
+	for (std::vector<int>::const_iterator it = m_readylist.begin();
+	     it != m_readylist.end(); ++it)
+	{
+	    m_ready[*it] = 0;
 	}
+	m_readylist.clear();
+    }
 
-	return true;
+    /// Mark events as ready on fd, restricted to the current interest.
+    inline void mark_ready(int fd, int events)
+    {
+	events &= m_interest[fd];
+	if (!events) return;
+
+	if (!m_ready[fd]) m_readylist.push_back(fd);
+	m_ready[fd] |= events;
     }
 
-    ///@}
+public:
+    /// Virtual destructor for derived classes.
+    virtual ~Poller()
+    {
+    }
 
-protected:
+    /// Name of the backend for debug output.
+    virtual const char* name() const = 0;
 
-    // *** Helper Function for run() ***
+    /// Type of the backend, or PE_AUTO if driven by an external event loop.
+    virtual enum ExecPipe::PollEngine engine() const = 0;
 
-    /// Transform arguments and launch an exec stage using the correct exec()
-    /// variant.
-    void	exec_stage(const Stage& stage);
+    /// Set the interest events for the file descriptor. Zero removes the file
+    /// descriptor from the interest set.
+    virtual void watch(int fd, int events) = 0;
 
-    /// Print all arguments of exec() call.
-    void	print_exec(const std::vector<std::string>& args);
+    /// Remove a file descriptor from the interest set before it is closed. The
+    /// backend must not hold any reference to the file afterwards.
+    virtual void unwatch(int fd)
+    {
+	watch(fd, 0);
+    }
 
-    /// Safe close() call and output error if fd was already closed.
-    void	sclose(int fd);
-};
+    /// Wait for events on the interest set for at most timeout milliseconds,
+    /// or indefinitely if timeout is -1. Returns the number of ready file
+    /// descriptors.
+    virtual int wait(int timeout) = 0;
 
-// --- ExecPipeImpl ----------------------------------------------------- //
+    /// Return the number of system calls saved by batching, compared to
+    /// issuing each registration change and wait separately.
+    virtual unsigned long syscalls_saved() const
+    {
+	return 0;
+    }
 
-void ExecPipeImpl::print_exec(const std::vector<std::string>& args)
-{
-    std::ostringstream oss;
-    oss << "Exec()";
-    for (unsigned ai = 0; ai < args.size(); ++ai)
+    /// Return a buffer of size bytes for data transfers on fd done by the
+    /// backend itself, or NULL if the caller must wait for readiness and
+    /// read() or write() fd. The buffer stays assigned to fd until unwatch().
+    virtual char* transfer_buffer(int /* fd */, unsigned int& size)
     {
-	oss << " " << args[ai];
+	size = 0;
+	return NULL;
     }
-    LOG_INFO(oss.str());
+
+    /// Queue a read of at most len bytes into the transfer buffer of fd. A
+    /// later wait() marks fd ready for PL_READ once it completed.
+    virtual void read_async(int /* fd */, unsigned int /* len */)
+    {
+    }
+
+    /// Queue a write of the first len bytes of the transfer buffer of fd. A
+    /// later wait() marks fd ready for PL_WRITE once it completed.
+    virtual void write_async(int /* fd */, unsigned int /* len */)
+    {
+    }
+
+    /// Return true if a transfer on fd is in flight or its result was not
+    /// taken yet.
+    virtual bool busy(int /* fd */) const
+    {
+	return false;
+    }
+
+    /// Take the result of a completed transfer on fd: count is the number of
+    /// bytes or -1 with errno set, data points to the transfer buffer.
+    /// Returns false if no transfer completed on fd.
+    virtual bool result(int /* fd */, ssize_t& /* count */, char*& /* data */)
+    {
+	return false;
+    }
+
+    /// Return the events ready on the file descriptor after wait().
+    inline int ready(int fd) const
+    {
+	if (fd < 0 || static_cast<unsigned int>(fd) >= m_ready.size()) return 0;
+	return m_ready[fd];
+    }
+};
+
+/**
+ * Portable Poller backend using select(). The fd_sets are kept persistently
+ * and only copied for each select() call, however, select() still scans all
+ * descriptors up to the highest one and cannot handle any file descriptor
+ * larger than FD_SETSIZE.
+ */
+class SelectPoller : public Poller
+{
+private:
+    /// persistent read and write interest sets
+    fd_set		m_read_fds, m_write_fds;
+
+    /// highest file descriptor in the interest sets or -1.
+    int			m_max_fd;
+
+public:
+    /// Construct an empty interest set.
+    SelectPoller()
+	: m_max_fd(-1)
+    {
+	FD_ZERO(&m_read_fds);
+	FD_ZERO(&m_write_fds);
+    }
+
+    virtual const char* name() const
+    {
+	return "select";
+    }
+
+    virtual enum ExecPipe::PollEngine engine() const
+    {
+	return ExecPipe::PE_SELECT;
+    }
+
+    virtual void watch(int fd, int events)
+    {
+	if (events && fd >= FD_SETSIZE)
+	    throw(std::runtime_error("File descriptor exceeds FD_SETSIZE, cannot use select() backend."));
+
+	int old = set_interest(fd, events);
+	if (old == events) return;
+
+	if (events & PL_READ) FD_SET(fd, &m_read_fds);
+	else if (old & PL_READ) FD_CLR(fd, &m_read_fds);
+
+	if (events & PL_WRITE) FD_SET(fd, &m_write_fds);
+	else if (old & PL_WRITE) FD_CLR(fd, &m_write_fds);
+
+	if (events && fd > m_max_fd)
+	    m_max_fd = fd;
+	else if (!events && fd == m_max_fd)
+	{
+	    while (m_max_fd >= 0 && !m_interest[m_max_fd])
+		--m_max_fd;
+	}
+    }
+
+    virtual int wait(int timeout)
+    {
+	clear_ready();
+
+	fd_set read_fds = m_read_fds, write_fds = m_write_fds;
+
+	struct timeval tv, *tvp = NULL;
+	if (timeout >= 0)
+	{
+	    tv.tv_sec = timeout / 1000;
+	    tv.tv_usec = (timeout % 1000) * 1000;
+	    tvp = &tv;
+	}
+
+	int retval = select(m_max_fd+1, &read_fds, &write_fds, NULL, tvp);
+	if (retval < 0)
+	{
+	    if (errno == EINTR) return 0;
+	    throw(std::runtime_error(std::string("Error during select() on file descriptors: ") + strerror(errno)));
+	}
+
+	for (int fd = 0; fd <= m_max_fd; ++fd)
+	{
+	    if (FD_ISSET(fd, &read_fds)) mark_ready(fd, PL_READ);
+	    if (FD_ISSET(fd, &write_fds)) mark_ready(fd, PL_WRITE);
+	}
+
+	return m_readylist.size();
+    }
+};
+
+#if STX_EXECPIPE_HAVE_EPOLL
+
+/**
+ * Linux Poller backend using epoll(). The kernel holds the interest set and
+ * epoll_ctl() is only called when the interest of a file descriptor changes,
+ * thus each wakeup costs O(ready) instead of O(max fd).
+ */
+class EpollPoller : public Poller
+{
+private:
+    /// epoll instance file descriptor
+    int			m_epfd;
+
+    /// number of file descriptors in the interest set
+    unsigned int	m_count;
+
+    /// event array filled by epoll_wait()
+    std::vector<struct epoll_event> m_events;
+
+    /// regular files in the interest set, which epoll() rejects.
+    std::vector<int>	m_files;
+
+public:
+    /// Create the epoll instance, throws if the kernel does not support it.
+    EpollPoller()
+	: m_count(0)
+    {
+	m_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (m_epfd < 0)
+	    throw(std::runtime_error(std::string("Could not create epoll instance: ") + strerror(errno)));
+    }
+
+    /// Close the epoll instance.
+    ~EpollPoller()
+    {
+	close(m_epfd);
+    }
+
+    virtual const char* name() const
+    {
+	return "epoll";
+    }
+
+    virtual enum ExecPipe::PollEngine engine() const
+    {
+	return ExecPipe::PE_EPOLL;
+    }
+
+    virtual void watch(int fd, int events)
+    {
+	int old = set_interest(fd, events);
+	if (old == events) return;
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.data.fd = fd;
+	if (events & PL_READ) ev.events |= EPOLLIN;
+	if (events & PL_WRITE) ev.events |= EPOLLOUT;
+
+	// regular files cannot be added to epoll, they are always ready.
+	std::vector<int>::iterator fi = std::find(m_files.begin(), m_files.end(), fd);
+	if (fi != m_files.end())
+	{
+	    if (!events) m_files.erase(fi);
+	    return;
+	}
+
+	// EPOLLHUP and EPOLLERR are always reported, thus a file descriptor
+	// without interest must be removed from the set entirely.
+	int op = !old ? EPOLL_CTL_ADD : events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+
+	if (epoll_ctl(m_epfd, op, fd, &ev) != 0)
+	{
+	    if (errno == EPERM && op == EPOLL_CTL_ADD) {
+		m_files.push_back(fd);
+		return;
+	    }
+	    throw(std::runtime_error(std::string("Error during epoll_ctl() on file descriptor: ") + strerror(errno)));
+	}
+
+	if (!old) ++m_count;
+	else if (!events) --m_count;
+    }
+
+    virtual int wait(int timeout)
+    {
+	clear_ready();
+
+	m_events.resize(m_count > 0 ? m_count : 1);
+
+	// file descriptors of regular files are always ready.
+	for (std::vector<int>::const_iterator fi = m_files.begin();
+	     fi != m_files.end(); ++fi)
+	{
+	    mark_ready(*fi, PL_READ | PL_WRITE);
+	}
+
+	if (!m_readylist.empty()) timeout = 0;
+
+	int retval = epoll_wait(m_epfd, &m_events[0], m_events.size(), timeout);
+	if (retval < 0)
+	{
+	    if (errno == EINTR) return 0;
+	    throw(std::runtime_error(std::string("Error during epoll_wait() on file descriptors: ") + strerror(errno)));
+	}
+
+	for (int i = 0; i < retval; ++i)
+	{
+	    // hangup and errors are reported to select() as readable or
+	    // writable, map them accordingly.
+	    int fd = m_events[i].data.fd, events = 0;
+
+	    if (m_events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+		events |= PL_READ;
+	    if (m_events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+		events |= PL_WRITE;
+
+	    mark_ready(fd, events);
+	}
+
+	return m_readylist.size();
+    }
+};
+
+#endif // STX_EXECPIPE_HAVE_EPOLL
+
+#if STX_EXECPIPE_HAVE_IO_URING
+
+/**
+ * Linux Poller backend using io_uring. Registration changes, data transfers
+ * and the wait for events are queued as submission entries and passed to the
+ * kernel in a single io_uring_enter() call per loop turn.
+ *
+ * The parent's reads and writes of data pipes are queued as
+ * IORING_OP_READ_FIXED and IORING_OP_WRITE_FIXED requests on transfer
+ * buffers, which are registered with the kernel once instead of being mapped
+ * for each request. Each file descriptor with transfers holds one of
+ * XFER_SLOTS buffers until unwatch(). If none is free or the kernel refuses
+ * the registration, the caller polls for readiness instead. A kernel which
+ * completes a transfer on an O_NONBLOCK pipe with EAGAIN instead of waiting
+ * for data disables further transfers.
+ *
+ * One-shot IORING_OP_POLL_ADD requests are used for readiness, since
+ * multishot polls are edge-triggered and the run() loop relies on
+ * level-triggered readiness. Each poll request carries a per-fd generation
+ * number in its user_data, so that completions of cancelled or superseded
+ * requests are ignored.
+ *
+ * Pending poll requests and transfers hold a reference to the file, which
+ * would keep a pipe end open after close(). Therefore unwatch() synchronously
+ * cancels them before returning.
+ *
+ * At most one IORING_OP_TIMEOUT is armed. It expires at an absolute time and
+ * is kept by later waits with a later deadline, which wake up early and wait
+ * again. A new timeout is armed once its completion was reaped, or after
+ * removing it for an earlier deadline.
+ */
+class IoUringPoller : public Poller
+{
+private:
+    /// size and number of the registered transfer buffers
+    static const unsigned int XFER_SIZE = 65536, XFER_SLOTS = 16;
+
+    /// state of data transfers on a file descriptor
+    enum { XF_NONE, XF_READ, XF_WRITE, XF_DONE };
+
+    /// data transfer on a file descriptor
+    struct Transfer
+    {
+	/// assigned transfer buffer plus one, or zero
+	unsigned short	slot;
+
+	/// XF_NONE, in flight or completed with result res
+	unsigned char	state;
+
+	/// ready event reported for the completed transfer
+	unsigned char	events;
+
+	/// contained in m_xdone
+	bool		listed;
+
+	/// completion result, number of bytes or negative errno
+	int		res;
+
+	Transfer()
+	    : slot(0), state(XF_NONE), events(0), listed(false), res(0)
+	{
+	}
+    };
+
+    /// io_uring instance file descriptor
+    int			m_ringfd;
+
+    /// parameters filled by io_uring_setup()
+    struct io_uring_params m_params;
+
+    /// mapped submission and completion ring and submission entries
+    void		*m_sq_ptr, *m_cq_ptr;
+    size_t		m_sq_len, m_cq_len, m_sqes_len;
+    struct io_uring_sqe* m_sqes;
+
+    /// pointers into the mapped submission ring
+    unsigned int	*m_sq_head, *m_sq_tail, *m_sq_mask, *m_sq_array;
+
+    /// pointers into the mapped completion ring
+    unsigned int	*m_cq_head, *m_cq_tail, *m_cq_mask;
+    struct io_uring_cqe* m_cqes;
+
+    /// local submission tail and number of entries not yet submitted
+    unsigned int	m_sq_local_tail, m_sq_pending;
+
+    /// poll events currently armed in the kernel indexed by fd
+    std::vector<unsigned char>	m_armed;
+
+    /// generation of the current poll request indexed by fd
+    std::vector<unsigned int>	m_gen;
+
+    /// file descriptors whose one-shot poll fired and need re-arming
+    std::vector<int>		m_rearm;
+
+    /// ready events reaped outside of wait(), delivered by the next wait().
+    std::vector< std::pair<int,int> > m_deferred;
+
+    /// registered transfer buffers, or NULL if not registered
+    char*			m_xbuf;
+
+    /// true while transfers are queued instead of polling
+    bool			m_xfer_ok;
+
+    /// data transfers indexed by fd
+    std::vector<Transfer>	m_xfer;
+
+    /// unassigned transfer buffers
+    std::vector<unsigned int>	m_xfree;
+
+    /// file descriptors with completed transfers whose result was not taken
+    std::vector<int>		m_xdone;
+
+    /// absolute expiry time of the armed IORING_OP_TIMEOUT request
+    struct __kernel_timespec	m_timeout;
+
+    /// whether a timeout is armed and its generation, removed timeouts
+    /// complete with an older one.
+    bool		m_timeout_armed;
+    unsigned int	m_timeout_gen;
+
+    /// statistics: registration changes, transfers, waits and
+    /// io_uring_enter() calls
+    unsigned long	m_ops, m_xfers, m_waits, m_enters;
+
+    /// user_data tags of non-poll requests
+    static const unsigned long long TAG_REMOVE = 1ULL << 63;
+    static const unsigned long long TAG_TIMEOUT = 1ULL << 62;
+    static const unsigned long long TAG_XFER = 1ULL << 61;
+    static const unsigned long long TAG_CANCEL = 1ULL << 60;
+
+    /// Compose user_data of a poll request on fd.
+    inline unsigned long long poll_tag(int fd) const
+    {
+	return (static_cast<unsigned long long>(m_gen[fd] & 0x0FFFFFFF) << 32) | fd;
+    }
+
+    /// Return the transfer buffer of a slot.
+    inline char* slot_buffer(unsigned int slot) const
+    {
+	return m_xbuf + (slot - 1) * XFER_SIZE;
+    }
+
+    /// Enlarge the per-fd arrays to contain fd.
+    void grow(int fd)
+    {
+	assert(fd >= 0);
+
+	if (static_cast<unsigned int>(fd) >= m_armed.size())
+	{
+	    m_armed.resize(fd + 1, 0);
+	    m_gen.resize(fd + 1, 0);
+	    m_xfer.resize(fd + 1);
+	}
+
+	// completed transfers are marked ready without poll interest.
+	if (static_cast<unsigned int>(fd) >= m_interest.size())
+	{
+	    m_interest.resize(fd + 1, 0);
+	    m_ready.resize(fd + 1, 0);
+	}
+    }
+
+    /// Call io_uring_enter() to submit pending entries and wait for
+    /// min_complete completions. Returns false if interrupted by a signal.
+    bool enter(unsigned int min_complete)
+    {
+	__atomic_store_n(m_sq_tail, m_sq_local_tail, __ATOMIC_RELEASE);
+
+	int r = syscall(__NR_io_uring_enter, m_ringfd, m_sq_pending, min_complete,
+			min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	++m_enters;
+
+	if (r < 0)
+	{
+	    if (errno == EINTR) return false;
+	    if (errno == EAGAIN || errno == EBUSY) return true;
+	    throw(std::runtime_error(std::string("Error during io_uring_enter(): ") + strerror(errno)));
+	}
+
+	m_sq_pending -= r;
+	return true;
+    }
+
+    /// Return a cleared submission entry, flushing the ring if it is full.
+    struct io_uring_sqe* get_sqe()
+    {
+	if (m_sq_local_tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) >= m_params.sq_entries)
+	    enter(0);
+
+	unsigned int idx = m_sq_local_tail & *m_sq_mask;
+	m_sq_array[idx] = idx;
+	++m_sq_local_tail;
+	++m_sq_pending;
+
+	struct io_uring_sqe* sqe = &m_sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+    }
+
+    /// Queue a poll request for fd with the given events.
+    void arm(int fd, int events)
+    {
+	struct io_uring_sqe* sqe = get_sqe();
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = ((events & PL_READ) ? POLLIN : 0) | ((events & PL_WRITE) ? POLLOUT : 0);
+	sqe->user_data = poll_tag(fd);
+	m_armed[fd] = events;
+    }
+
+    /// Queue cancellation of the armed poll request on fd.
+    void disarm(int fd)
+    {
+	struct io_uring_sqe* sqe = get_sqe();
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = poll_tag(fd);
+	sqe->user_data = TAG_REMOVE | fd;
+	m_armed[fd] = 0;
+	++m_gen[fd];
+    }
+
+    /// Queue a READ_FIXED or WRITE_FIXED request of len bytes on the
+    /// transfer buffer of fd.
+    void transfer(int fd, unsigned char opcode, unsigned int len)
+    {
+	Transfer& xf = m_xfer[fd];
+	assert(xf.slot && xf.state == XF_NONE && len <= XFER_SIZE);
+
+	struct io_uring_sqe* sqe = get_sqe();
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->off = static_cast<unsigned long long>(-1); // current file position
+	sqe->addr = reinterpret_cast<unsigned long>(slot_buffer(xf.slot));
+	sqe->len = len;
+	sqe->buf_index = xf.slot - 1;
+	sqe->user_data = TAG_XFER | fd;
+
+	xf.state = (opcode == IORING_OP_READ_FIXED) ? XF_READ : XF_WRITE;
+	++m_xfers;
+    }
+
+    /// Queue a timeout expiring at the absolute monotonic time deadline,
+    /// unless an earlier one is armed.
+    void arm_timeout(const struct __kernel_timespec& deadline)
+    {
+	if (m_timeout_armed)
+	{
+	    if (m_timeout.tv_sec < deadline.tv_sec ||
+		(m_timeout.tv_sec == deadline.tv_sec && m_timeout.tv_nsec <= deadline.tv_nsec))
+		return;
+
+	    struct io_uring_sqe* sqe = get_sqe();
+	    sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+	    sqe->fd = -1;
+	    sqe->addr = TAG_TIMEOUT | m_timeout_gen;
+	    sqe->user_data = TAG_CANCEL;
+	}
+
+	++m_timeout_gen;
+	m_timeout = deadline;
+
+	struct io_uring_sqe* sqe = get_sqe();
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->fd = -1;
+	sqe->addr = reinterpret_cast<unsigned long>(&m_timeout);
+	sqe->len = 1;
+	sqe->timeout_flags = IORING_TIMEOUT_ABS;
+	sqe->user_data = TAG_TIMEOUT | m_timeout_gen;
+
+	m_timeout_armed = true;
+    }
+
+    /// Process all available completions. If remove_fd is not -1, returns
+    /// true when the cancellation of that fd's poll was seen.
+    bool reap(bool defer, int remove_fd = -1)
+    {
+	bool found = false;
+	unsigned int head = *m_cq_head;
+	unsigned int tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+
+	for (; head != tail; ++head)
+	{
+	    const struct io_uring_cqe& cqe = m_cqes[head & *m_cq_mask];
+
+	    if (cqe.user_data & TAG_TIMEOUT)
+	    {
+		if (cqe.user_data == (TAG_TIMEOUT | m_timeout_gen))
+		    m_timeout_armed = false;
+		continue;
+	    }
+
+	    if (cqe.user_data & TAG_REMOVE)
+	    {
+		if (static_cast<int>(cqe.user_data & 0xFFFFFFFF) == remove_fd)
+		    found = true;
+		continue;
+	    }
+
+	    if (cqe.user_data & TAG_CANCEL) continue;
+
+	    int fd = cqe.user_data & 0xFFFFFFFF;
+
+	    if (fd < 0 || static_cast<unsigned int>(fd) >= m_gen.size()) continue;
+
+	    if (cqe.user_data & TAG_XFER)
+	    {
+		Transfer& xf = m_xfer[fd];
+
+		xf.events = (xf.state == XF_READ) ? PL_READ : PL_WRITE;
+		xf.state = XF_DONE;
+		xf.res = cqe.res;
+
+		// the kernel does not wait for O_NONBLOCK files.
+		if (cqe.res == -EAGAIN)
+		    m_xfer_ok = false;
+
+		if (!xf.listed)
+		{
+		    m_xdone.push_back(fd);
+		    xf.listed = true;
+		}
+		continue;
+	    }
+
+	    if (cqe.user_data != poll_tag(fd)) continue; // stale generation
+
+	    m_armed[fd] = 0;
+	    m_rearm.push_back(fd);
+
+	    if (cqe.res <= 0) continue;
+
+	    int events = 0;
+	    if (cqe.res & (POLLIN | POLLHUP | POLLERR)) events |= PL_READ;
+	    if (cqe.res & (POLLOUT | POLLHUP | POLLERR)) events |= PL_WRITE;
+
+	    if (defer)
+		m_deferred.push_back(std::make_pair(fd, events));
+	    else
+		mark_ready(fd, events);
+	}
+
+	__atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+	return found;
+    }
+
+    /// Mark file descriptors with completed transfers ready until their
+    /// result is taken.
+    void deliver_transfers()
+    {
+	unsigned int j = 0;
+
+	for (unsigned int i = 0; i < m_xdone.size(); ++i)
+	{
+	    int fd = m_xdone[i];
+	    Transfer& xf = m_xfer[fd];
+
+	    if (xf.state != XF_DONE)
+	    {
+		xf.listed = false;
+		continue;
+	    }
+
+	    if (!m_ready[fd]) m_readylist.push_back(fd);
+	    m_ready[fd] |= xf.events;
+
+	    m_xdone[j++] = fd;
+	}
+
+	m_xdone.resize(j);
+    }
+
+    /// Register the transfer buffers, transfers stay disabled on failure.
+    void register_buffers()
+    {
+	// the current file position is needed for offset -1.
+	if (!(m_params.features & IORING_FEAT_RW_CUR_POS)) return;
+
+	void* xbuf = mmap(NULL, XFER_SIZE * XFER_SLOTS, PROT_READ | PROT_WRITE,
+			  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (xbuf == MAP_FAILED) return;
+
+	struct iovec iov[XFER_SLOTS];
+	for (unsigned int i = 0; i < XFER_SLOTS; ++i)
+	{
+	    iov[i].iov_base = static_cast<char*>(xbuf) + i * XFER_SIZE;
+	    iov[i].iov_len = XFER_SIZE;
+	}
+
+	if (syscall(__NR_io_uring_register, m_ringfd, IORING_REGISTER_BUFFERS, iov, XFER_SLOTS) != 0)
+	{
+	    munmap(xbuf, XFER_SIZE * XFER_SLOTS);
+	    return;
+	}
+
+	m_xbuf = static_cast<char*>(xbuf);
+	m_xfer_ok = true;
+
+	for (unsigned int i = XFER_SLOTS; i > 0; --i)
+	    m_xfree.push_back(i);
+    }
+
+public:
+    /// Set up the io_uring instance, throws if the kernel does not support it.
+    IoUringPoller()
+	: m_sq_ptr(MAP_FAILED), m_cq_ptr(MAP_FAILED), m_sqes(NULL),
+	  m_sq_local_tail(0), m_sq_pending(0),
+	  m_xbuf(NULL), m_xfer_ok(false),
+	  m_timeout_armed(false), m_timeout_gen(0),
+	  m_ops(0), m_xfers(0), m_waits(0), m_enters(0)
+    {
+	memset(&m_params, 0, sizeof(m_params));
+
+	m_ringfd = syscall(__NR_io_uring_setup, 256, &m_params);
+	if (m_ringfd < 0)
+	    throw(std::runtime_error(std::string("Could not create io_uring instance: ") + strerror(errno)));
+
+	m_sq_len = m_params.sq_off.array + m_params.sq_entries * sizeof(unsigned int);
+	m_cq_len = m_params.cq_off.cqes + m_params.cq_entries * sizeof(struct io_uring_cqe);
+
+	if (m_params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+	    if (m_cq_len > m_sq_len) m_sq_len = m_cq_len;
+	    m_cq_len = m_sq_len;
+	}
+
+	m_sq_ptr = mmap(NULL, m_sq_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, m_ringfd, IORING_OFF_SQ_RING);
+
+	if (m_sq_ptr != MAP_FAILED)
+	{
+	    if (m_params.features & IORING_FEAT_SINGLE_MMAP)
+		m_cq_ptr = m_sq_ptr;
+	    else
+		m_cq_ptr = mmap(NULL, m_cq_len, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, m_ringfd, IORING_OFF_CQ_RING);
+	}
+
+	m_sqes_len = m_params.sq_entries * sizeof(struct io_uring_sqe);
+	void* sqes = MAP_FAILED;
+
+	if (m_cq_ptr != MAP_FAILED)
+	    sqes = mmap(NULL, m_sqes_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, m_ringfd, IORING_OFF_SQES);
+
+	if (sqes == MAP_FAILED)
+	{
+	    int err = errno;
+	    release();
+	    throw(std::runtime_error(std::string("Could not map io_uring rings: ") + strerror(err)));
+	}
+
+	m_sqes = static_cast<struct io_uring_sqe*>(sqes);
+
+	char* sq = static_cast<char*>(m_sq_ptr);
+	m_sq_head = reinterpret_cast<unsigned int*>(sq + m_params.sq_off.head);
+	m_sq_tail = reinterpret_cast<unsigned int*>(sq + m_params.sq_off.tail);
+	m_sq_mask = reinterpret_cast<unsigned int*>(sq + m_params.sq_off.ring_mask);
+	m_sq_array = reinterpret_cast<unsigned int*>(sq + m_params.sq_off.array);
+
+	char* cq = static_cast<char*>(m_cq_ptr);
+	m_cq_head = reinterpret_cast<unsigned int*>(cq + m_params.cq_off.head);
+	m_cq_tail = reinterpret_cast<unsigned int*>(cq + m_params.cq_off.tail);
+	m_cq_mask = reinterpret_cast<unsigned int*>(cq + m_params.cq_off.ring_mask);
+	m_cqes = reinterpret_cast<struct io_uring_cqe*>(cq + m_params.cq_off.cqes);
+
+	m_sq_local_tail = *m_sq_tail;
+
+	register_buffers();
+    }
+
+    /// Unmap the rings and close the io_uring instance.
+    ~IoUringPoller()
+    {
+	release();
+    }
+
+    /// Unmap the rings and buffers and close the instance.
+    void release()
+    {
+	if (m_sqes) munmap(m_sqes, m_sqes_len);
+	if (m_cq_ptr != MAP_FAILED && m_cq_ptr != m_sq_ptr) munmap(m_cq_ptr, m_cq_len);
+	if (m_sq_ptr != MAP_FAILED) munmap(m_sq_ptr, m_sq_len);
+	close(m_ringfd);
+
+	if (m_xbuf) munmap(m_xbuf, XFER_SIZE * XFER_SLOTS);
+    }
+
+    virtual const char* name() const
+    {
+	return "io_uring";
+    }
+
+    virtual enum ExecPipe::PollEngine engine() const
+    {
+	return ExecPipe::PE_IO_URING;
+    }
+
+    virtual void watch(int fd, int events)
+    {
+	int old = set_interest(fd, events);
+	if (old == events) return;
+
+	++m_ops;
+
+	grow(fd);
+
+	if (m_armed[fd] && m_armed[fd] != events)
+	    disarm(fd);
+
+	if (events && !m_armed[fd])
+	    arm(fd, events);
+    }
+
+    virtual void unwatch(int fd)
+    {
+	if (fd < 0 || static_cast<unsigned int>(fd) >= m_armed.size())
+	    return watch(fd, 0);
+
+	bool armed = (m_armed[fd] != 0);
+
+	watch(fd, 0);
+
+	// wait until the kernel confirms the cancellation, which releases the
+	// file reference held by the poll request.
+	if (armed)
+	{
+	    while (!reap(true, fd))
+		enter(1);
+	}
+
+	if (m_xfer[fd].state == XF_READ || m_xfer[fd].state == XF_WRITE)
+	{
+	    struct io_uring_sqe* sqe = get_sqe();
+	    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	    sqe->fd = -1;
+	    sqe->addr = TAG_XFER | fd;
+	    sqe->user_data = TAG_CANCEL;
+
+	    // the transfer completes either cancelled or with its result.
+	    while (m_xfer[fd].state != XF_DONE)
+	    {
+		enter(1);
+		reap(true);
+	    }
+	}
+
+	Transfer& xf = m_xfer[fd];
+	xf.state = XF_NONE;
+
+	if (xf.slot)
+	{
+	    m_xfree.push_back(xf.slot);
+	    xf.slot = 0;
+	}
+    }
+
+    virtual int wait(int timeout)
+    {
+	clear_ready();
+
+	// re-arm one-shot polls which fired during the last round
+	for (std::vector<int>::const_iterator it = m_rearm.begin();
+	     it != m_rearm.end(); ++it)
+	{
+	    if (m_interest[*it] && !m_armed[*it])
+		arm(*it, m_interest[*it]);
+	}
+	m_rearm.clear();
+
+	for (unsigned int i = 0; i < m_deferred.size(); ++i)
+	    mark_ready(m_deferred[i].first, m_deferred[i].second);
+	m_deferred.clear();
+
+	deliver_transfers();
+
+	struct __kernel_timespec deadline = { 0, 0 };
+
+	if (timeout > 0)
+	{
+	    struct timespec now;
+	    clock_gettime(CLOCK_MONOTONIC, &now);
+
+	    deadline.tv_sec = now.tv_sec + timeout / 1000;
+	    deadline.tv_nsec = now.tv_nsec + (timeout % 1000) * 1000000L;
+	    if (deadline.tv_nsec >= 1000000000L)
+	    {
+		++deadline.tv_sec;
+		deadline.tv_nsec -= 1000000000L;
+	    }
+	}
+
+	++m_waits;
+
+	while (1)
+	{
+	    bool block = m_readylist.empty() && timeout != 0;
+
+	    if (block && timeout > 0)
+		arm_timeout(deadline);
+
+	    if (!enter(block ? 1 : 0))
+		break;
+
+	    reap(false);
+	    deliver_transfers();
+
+	    if (!block || !m_readylist.empty() || timeout < 0)
+		break;
+
+	    // woken by an earlier timeout or a stale completion.
+	    struct timespec now;
+	    clock_gettime(CLOCK_MONOTONIC, &now);
+
+	    if (now.tv_sec > deadline.tv_sec ||
+		(now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec))
+		break;
+	}
+
+	return m_readylist.size();
+    }
+
+    virtual unsigned long syscalls_saved() const
+    {
+	return (m_ops + m_xfers + m_waits > m_enters) ? m_ops + m_xfers + m_waits - m_enters : 0;
+    }
+
+    virtual char* transfer_buffer(int fd, unsigned int& size)
+    {
+	size = 0;
+	if (!m_xfer_ok) return NULL;
+
+	grow(fd);
+
+	Transfer& xf = m_xfer[fd];
+
+	if (!xf.slot)
+	{
+	    if (m_xfree.empty()) return NULL;
+
+	    xf.slot = m_xfree.back();
+	    m_xfree.pop_back();
+	}
+
+	size = XFER_SIZE;
+	return slot_buffer(xf.slot);
+    }
+
+    virtual void read_async(int fd, unsigned int len)
+    {
+	transfer(fd, IORING_OP_READ_FIXED, len);
+    }
+
+    virtual void write_async(int fd, unsigned int len)
+    {
+	transfer(fd, IORING_OP_WRITE_FIXED, len);
+    }
+
+    virtual bool busy(int fd) const
+    {
+	if (fd < 0 || static_cast<unsigned int>(fd) >= m_xfer.size()) return false;
+	return (m_xfer[fd].state != XF_NONE);
+    }
+
+    virtual bool result(int fd, ssize_t& count, char*& data)
+    {
+	if (fd < 0 || static_cast<unsigned int>(fd) >= m_xfer.size()) return false;
+
+	Transfer& xf = m_xfer[fd];
+	if (xf.state != XF_DONE) return false;
+
+	xf.state = XF_NONE;
+	data = slot_buffer(xf.slot);
+
+	if (xf.res < 0)
+	{
+	    errno = -xf.res;
+	    count = -1;
+	}
+	else
+	    count = xf.res;
+
+	return true;
+    }
+};
+
+#endif // STX_EXECPIPE_HAVE_IO_URING
+
+/**
+ * Poller backend for pipes embedded into an external event loop via
+ * ExecPipe::start(). It only keeps the interest set, which the caller reads
+ * via get_poll_fds() and registers with its own reactor. The ready events are
+ * passed in by ExecPipe::on_ready() instead of being waited for.
+ */
+class ExternalPoller : public Poller
+{
+public:
+    virtual const char* name() const
+    {
+	return "external";
+    }
+
+    virtual enum ExecPipe::PollEngine engine() const
+    {
+	return ExecPipe::PE_AUTO;
+    }
+
+    virtual void watch(int fd, int events)
+    {
+	set_interest(fd, events);
+    }
+
+    /// Never called, the caller's reactor waits instead.
+    virtual int wait(int /* timeout */)
+    {
+	return 0;
+    }
+
+    /// Mark events reported by the external event loop as ready on fd.
+    void set_ready(int fd, int events)
+    {
+	clear_ready();
+
+	if (fd >= 0 && static_cast<unsigned int>(fd) < m_interest.size())
+	    mark_ready(fd, events);
+    }
+
+    /// Clear the events after they were dispatched.
+    void reset_ready()
+    {
+	clear_ready();
+    }
+
+    /// Append all file descriptors with non-zero interest.
+    void interest_list(std::vector<ExecPipe::PollFd>& list) const
+    {
+	for (unsigned int fd = 0; fd < m_interest.size(); ++fd)
+	{
+	    if (!m_interest[fd]) continue;
+
+	    ExecPipe::PollFd pfd;
+	    pfd.fd = fd;
+	    pfd.events = m_interest[fd];
+	    list.push_back(pfd);
+	}
+    }
+};
+
+} // namespace <anonymous>
+
+#if STX_EXECPIPE_HAVE_THREADS
+
+/// namespace containing the worker threads of function stages, sources and
+/// sinks
+namespace {
+
+/**
+ * Bounded lock-free queue of pointers between exactly one producer and one
+ * consumer thread. Each index is written by only one side: the producer
+ * fills a slot before publishing it with a release store of m_tail, and the
+ * consumer's acquire load of m_tail therefore sees the slot's contents.
+ * Likewise the consumer's release store of m_head only hands a slot back for
+ * reuse after it was read. With more than one producer or consumer the
+ * plain read-modify-write of the own index races.
+ */
+template <typename Type>
+class SpscQueue
+{
+private:
+    /// number of slots, a power of two.
+    static const unsigned int	slots = 64;
+
+    /// ring of queued items.
+    Type*		m_ring[slots];
+
+    /// number of items popped, written only by the consumer.
+    unsigned int	m_head;
+
+    /// number of items pushed, written only by the producer.
+    unsigned int	m_tail;
+
+public:
+    SpscQueue()
+	: m_head(0), m_tail(0)
+    {
+    }
+
+    /// Append an item, returns false if the queue is full. Producer only.
+    bool push(Type* item)
+    {
+	unsigned int tail = m_tail;
+
+	if (tail - __atomic_load_n(&m_head, __ATOMIC_ACQUIRE) == slots)
+	    return false;
+
+	m_ring[tail % slots] = item;
+	__atomic_store_n(&m_tail, tail + 1, __ATOMIC_RELEASE);
+
+	return true;
+    }
+
+    /// Remove the oldest item, returns false if the queue is empty. Consumer
+    /// only.
+    bool pop(Type*& item)
+    {
+	unsigned int head = m_head;
+
+	if (head == __atomic_load_n(&m_tail, __ATOMIC_ACQUIRE))
+	    return false;
+
+	item = m_ring[head % slots];
+	__atomic_store_n(&m_head, head + 1, __ATOMIC_RELEASE);
+
+	return true;
+    }
+
+    /// True if no item can be pushed.
+    bool full() const
+    {
+	return (__atomic_load_n(&m_tail, __ATOMIC_ACQUIRE)
+		- __atomic_load_n(&m_head, __ATOMIC_ACQUIRE) == slots);
+    }
+
+    /// True if no item can be popped.
+    bool empty() const
+    {
+	return (__atomic_load_n(&m_tail, __ATOMIC_ACQUIRE)
+		== __atomic_load_n(&m_head, __ATOMIC_ACQUIRE));
+    }
+};
+
+/**
+ * Wakeup channel to another thread, based on an eventfd or, on other systems,
+ * a pipe. Notifications are counted, thus a notify() issued before the other
+ * thread waits is never lost.
+ */
+class Notifier
+{
+private:
+    /// read and write ends, identical for an eventfd.
+    int		m_fd[2];
+
+public:
+    /// Create the channel, whose read end is non-blocking if requested.
+    Notifier(bool nonblock)
+    {
+#if defined(__linux__)
+	m_fd[0] = m_fd[1] = eventfd(0, EFD_CLOEXEC | (nonblock ? EFD_NONBLOCK : 0));
+	if (m_fd[0] < 0)
+	    throw(std::runtime_error(std::string("Could not create eventfd: ") + strerror(errno)));
+#else
+	if (pipe_cloexec(m_fd) != 0)
+	    throw(std::runtime_error(std::string("Could not create pipe: ") + strerror(errno)));
+
+	// a full pipe already holds a pending notification.
+	fcntl(m_fd[1], F_SETFL, O_NONBLOCK);
+	if (nonblock)
+	    fcntl(m_fd[0], F_SETFL, O_NONBLOCK);
+#endif
+    }
+
+    ~Notifier()
+    {
+	close(m_fd[0]);
+	if (m_fd[1] != m_fd[0])
+	    close(m_fd[1]);
+    }
+
+    /// File descriptor which becomes readable on notification.
+    int fd() const
+    {
+	return m_fd[0];
+    }
+
+    /// Wake up the other thread.
+    void notify()
+    {
+#if defined(__linux__)
+	while (eventfd_write(m_fd[1], 1) != 0 && errno == EINTR) { }
+#else
+	char c = 0;
+	while (write(m_fd[1], &c, 1) < 0 && errno == EINTR) { }
+#endif
+    }
+
+    /// Wait for notifications and consume them, or only consume pending ones
+    /// if the channel is non-blocking.
+    void wait()
+    {
+#if defined(__linux__)
+	eventfd_t value;
+	while (eventfd_read(m_fd[0], &value) != 0 && errno == EINTR) { }
+#else
+	char buffer[64];
+	while (read(m_fd[0], buffer, sizeof(buffer)) < 0 && errno == EINTR) { }
+#endif
+    }
+};
+
+/**
+ * State of a user object running on its own thread. The event loop feeds
+ * input chunks through one queue and receives output chunks through the
+ * other, a source only uses the output and a sink only the input queue. Each
+ * side notifies the other after changing a queue.
+ */
+class ThreadWorker
+{
+public:
+    /// Enumeration of the user objects called by the thread.
+    enum Role
+    {
+	TW_FUNCTION, ///< PipeFunction of stage stageid.
+	TW_SOURCE,   ///< input PipeSource.
+	TW_SINK      ///< output PipeSink.
+    };
+    /// block of data passed between the threads.
+    typedef std::vector<char>	Chunk;
+
+    /// maximum size of output chunks, larger writes are split.
+    static const unsigned int	chunk_max = 64*1024;
+
+    /// input chunks read by the event loop.
+    SpscQueue<Chunk>	input;
+
+    /// output chunks written by the function.
+    SpscQueue<Chunk>	output;
+
+    /// wakes the worker thread.
+    Notifier		wake_worker;
+
+    /// wakes the event loop, watched by its backend.
+    Notifier		wake_loop;
+
+    /// set by the event loop after the last input chunk was pushed.
+    bool		input_eof;
+
+    /// set by the event loop to make the worker quit immediately.
+    bool		cancel;
+
+    /// set by the worker when it quits, before it notifies the loop.
+    bool		finished;
+
+    /// set by the event loop after joining the thread.
+    bool		joined;
+
+    /// message of an exception thrown by the function, read after joining.
+    std::string		error;
+
+    /// output chunk currently filled by the function.
+    Chunk*		outchunk;
+
+    /// thread handle.
+    pthread_t		thread;
+
+    /// pipe, object and stage of a function, passed to the thread.
+    class ExecPipeImpl*	impl;
+    enum Role		role;
+    unsigned int	stageid;
+
+    ThreadWorker(class ExecPipeImpl* ep, enum Role r, unsigned int st = 0)
+	: wake_worker(false), wake_loop(true),
+	  input_eof(false), cancel(false), finished(false), joined(false),
+	  outchunk(NULL), impl(ep), role(r), stageid(st)
+    {
+    }
+
+    /// Free all chunks left in the queues.
+    ~ThreadWorker()
+    {
+	Chunk* chunk;
+	while (input.pop(chunk)) delete chunk;
+	while (output.pop(chunk)) delete chunk;
+	delete outchunk;
+    }
+
+    /// Pop the next input chunk, waiting until one is available. Returns
+    /// NULL after the last chunk or on cancellation. Worker thread only.
+    Chunk* pop_input()
+    {
+	Chunk* chunk;
+
+	while (!__atomic_load_n(&cancel, __ATOMIC_ACQUIRE))
+	{
+	    // read input_eof before trying the queue, thus no chunk pushed
+	    // before the flag was set is missed.
+	    bool eof = __atomic_load_n(&input_eof, __ATOMIC_ACQUIRE);
+
+	    if (input.pop(chunk))
+	    {
+		wake_loop.notify();
+		return chunk;
+	    }
+
+	    if (eof) break;
+
+	    wake_worker.wait();
+	}
+
+	return NULL;
+    }
+
+    /// Append output data of the function to the current chunk. Worker
+    /// thread only.
+    void write(const void* data, unsigned int datalen)
+    {
+	const char* cdata = static_cast<const char*>(data);
+
+	while (datalen > 0)
+	{
+	    if (!outchunk)
+		outchunk = new Chunk;
+
+	    unsigned int room = chunk_max - outchunk->size();
+	    unsigned int len = (datalen < room) ? datalen : room;
+
+	    outchunk->insert(outchunk->end(), cdata, cdata + len);
+
+	    cdata += len;
+	    datalen -= len;
+
+	    if (outchunk->size() >= chunk_max)
+		flush();
+	}
+    }
+
+    /// Pass the current output chunk to the event loop, waiting while the
+    /// output queue is full. Worker thread only.
+    void flush()
+    {
+	if (!outchunk) return;
+
+	while (!output.push(outchunk))
+	{
+	    if (__atomic_load_n(&cancel, __ATOMIC_ACQUIRE))
+	    {
+		delete outchunk;
+		break;
+	    }
+
+	    wake_worker.wait();
+	}
+
+	outchunk = NULL;
+	wake_loop.notify();
+    }
+
+    /// Signal the worker that no more input follows. Event loop only.
+    void close_input()
+    {
+	// all chunks were pushed before input_eof is seen.
+	__atomic_store_n(&input_eof, true, __ATOMIC_RELEASE);
+	wake_worker.notify();
+    }
+
+    /// True once the worker quit and pushed all its output. Event loop only.
+    bool is_finished() const
+    {
+	return __atomic_load_n(&finished, __ATOMIC_ACQUIRE);
+    }
+
+    /// Make the worker quit as soon as possible, without calling eof().
+    /// Event loop only.
+    void interrupt()
+    {
+	__atomic_store_n(&cancel, true, __ATOMIC_RELEASE);
+	wake_worker.notify();
+    }
+
+    /// Interrupt the worker and wait for it, unless it was already joined.
+    /// Event loop only.
+    void stop()
+    {
+	if (joined) return;
+
+	interrupt();
+
+	pthread_join(thread, NULL);
+	joined = true;
+    }
+};
+
+} // namespace <anonymous>
+
+#else
+
+namespace {
+
+/// placeholder, user objects always run inline without threads.
+class ThreadWorker;
+
+} // namespace <anonymous>
+
+#endif // STX_EXECPIPE_HAVE_THREADS
+
+/**
+ * \brief Main library implementation (internal object)
+ *
+ * Implementation class for stx::ExecPipe. See the documentation of the
+ * front-end class for detailed information.
+ */
+class ExecPipeImpl
+{
+private:
+
+    /// reference counter, modified atomically
+    volatile unsigned int	m_refs;
+
+private:
+
+    // *** Debugging Output ***
+    
+    /// currently set debug level
+    enum ExecPipe::DebugLevel	m_debug_level;
+
+    /// current debug line output function
+    void		(*m_debug_output)(const char* line);
+
+public:
+
+    /// Change the current debug level. The default is DL_ERROR.
+    void set_debug_level(enum ExecPipe::DebugLevel dl)
+    {
+	m_debug_level = dl;
+    }
+
+    /// Change output function for debug messages. If set to NULL (the default)
+    /// the debug lines are printed to stdout.
+    void set_debug_output(void (*output)(const char *line))
+    {
+	m_debug_output = output;
+    }
+
+private:
+
+    /// Enumeration describing the currently set input or output stream type
+    enum StreamType
+    {
+	ST_NONE = 0,	///< no special redirection requested
+	ST_FD,		///< redirection to existing fd
+	ST_FILE,	///< redirection to file path
+	ST_STRING,	///< input/output directed by/to string
+	ST_OBJECT,	///< input/output attached to program object
+	ST_FILELIST	///< input concatenated from a list of files
+    };
+
+    /// describes the currently set input stream type
+    StreamType		m_input;
+
+    // *** Input Stream ***
+
+    /// for ST_FD the input fd given by the user. for ST_STRING and ST_FUNCTION
+    /// the pipe write fd of the parent process.
+    int			m_input_fd;
+
+    /// for ST_FILE the path of the input file.
+    const char* 	m_input_file;
+
+    /// for ST_STRING a pointer to the user-supplied std::string input stream
+    /// object.
+    const std::string*	m_input_string;
+
+    /// for ST_STRING the current position in the input stream object.
+    std::string::size_type m_input_string_pos;
+
+    /// for ST_STRING map the string's pages into the input pipe using
+    /// vmsplice() instead of copying them via write().
+    bool		m_input_vmsplice;
+
+    /// for ST_FILELIST a pointer to the user-supplied list of paths.
+    const std::vector<std::string>* m_input_files;
+
+    /// for ST_FILELIST the index of the next file to open.
+    unsigned int	m_input_files_pos;
+
+    /// for ST_FILELIST the currently opened input file or -1.
+    int			m_input_files_fd;
+
+    /// for ST_FILELIST whether splice() can be used, else data is copied via
+    /// m_input_rbuffer.
+    bool		m_input_files_splice;
+
+    /// for ST_OBJECT the input stream source object
+    PipeSource*		m_input_source;
+
+    /// for ST_OBJECT the input stream ring buffer
+    RingBuffer		m_input_rbuffer;
+
+    /// for ST_OBJECT set when poll() returned false.
+    bool		m_input_source_eof;
+
+    /// for ST_OBJECT the thread on which the source is polled.
+    enum ExecPipe::FunctionMode m_input_source_mode;
+
+    /// for ST_OBJECT in FM_THREAD mode the worker polling the source during
+    /// run().
+    ThreadWorker*	m_source_worker;
+
+    /// for ST_STRING, ST_OBJECT and ST_FILELIST the capacity of the input
+    /// pipe.
+    unsigned int	m_input_pipe_capacity;
+
+    // *** Output Stream ***
+
+    /// describes the currently set input stream type
+    StreamType		m_output;
+
+    /// for ST_FD the output fd given by the user. for ST_STRING and
+    /// ST_FUNCTION the pipe read fd of the parent process.
+    int			m_output_fd;
+
+    /// for ST_FILE the path of the output file.
+    const char*		m_output_file;
+
+    /// for ST_FILE the permission used in the open() call.
+    int			m_output_file_mode;
+
+    /// for ST_STRING a pointer to the user-supplied std::string output stream
+    /// object.
+    std::string*	m_output_string;
+
+    /// for ST_OBJECT the output stream source object
+    PipeSink*		m_output_sink;
+
+    /// for ST_OBJECT the thread on which the sink is called.
+    enum ExecPipe::FunctionMode m_output_sink_mode;
+
+    /// for ST_OBJECT in FM_THREAD mode the worker calling the sink during
+    /// run().
+    ThreadWorker*	m_sink_worker;
+
+    // *** Pipe Stages ***
+
+    /**
+     * Structure representing each stage in the pipe. Contains arguments,
+     * buffers and output variables.
+     */
+    struct Stage
+    {
+	/// List of program and arguments copied from simple add_exec() calls.
+	std::vector<std::string>	args;
+
+	/// Character pointer to program path called
+	const char*			prog;
+
+	/// Pointer to user list of program and arguments.
+	const std::vector<std::string>* argsp;
+
+	/// Pointer to environment list supplied by user.
+	const std::vector<std::string>* envp;
+
+	/// Pipe stage function object.
+	PipeFunction*			func;
+
+	/// Pipe stage observer object, which sees but does not modify data.
+	PipeSink*			observer;
+
+	/// Output stream buffer for function or copying observer object.
+	RingBuffer			outbuffer;
+
+	// *** Observer Stage Variables ***
+
+	/// tee() returned EAGAIN, wait for the output to become writable.
+	bool	tee_blocked;
+
+	/// tee() is not possible, copy data through outbuffer instead.
+	bool	tee_copy;
+
+	// *** Buffer Limit Variables ***
+
+	/// outbuffer size at which reading the stage's input is suspended, zero
+	/// for unlimited. Set to the pipe's default unless set by the user.
+	unsigned int	buffer_high;
+
+	/// outbuffer size at which reading the stage's input is resumed.
+	unsigned int	buffer_low;
+
+	/// whether buffer_high and buffer_low were set by the user.
+	bool		buffer_user;
+
+	/// reading input is suspended until outbuffer drains below buffer_low.
+	bool		throttled;
+
+	/// largest number of bytes held in outbuffer during run().
+	unsigned int	buffer_peak;
+
+	/// Set once the next stage closed its input early, after which output
+	/// of the function is discarded.
+	bool	broken;
+
+	/// Thread on which the function is run.
+	enum ExecPipe::FunctionMode	mode;
+
+	/// Worker thread state during run() in FM_THREAD mode, or NULL.
+	ThreadWorker*	worker;
+
+	/// Set while the worker thread has not finished processing.
+	bool	worker_busy;
+
+	// *** Exec Stages Variables ***
+
+	/// Call execp() variants.
+	bool	withpath;
+
+	/// Pid of the running child process
+	pid_t	pid;
+
+	/// Return status of wait() after child exit.
+	int	retstatus;
+
+	/// pidfd of the running child process, or -1.
+	int	pidfd;
+
+	/// Read end of the fork server's status pipe for the child, or -1.
+	int	statusfd;
+
+	/// Set once the child's exit status was collected.
+	bool	reaped;
+
+	/// errno of the failed exec() or launch of the child, zero otherwise.
+	int	exec_errno;
+
+	/// Whether a failure of the child aborts the pipe under FP_ABORT.
+	bool	critical;
+
+	/// Read end of the pipe carrying the saved state of an FM_PROCESS
+	/// function, or -1.
+	int	statefd;
+
+	/// State saved by the FM_PROCESS function in the worker process.
+	std::string	state;
+
+	/// Milliseconds the child may run before it is signaled, zero for none.
+	unsigned int	timeout;
+
+	/// Monotonic time at which the child is signaled, zero for none.
+	long long	deadline;
+
+	/// Monotonic time at which the timed out child is killed, zero for none.
+	long long	kill_time;
+
+	/// Set if the child was signaled because a deadline expired.
+	bool	timed_out;
+	
+	/// File descriptor for child stdin. This is dup2()-ed to STDIN.
+	int	stdin_fd;
+
+	/// File descriptor for child stdout. This is dup2()-ed to STDOUT.
+	int	stdout_fd;
+
+	// *** Launch Variables ***
+
+	/// NULL-terminated argument array passed to exec(), built by
+	/// prepare_exec() before launching.
+	std::vector<const char*>	cargs;
+
+	/// NULL-terminated environment array passed to exec(), empty if the
+	/// parent's environment is inherited.
+	std::vector<const char*>	cenv;
+
+	/// Path of an execp() stage's program resolved via the ExecCache, or
+	/// empty to let execvp() search PATH.
+	std::string			exec_path;
+
+	/// File descriptor of the program for fexecve(), or -1.
+	int				exec_fd;
+
+	/// Constructor reseting all variables.
+	Stage()
+	    : prog(NULL), argsp(NULL), envp(NULL), func(NULL), observer(NULL),
+	      tee_blocked(false), tee_copy(false),
+	      buffer_high(0), buffer_low(0), buffer_user(false),
+	      throttled(false), buffer_peak(0), broken(false),
+	      mode(ExecPipe::FM_INLINE), worker(NULL), worker_busy(false),
+	      withpath(false), pid(0), retstatus(0), pidfd(-1), statusfd(-1), reaped(false),
+	      exec_errno(0), critical(true), statefd(-1),
+	      timeout(0), deadline(0), kill_time(0), timed_out(false),
+	      stdin_fd(-1), stdout_fd(-1), exec_fd(-1)
+	{
+	}
+
+	/// True if the stage is processed in the parent process. FM_PROCESS
+	/// functions are run in a child like exec stages.
+	bool in_parent() const
+	{
+	    return ((func != NULL && mode != ExecPipe::FM_PROCESS) || observer != NULL);
+	}
+
+	/// Return the object receiving the data passing through the stage.
+	PipeSink* sink() const
+	{
+	    return func ? func : observer;
+	}
+
+	/// True if all input was processed, thus the output can be closed once
+	/// the outbuffer is drained.
+	bool input_done() const
+	{
+	    return (stdin_fd < 0 && !worker_busy);
+	}
+
+	/// Update the throttle state from the outbuffer's fill level and return
+	/// true if the stage's input may be read.
+	bool may_read()
+	{
+	    if (outbuffer.size() > buffer_peak)
+		buffer_peak = outbuffer.size();
+
+	    // without an output pipe nothing drains the outbuffer.
+	    if (buffer_high == 0 || stdout_fd < 0)
+		return true;
+
+	    if (outbuffer.size() >= buffer_high)
+		throttled = true;
+	    else if (outbuffer.size() <= buffer_low)
+		throttled = false;
+
+	    return !throttled;
+	}
+    };
+
+    /// typedef of list of pipe stages.
+    typedef std::vector<Stage> stagelist_type;
+
+    /// list of pipe stages.
+    stagelist_type	m_stages;
+
+    /// general buffer used for read() and write() calls, sized in run() to
+    /// the largest read chunk.
+    std::vector<char>	m_buffer;
+
+    // *** Read Chunk Size ***
+
+    /**
+     * Structure tracking the read() chunk size and the distribution of bytes
+     * returned by read() on one edge.
+     */
+    struct ReadChunk
+    {
+	/// current number of bytes requested per read().
+	unsigned int	size;
+
+	/// range within which the adaptive mode moves size.
+	unsigned int	min, max;
+
+	/// number of reads returning [2^k, 2^(k+1)) bytes in slot k.
+	std::vector<unsigned long>	histogram;
+
+	/// Constructor reseting all variables.
+	ReadChunk()
+	    : size(0), min(0), max(0)
+	{
+	}
+
+	/// Count a read() returning rb bytes and adapt the chunk size: grow
+	/// while reads come back full, shrink when they return only a trickle.
+	void update(size_t rb, bool adaptive)
+	{
+	    unsigned int k = 0;
+	    while ((rb >> 1) >= (static_cast<size_t>(1) << k)) ++k;
+
+	    if (histogram.size() <= k)
+		histogram.resize(k + 1, 0);
+
+	    histogram[k]++;
+
+	    if (!adaptive) return;
+
+	    if (rb >= size && size < max)
+		size = std::min(2 * size, max);
+	    else if (rb < size / 4 && size > min)
+		size = std::max(size / 2, min);
+	}
+    };
+
+    /// read() chunk size for all stages, or the adaptive mode's lower bound.
+    unsigned int	m_read_size;
+
+    /// adaptive mode's upper bound, zero for the edge's pipe capacity.
+    unsigned int	m_read_max;
+
+    /// whether the chunk size adapts to the data rate.
+    bool		m_read_adaptive;
+
+    /// read() chunk state per edge during the last run().
+    std::vector<ReadChunk>	m_read_chunk;
+
+    /// default high and low watermarks of the stages' output buffers.
+    unsigned int	m_buffer_high, m_buffer_low;
+
+    // *** Pipe Capacity ***
+
+    /// default requested capacity of all pipes, zero keeps the kernel default.
+    unsigned int	m_pipe_capacity;
+
+    /// requested capacity per edge overriding the default, zero if unset.
+    std::vector<unsigned int>	m_edge_capacity;
+
+    /// number of data path system calls issued during the last run()
+    unsigned long	m_syscall_count;
+
+    /// number of event loop waits during the last run()
+    unsigned long	m_poll_count;
+
+    /// capacity granted by the kernel per edge during the last run(), zero
+    /// for edges which were not pipes created by run().
+    std::vector<unsigned int>	m_edge_granted;
+
+    // *** Event Loop ***
+
+    /// requested event loop backend
+    enum ExecPipe::PollEngine	m_poll_engine;
+
+    /// requested method to launch exec stages
+    enum ExecPipe::LaunchEngine	m_launch_engine;
+
+    /// event loop backend instance used during run()
+    Poller*		m_poller;
+
+    /// whether m_poller was created by run() or is shared by an ExecPipePool.
+    bool		m_poller_owned;
+
+    /// vmsplice() of the input string is still possible during run().
+    bool		m_run_vmsplice;
+
+    /// system calls saved by the event loop backend during the last run()
+    unsigned long	m_syscalls_saved;
+
+    /// event loop backend used during the last run()
+    enum ExecPipe::PollEngine	m_poll_engine_used;
+
+    // *** Failure Policy ***
+
+    /// reaction to a failed critical exec stage
+    enum ExecPipe::FailurePolicy	m_failure_policy;
+
+    /// exec stage which failed and aborted the last run(), or -1.
+    int			m_failed_stage;
+
+    // *** Deadlines ***
+
+    /// milliseconds the whole pipe may run, zero for no limit.
+    unsigned int	m_timeout;
+
+    /// signal sent to exec stages whose deadline expired.
+    int			m_timeout_signal;
+
+    /// milliseconds after the timeout signal until SIGKILL is sent.
+    unsigned int	m_timeout_grace;
+
+    /// monotonic time at which the pipe is aborted, zero for none.
+    long long		m_deadline;
+
+    /// set if the pipe's deadline expired during the last run().
+    bool		m_timed_out;
+
+    /// set during run() if the pipe or a stage has a deadline.
+    bool		m_deadlines;
+
+    // *** External Event Loop ***
+
+    /// Enumeration of the states of a pipe driven by on_ready().
+    enum StepState {
+	SS_NONE,	///< not started or finished.
+	SS_EVENTS,	///< event loop running, see run_prepare().
+	SS_REAPING,	///< waiting for children without pidfd, see run_reap().
+	SS_POOLED	///< queued or running in an ExecPipePool.
+    };
+
+    /// state of the pipe launched by start() or added to a pool
+    enum StepState	m_step;
+
+    /// timeout returned by get_poll_fds()
+    int			m_step_timeout;
+
+public:
+
+    /// Create a new pipe implementation with zero reference counter.
+    ExecPipeImpl()
+	: m_refs(0),
+	  m_debug_level(ExecPipe::DL_ERROR),
+	  m_debug_output(NULL),
+	  m_input(ST_NONE),
+	  m_input_fd(-1),
+	  m_input_vmsplice(false),
+	  m_input_files_fd(-1),
+	  m_input_source_mode(ExecPipe::FM_INLINE),
+	  m_source_worker(NULL),
+	  m_output(ST_NONE),
+	  m_output_fd(-1),
+	  m_output_sink_mode(ExecPipe::FM_INLINE),
+	  m_sink_worker(NULL),
+	  m_read_size(4096), m_read_max(0), m_read_adaptive(true),
+	  m_buffer_high(4*1024*1024), m_buffer_low(1024*1024),
+	  m_pipe_capacity(0),
+	  m_syscall_count(0), m_poll_count(0),
+	  m_poll_engine(ExecPipe::PE_AUTO),
+	  m_launch_engine(ExecPipe::LE_AUTO),
+	  m_poller(NULL), m_poller_owned(true), m_run_vmsplice(false),
+	  m_syscalls_saved(0), m_poll_engine_used(ExecPipe::PE_AUTO),
+	  m_failure_policy(ExecPipe::FP_IGNORE),
+	  m_failed_stage(-1),
+	  m_timeout(0), m_timeout_signal(SIGTERM), m_timeout_grace(1000),
+	  m_deadline(0), m_timed_out(false), m_deadlines(false),
+	  m_step(SS_NONE), m_step_timeout(-1)
+    {
+    }
+
+    /// Free the event loop backend and worker threads if left over by an
+    /// exception in run().
+    ~ExecPipeImpl()
+    {
+	stop_workers();
+	if (m_poller && m_poller_owned) delete m_poller;
+    }
+
+    /// Atomically increment the reference counter.
+    void ref()
+    {
+	__sync_add_and_fetch(&m_refs, 1);
+    }
+
+    /// Atomically decrement the reference counter and return true if it
+    /// dropped to zero.
+    bool unref()
+    {
+	return (__sync_sub_and_fetch(&m_refs, 1) == 0);
+    }
+
+    /// Select the event loop backend used by run().
+    void set_poll_engine(enum ExecPipe::PollEngine pe)
+    {
+	m_poll_engine = pe;
+    }
+
+    /// Select the method used by run() to launch exec stages.
+    void set_launch_engine(enum ExecPipe::LaunchEngine le)
+    {
+	m_launch_engine = le;
+    }
+
+    // *** Input Selectors ***
+
+    ///@{ \name Input Selectors
+
+    /**
+     * Assign an already opened file descriptor as input stream for the first
+     * exec stage.
+     */
+    void set_input_fd(int fd)
+    {
+	assert(m_input == ST_NONE);
+	if (m_input != ST_NONE) return;
+
+	m_input = ST_FD;
+	m_input_fd = fd;
+    }
+
+    /**
+     * Assign a file as input stream source. This file will be opened read-only
+     * and read by the first exec stage.
+     */
+    void set_input_file(const char* path)
+    {
+	assert(m_input == ST_NONE);
+	if (m_input != ST_NONE) return;
+
+	m_input = ST_FILE;
+	m_input_file = path;
+    }    
+
+    /**
+     * Assign a std::string as input stream source. The contents of the string
+     * will be written to the first exec stage. The string object is not copied
+     * and must still exist when run() is called. With zerocopy the string's
+     * pages are mapped into the pipe via vmsplice(), so it must not be
+     * modified until run() returns.
+     */
+    void set_input_string(const std::string* input, bool zerocopy = false)
+    {
+	assert(m_input == ST_NONE);
+	if (m_input != ST_NONE) return;
+
+	m_input = ST_STRING;
+	m_input_string = input;
+	m_input_string_pos = 0;
+	m_input_vmsplice = zerocopy;
+    }
+
+    /**
+     * Assign a list of files as input stream source. The files are
+     * concatenated in order and moved into the first stage's input pipe using
+     * splice(). Only one file is open at a time. The vector is not copied and
+     * must still exist when run() is called.
+     */
+    void set_input_files(const std::vector<std::string>* paths)
+    {
+	assert(m_input == ST_NONE);
+	if (m_input != ST_NONE) return;
+
+	m_input = ST_FILELIST;
+	m_input_files = paths;
+    }
+
+    /**
+     * Assign a PipeSource as input stream source. The object will be queried
+     * via the read() function for data which is then written to the first exec
+     * stage.
+     */
+    void set_input_source(PipeSource* source, enum ExecPipe::FunctionMode fm)
+    {
+	assert(m_input == ST_NONE);
+	if (m_input != ST_NONE) return;
+
+	m_input = ST_OBJECT;
+	m_input_source = source;
+	m_input_source_mode = fm;
+	source->m_impl = this;
+    }
+
+    ///@}
+    
+    // *** Pipe Capacity ***
+
+    /**
+     * Set the capacity requested for all pipes created by run(). Zero keeps
+     * the kernel's default.
+     */
+    void set_pipe_capacity(unsigned int bytes)
+    {
+	m_pipe_capacity = bytes;
+    }
+
+    /**
+     * Set the capacity requested for one edge's pipe, overriding the pipe's
+     * default.
+     */
+    void set_pipe_capacity(unsigned int edge, unsigned int bytes)
+    {
+	if (m_edge_capacity.size() <= edge)
+	    m_edge_capacity.resize(edge + 1, 0);
+
+	m_edge_capacity[edge] = bytes;
+    }
+
+    /**
+     * Return the capacity granted by the kernel to an edge's pipe during the
+     * last run().
+     */
+    unsigned int get_pipe_capacity(unsigned int edge) const
+    {
+	assert(edge <= m_stages.size());
+
+	if (edge >= m_edge_granted.size()) return 0;
+
+	return m_edge_granted[edge];
+    }
+
+    // *** Read Chunk Size ***
+
+    /**
+     * Set a fixed number of bytes requested by each read() on stage inputs
+     * and the output stream. Disables the adaptive mode.
+     */
+    void set_read_size(unsigned int bytes)
+    {
+	assert(bytes > 0);
+
+	m_read_size = bytes;
+	m_read_max = bytes;
+	m_read_adaptive = false;
+    }
+
+    /**
+     * Enable the adaptive mode moving the read() chunk size between minsize
+     * and maxsize, where maxsize zero selects the edge's pipe capacity.
+     */
+    void set_read_size_adaptive(unsigned int minsize, unsigned int maxsize)
+    {
+	assert(minsize > 0);
+	assert(maxsize == 0 || minsize <= maxsize);
+
+	m_read_size = minsize;
+	m_read_max = maxsize;
+	m_read_adaptive = true;
+    }
+
+    /**
+     * Return the distribution of bytes returned by read() on an edge during
+     * the last run(). Slot k counts reads of [2^k, 2^(k+1)) bytes.
+     */
+    std::vector<unsigned long> get_read_histogram(unsigned int edge) const
+    {
+	assert(edge <= m_stages.size());
+
+	if (edge >= m_read_chunk.size()) return std::vector<unsigned long>();
+
+	return m_read_chunk[edge].histogram;
+    }
+
+    /**
+     * Initialize the read() chunk state of all edges from the configured
+     * sizes and granted pipe capacities, and allocate the read buffer.
+     */
+    void setup_read_chunks()
+    {
+	unsigned int bufsize = m_read_size;
+
+	m_read_chunk.assign(m_stages.size() + 1, ReadChunk());
+
+	for (unsigned int e = 0; e <= m_stages.size(); ++e)
+	{
+	    ReadChunk& rc = m_read_chunk[e];
+
+	    rc.size = rc.min = m_read_size;
+
+	    if (m_read_max)
+		rc.max = m_read_max;
+	    else
+		rc.max = m_edge_granted[e] ? m_edge_granted[e] : 65536;
+
+	    if (rc.max < rc.min) rc.max = rc.min;
+
+	    bufsize = std::max(bufsize, rc.max);
+	}
+
+	m_buffer.resize(bufsize);
+    }
+
+    /**
+     * Resize the pipe of the given edge to the requested capacity, capped at
+     * the system's maximum, and record the capacity actually granted.
+     */
+    void setup_pipe_capacity(unsigned int edge, int fd, unsigned int maxsize)
+    {
+	unsigned int request = m_pipe_capacity;
+
+	if (edge < m_edge_capacity.size() && m_edge_capacity[edge])
+	    request = m_edge_capacity[edge];
+
+	if (maxsize && request > maxsize)
+	    request = maxsize;
+
+#if defined(F_SETPIPE_SZ) && defined(F_GETPIPE_SZ)
+	if (request)
+	{
+	    if (fcntl(fd, F_SETPIPE_SZ, request) < 0) {
+		LOG_INFO("Could not resize pipe of edge " << edge << " to " << request << " bytes: " << strerror(errno));
+	    }
+	}
+
+	int granted = fcntl(fd, F_GETPIPE_SZ);
+	m_edge_granted[edge] = (granted > 0) ? granted : 65536;
+#else
+	(void)fd;
+	m_edge_granted[edge] = 65536;
+#endif
+
+	LOG_DEBUG("Pipe of edge " << edge << " has capacity " << m_edge_granted[edge] << " bytes.");
+    }
+
+    /**
+     * Function called by PipeSource::write() to push data into the ring
+     * buffer.
+     */
+    void input_source_write(const void* data, unsigned int datalen)
+    {
+#if STX_EXECPIPE_HAVE_THREADS
+	// called on the worker thread, the event loop forwards the data.
+	if (m_source_worker)
+	    return m_source_worker->write(data, datalen);
+#endif
+	m_input_rbuffer.write(data, datalen);
+    }
+
+    // *** Output Selectors ***
+
+    ///@{ \name Output Selectors
+
+    /**
+     * Assign an already opened file descriptor as output stream for the last
+     * exec stage.
+     */
+    void set_output_fd(int fd)
+    {
+	assert(m_output == ST_NONE);
+	if (m_output != ST_NONE) return;
+
+	m_output = ST_FD;
+	m_output_fd = fd;
+    }
+
+    /**
+     * Assign a file as output stream destination. This file will be created or
+     * truncated write-only and written by the last exec stage.
+     */
+    void set_output_file(const char* path, int mode = 0666)
+    {
+	assert(m_output == ST_NONE);
+	if (m_output != ST_NONE) return;
+
+	m_output = ST_FILE;
+	m_output_file = path;
+	m_output_file_mode = mode;
+    }    
+
+    /**
+     * Assign a std::string as output stream destination. The output of the
+     * last exec stage will be stored as the contents of the string. The string
+     * object is not copied and must still exist when run() is called.
+     */
+    void set_output_string(std::string* output)
+    {
+	assert(m_output == ST_NONE);
+	if (m_output != ST_NONE) return;
+
+	m_output = ST_STRING;
+	m_output_string = output;
+    }
+
+    /**
+     * Assign a PipeSink as output stream destination. The object will receive
+     * data via the process() function and is informed via eof()
+     */
+    void set_output_sink(PipeSink* sink, enum ExecPipe::FunctionMode fm)
+    {
+	assert(m_output == ST_NONE);
+	if (m_output != ST_NONE) return;
+
+	m_output = ST_OBJECT;
+	m_output_sink = sink;
+	m_output_sink_mode = fm;
+    }
+
+    ///@}
+
+    // *** Pipe Stages ***
+
+    ///@{ \name Add Pipe Stages
+
+    /**
+     * Return the number of pipe stages added.
+     */
+    unsigned int size() const
+    {
+	return m_stages.size();
+    }
+
+    /**
+     * Add an exec() stage to the pipe with given arguments. Note that argv[0]
+     * is set to prog.
+     */
+    void add_exec(const char* prog)
+    {
+	struct Stage newstage;
+	newstage.prog = prog;
+	newstage.args.push_back(prog);
+	m_stages.push_back(newstage);
+    }
+
+    /**
+     * Add an exec() stage to the pipe with given arguments. Note that argv[0]
+     * is set to prog.
+     */
+    void add_exec(const char* prog, const char* arg1)
+    {
+	struct Stage newstage;
+	newstage.prog = prog;
+	newstage.args.push_back(prog);
+	newstage.args.push_back(arg1);
+	m_stages.push_back(newstage);
+    }
+
+    /**
+     * Add an exec() stage to the pipe with given arguments. Note that argv[0]
+     * is set to prog.
+     */
+    void add_exec(const char* prog, const char* arg1, const char* arg2)
+    {
+	struct Stage newstage;
+	newstage.prog = prog;
+	newstage.args.push_back(prog);
+	newstage.args.push_back(arg1);
+	newstage.args.push_back(arg2);
+	m_stages.push_back(newstage);
+    }
+
+    /**
+     * Add an exec() stage to the pipe with given arguments. Note that argv[0]
+     * is set to prog.
+     */
+    void add_exec(const char* prog, const char* arg1, const char* arg2, const char* arg3)
+    {
+	struct Stage newstage;
+	newstage.prog = prog;
+	newstage.args.push_back(prog);
+	newstage.args.push_back(arg1);
+	newstage.args.push_back(arg2);
+	newstage.args.push_back(arg3);
+	m_stages.push_back(newstage);
+    }
+
+    /**
+     * Add an exec() stage to the pipe with given arguments. The vector of
+     * arguments is not copied, so it must still exist when run() is
+     * called. Note that the program called is args[0].
+     */
+    void add_exec(const std::vector<std::string>* args)
+    {
+	assert(args->size() > 0);
+	if (args->size() == 0) return;
+
+	struct Stage newstage;
+	newstage.prog = (*args)[0].c_str();
+	newstage.argsp = args;
+	m_stages.push_back(newstage);
+    }
+
+    /**
+     * Check that the program of an execp() stage can be found via PATH,
+     * unless the executable cache is disabled.
+     */
+    void check_execp(const char* prog)
+    {
+	if (ExecCache::instance().mode() == ExecPipe::EC_OFF) return;
+
+	std::string path;
+	int fd;
+
+	if (!ExecCache::instance().resolve(prog, path, fd))
+	    throw(std::runtime_error(std::string("Could not find program ") + prog + " in PATH."));
+
+	if (fd >= 0) close(fd);
+    }
+
+    /**
+     * Add an execp() stage to the pipe with given arguments. The PATH variable
+     * is search for programs not containing a slash / character. Note that
+     * argv[0] is set to prog.
+     */
+    void add_execp(const char* prog)
+    {
+	check_execp(prog);
+
+	struct Stage newstage;
+	newstage.prog = prog;
+	newstage.args.push_back(prog);
+	newstage.withpath = true;
+	m_stages.push_back(newstage);
+    }
+
+    /**
+     * Add an execp() stage to the pipe with given arguments. The PATH variable
+     * is search for programs not containing a slash / character. Note that
+     * argv[0] is set to prog.
+     */
+    void add_execp(const char* prog, const char* arg1)
+    {
+	check_execp(prog);
+
+	struct Stage newstage;
+	newstage.prog = prog;
+	newstage.args.push_back(prog);
+	newstage.args.push_back(arg1);
+	newstage.withpath = true;
+	m_stages.push_back(newstage);
+    }
+
+    /**
+     * Add an execp() stage to the pipe with given arguments. The PATH variable
+     * is search for programs not containing a slash / character. Note that
+     * argv[0] is set to prog.
+     */
+    void add_execp(const char* prog, const char* arg1, const char* arg2)
+    {
+	check_execp(prog);
+
+	struct Stage newstage;
+	newstage.prog = prog;
+	newstage.args.push_back(prog);
+	newstage.args.push_back(arg1);
+	newstage.args.push_back(arg2);
+	newstage.withpath = true;
+	m_stages.push_back(newstage);
+    }
+
+    /**
+     * Add an execp() stage to the pipe with given arguments. The PATH variable
+     * is search for programs not containing a slash / character. Note that
+     * argv[0] is set to prog.
+     */
+    void add_execp(const char* prog, const char* arg1, const char* arg2, const char* arg3)
+    {
+	check_execp(prog);
+
+	struct Stage newstage;
+	newstage.prog = prog;
+	newstage.args.push_back(prog);
+	newstage.args.push_back(arg1);
+	newstage.args.push_back(arg2);
+	newstage.args.push_back(arg3);
+	newstage.withpath = true;
+	m_stages.push_back(newstage);
+    }
+
+    /**
+     * Add an execp() stage to the pipe with given arguments. The PATH variable
+     * is search for programs not containing a slash / character. The vector of
+     * arguments is not copied, so it must still exist when run() is
+     * called. Note that the program called is args[0].
+     */
+    void add_execp(const std::vector<std::string>* args)
+    {
+	assert(args->size() > 0);
+	if (args->size() == 0) return;
+
+	check_execp((*args)[0].c_str());
+
+	struct Stage newstage;
+	newstage.prog = (*args)[0].c_str();
+	newstage.argsp = args;
+	newstage.withpath = true;
+	m_stages.push_back(newstage);
+    }
+
+    /**
+     * Add an exece() stage to the pipe with the given arguments and
+     * environments. This is the most flexible exec() call. The vector of
+     * arguments and environment variables is not copied, so it must still
+     * exist when run() is called. The env vector pointer may be NULL, the args
+     * vector must not be NULL. The args[0] is _not_ override with path, so you
+     * can fake program name calls.
+     */
+    void add_exece(const char* path,
+		   const std::vector<std::string>* argsp,
+		   const std::vector<std::string>* envp)
+    {
+	assert(path && argsp);
+	assert(argsp->size() > 0);
+	if (argsp->size() == 0) return;
+
+	struct Stage newstage;
+	newstage.prog = path;
+	newstage.argsp = argsp;
+	newstage.envp = envp;
+	m_stages.push_back(newstage);
+    }
+
+    /**
+     * Add a function stage to the pipe. This function object will be called in
+     * the parent process with data passing through the stage. See PipeFunction
+     * for more information.
+     */
+    void add_function(PipeFunction* func, enum ExecPipe::FunctionMode fm)
+    {
+	assert(func);
+	if (!func) return;
+
+	func->m_impl = this;
+	func->m_stageid = m_stages.size();
+
+	struct Stage newstage;
+	newstage.func = func;
+	newstage.mode = fm;
+	m_stages.push_back(newstage);
+    }
+
+    /**
+     * Add an observer stage to the pipe. The object receives all data passing
+     * through the stage, which is forwarded unmodified to the next stage
+     * using tee() without copying it through a user-space buffer.
+     */
+    void add_observer(PipeSink* observer)
+    {
+	assert(observer);
+	if (!observer) return;
+
+	struct Stage newstage;
+	newstage.observer = observer;
+	m_stages.push_back(newstage);
+    }
+
+    ///@}
+
+    // *** Buffer Limits ***
+
+    /**
+     * Set the default high and low watermarks of the output buffers of
+     * function and observer stages. A high watermark of zero disables the
+     * limit.
+     */
+    void set_buffer_limits(unsigned int high, unsigned int low)
+    {
+	assert(low <= high);
+
+	m_buffer_high = high;
+	m_buffer_low = low;
+    }
+
+    /**
+     * Set the high and low watermarks of one stage's output buffer,
+     * overriding the pipe's defaults.
+     */
+    void set_buffer_limits(unsigned int stageid, unsigned int high, unsigned int low)
+    {
+	assert(stageid < m_stages.size());
+	assert(low <= high);
+
+	m_stages[stageid].buffer_high = high;
+	m_stages[stageid].buffer_low = low;
+	m_stages[stageid].buffer_user = true;
+    }
+
+    /**
+     * Return the largest number of bytes held in a function or observer
+     * stage's output buffer during the last run().
+     */
+    unsigned int get_buffer_peak(unsigned int stageid) const
+    {
+	assert(stageid < m_stages.size());
+	assert(m_stages[stageid].in_parent());
+
+	return m_stages[stageid].buffer_peak;
+    }
+
+    /// Function called by PipeFunction::get_timeout_left().
+    int stage_function_timeout_left() const
+    {
+	if (!m_deadline) return -1;
+
+	long long left = m_deadline - monotonic_msec();
+	return left > 0 ? static_cast<int>(left) : 0;
+    }
+
+    /**
+     * Function called by PipeSource::write() to push data into the ring
+     * buffer.
+     */
+    void stage_function_write(unsigned int st, const void* data, unsigned int datalen)
+    {
+	assert(st < m_stages.size());
+
+	Stage& stage = m_stages[st];
+
+#if STX_EXECPIPE_HAVE_THREADS
+	// called on the worker thread, the event loop forwards the data.
+	if (stage.worker)
+	    return stage.worker->write(data, datalen);
+#endif
+
+	// nobody reads the output anymore, or the last stage has no output.
+	if (stage.broken || stage.stdout_fd < 0) return;
+
+	// write through directly if nothing is queued before this data, unless
+	// the backend batches the write into its next submission.
+	unsigned int xsize;
+
+	if (m_poller && stage.outbuffer.size() == 0 && stage.stdout_fd >= 0
+	    && !m_poller->transfer_buffer(stage.stdout_fd, xsize))
+	{
+	    ssize_t wb;
+
+	    do {
+		wb = write(stage.stdout_fd, data, datalen);
+		++m_syscall_count;
+	    } while (wb < 0 && errno == EINTR);
+
+	    LOG_TRACE("Write-through on stage fd: " << wb);
+
+	    if (wb > 0)
+	    {
+		data = static_cast<const char*>(data) + wb;
+		datalen -= wb;
+	    }
+	}
+
+	return stage.outbuffer.write(data, datalen);
+    }
+
+    /**
+     * Write as much as possible from the ring buffer to the file descriptor,
+     * using one writev() for both segments of a wrapped buffer. Returns the
+     * result of the last system call.
+     */
+    ssize_t write_ringbuffer(int fd, RingBuffer& rbuffer)
+    {
+	ssize_t wb = 0;
+
+	while (rbuffer.size() > 0)
+	{
+	    struct iovec iov[2];
+	    iov[0].iov_base = rbuffer.bottom();
+	    iov[0].iov_len = rbuffer.bottomsize();
+	    iov[1].iov_base = rbuffer.wrapped();
+	    iov[1].iov_len = rbuffer.wrappedsize();
+
+	    size_t len = iov[0].iov_len + iov[1].iov_len;
+
+	    if (iov[1].iov_len)
+		wb = writev(fd, iov, 2);
+	    else
+		wb = write(fd, iov[0].iov_base, iov[0].iov_len);
+
+	    ++m_syscall_count;
+
+	    if (wb < 0)
+	    {
+		if (errno == EINTR) continue;
+		return wb;
+	    }
+
+	    rbuffer.advance(wb);
+
+	    // a short write means the pipe is full.
+	    if (static_cast<size_t>(wb) < len)
+		break;
+	}
+
+	return wb;
+    }
+
+    /**
+     * Return the number of read(), write(), writev(), splice(), tee() and
+     * vmsplice() calls issued on the data path during the last run().
+     */
+    unsigned long get_syscall_count() const
+    {
+	return m_syscall_count;
+    }
+
+    /// Return the number of event loop waits during the last run().
+    unsigned long get_poll_count() const
+    {
+	return m_poll_count;
+    }
+
+    // *** Failure Policy ***
+
+    ///@{ \name Failure Policy
+
+    /// Select the reaction to a critical exec stage which fails.
+    void set_failure_policy(enum ExecPipe::FailurePolicy fp)
+    {
+	m_failure_policy = fp;
+    }
+
+    /// Select whether the exec stage's failure triggers the failure policy.
+    void set_stage_critical(unsigned int stageid, bool critical)
+    {
+	assert(stageid < m_stages.size());
+	assert(!m_stages[stageid].in_parent());
+
+	m_stages[stageid].critical = critical;
+    }
+
+    /**
+     * Return true if the reaped exec stage failed in the sense of the failure
+     * policy: it exited with a non-zero return code or was killed by a signal
+     * other than SIGPIPE, which only means that a downstream stage finished
+     * reading early.
+     */
+    bool stage_failed(const Stage& stage) const
+    {
+	if (!stage.critical) return false;
+
+	if (WIFEXITED(stage.retstatus))
+	    return (WEXITSTATUS(stage.retstatus) != 0);
+
+	if (WIFSIGNALED(stage.retstatus))
+	    return (WTERMSIG(stage.retstatus) != SIGPIPE);
+
+	return false;
+    }
+
+    ///@}
+
+    // *** Deadlines ***
+
+    ///@{ \name Deadlines
+
+    /// Set the number of milliseconds the whole pipe may run, zero for no
+    /// limit.
+    void set_timeout(unsigned int msec)
+    {
+	m_timeout = msec;
+    }
+
+    /// Set the number of milliseconds an exec stage may run, zero for no
+    /// limit.
+    void set_stage_timeout(unsigned int stageid, unsigned int msec)
+    {
+	assert(stageid < m_stages.size());
+	assert(!m_stages[stageid].in_parent());
+
+	m_stages[stageid].timeout = msec;
+    }
+
+    /// Set the signal sent on expiry of a deadline and the grace period in
+    /// milliseconds until SIGKILL follows.
+    void set_timeout_signal(int sig, unsigned int grace_msec)
+    {
+	m_timeout_signal = sig;
+	m_timeout_grace = grace_msec;
+    }
+
+    /// Return true if the pipe's deadline expired during the last run().
+    bool get_timed_out() const
+    {
+	return m_timed_out;
+    }
+
+    /// Return true if the exec stage was signaled during the last run()
+    /// because its own or the pipe's deadline expired.
+    bool get_stage_timed_out(unsigned int stageid) const
+    {
+	assert(stageid < m_stages.size());
+	assert(!m_stages[stageid].in_parent());
+
+	return m_stages[stageid].timed_out;
+    }
+
+    ///@}
+
+    // *** Run Pipe ***
+
+    /**
+     * Run the configured pipe sequence and wait for all children processes to
+     * complete. Returns a reference to *this for chaining.
+     *
+     * This function call should be wrapped into a try-catch block as it will
+     * throw() if a system call fails.
+     */
+    void run();
+
+    /**
+     * Steps of run(), which are also driven by an ExecPipePool for many
+     * pipes in one event loop. run_start() prepares all file descriptors,
+     * launches the children and registers with the poller, which is created
+     * if NULL. run_prepare() updates the interest set and returns false once
+     * nothing is left to wait for, run_dispatch() handles the events of the
+     * last wait(). run_stop() releases the poller and worker threads,
+     * run_reap() collects children left without pidfd and returns true once
+     * all are reaped, and run_finish() completes the run.
+     */
+    void run_start(Poller* poller);
+
+    /// See run_start().
+    bool run_prepare(int& timeout);
+
+    /// See run_start().
+    void run_dispatch();
+
+    /// See run_start().
+    void run_stop();
+
+    /// See run_start().
+    bool run_reap(bool block);
+
+    /// See run_start().
+    void run_finish();
+
+    /// Launch the pipe for an external event loop, see ExecPipe::start().
+    void start();
+
+    /// Return the file descriptors to watch, see ExecPipe::get_poll_fds().
+    int get_poll_fds(std::vector<ExecPipe::PollFd>& fds) const;
+
+    /// Handle events of an external event loop, see ExecPipe::on_ready().
+    void on_ready(int fd, int events);
+
+    /// Return true if the pipe launched by start() finished.
+    bool is_finished() const
+    {
+	return (m_step == SS_NONE);
+    }
+
+    /// Run the steps following a dispatch of events until the pipe waits
+    /// again, and finish it once all children were reaped.
+    void step_advance();
+
+    /// Abort a run after one of its steps threw an exception: attach the
+    /// poller if run_start() failed before, and terminate the pipe, which
+    /// then only waits for its launched children.
+    void run_abort(Poller* poller)
+    {
+	if (!m_poller)
+	{
+	    m_poller = poller;
+	    m_poller_owned = false;
+	}
+
+	abort_pipe(SIGTERM);
+    }
+
+    /// Return the number of child processes launched by run(), i.e. exec and
+    /// FM_PROCESS function stages.
+    unsigned int get_child_count() const
+    {
+	unsigned int n = 0;
+
+	for (unsigned int i = 0; i < m_stages.size(); ++i)
+	{
+	    if (!m_stages[i].in_parent()) ++n;
+	}
+
+	return n;
+    }
+
+    // *** Inspection After Pipe Execution ***
+
+    ///@{ \name Inspect Return Codes
+
+    /**
+     * Get the return status of exec() stage's program run after pipe execution
+     * as indicated by wait().
+     */
+    int get_return_status(unsigned int stageid) const
+    {
+	assert(stageid < m_stages.size());
+	assert(!m_stages[stageid].in_parent());
+
+	return m_stages[stageid].retstatus;
+    }
+
+    /**
+     * Get the return code of exec() stage's program run after pipe execution,
+     * or -1 if the program terminated abnormally.
+     */
+    int get_return_code(unsigned int stageid) const
+    {
+	assert(stageid < m_stages.size());
+	assert(!m_stages[stageid].in_parent());
+
+	if (WIFEXITED(m_stages[stageid].retstatus))
+	    return WEXITSTATUS(m_stages[stageid].retstatus);
+	else
+	    return -1;
+    }
+
+    /**
+     * Get the signal of the abnormally terminated exec() stage's program run
+     * after pipe execution, or -1 if the program terminated normally.
+     */
+    int get_return_signal(unsigned int stageid) const
+    {
+	assert(stageid < m_stages.size());
+	assert(!m_stages[stageid].in_parent());
+
+	if (WIFSIGNALED(m_stages[stageid].retstatus))
+	    return WTERMSIG(m_stages[stageid].retstatus);
+	else
+	    return -1;
+    }
+
+    /**
+     * Return the number of system calls the event loop backend saved during
+     * the last run() by batching registration changes and waits.
+     */
+    unsigned long get_syscalls_saved() const
+    {
+	return m_syscalls_saved;
+    }
+
+    /// Return the event loop backend used during the last run().
+    enum ExecPipe::PollEngine get_poll_engine_used() const
+    {
+	return m_poll_engine_used;
+    }
+
+    /**
+     * Return the errno with which the exec() stage's program failed to be
+     * executed during the last run(), or zero if it was executed.
+     */
+    int get_exec_error(unsigned int stageid) const
+    {
+	assert(stageid < m_stages.size());
+	assert(!m_stages[stageid].in_parent());
+
+	return m_stages[stageid].exec_errno;
+    }
+
+    /**
+     * Return the exec() stage which failed and thereby aborted the last
+     * run(), or -1 if the pipe was not aborted.
+     */
+    int get_failed_stage() const
+    {
+	return m_failed_stage;
+    }
+
+    /**
+     * Return true if the return code of all exec() stages were zero.
+     */
+    bool all_return_codes_zero() const
+    {
+	for (unsigned int i = 0; i < m_stages.size(); ++i)
+	{
+	    if (m_stages[i].in_parent()) continue;
+
+	    if (get_return_code(i) != 0)
+		return false;
+	}
+
+	return true;
+    }
+
+    ///@}
+
+protected:
+
+    // *** Helper Function for run() ***
+
+    /// Terminate all launched and not yet reaped exec stages with the signal
+    /// and close all file descriptors still held by the parent.
+    void	abort_pipe(int sig);
+
+    /// Launch the worker threads of FM_THREAD function stages, sources and
+    /// sinks.
+    void	start_workers();
+
+#if STX_EXECPIPE_HAVE_THREADS
+    /// Store the worker in the slot and start its thread.
+    void	launch_worker(ThreadWorker*& slot, ThreadWorker* worker);
+#endif
+
+    /// Cancel and join the worker in the slot if it is still running, and
+    /// free its state.
+    void	stop_worker(ThreadWorker*& slot);
+
+    /// Cancel and join all worker threads which are still running, and free
+    /// their state.
+    void	stop_workers();
+
+    /// Entry point of worker threads, calls the main function of the
+    /// worker's role.
+    static void* worker_thread(void* arg);
+
+    /// Feed the function on the worker thread until its input ends.
+    void	worker_main(unsigned int st);
+
+    /// Read the input of an FM_THREAD stage into the worker's input queue.
+    void	worker_read(unsigned int st);
+
+    /// Move output of the worker into the stage's outbuffer and join the
+    /// thread once it finished.
+    void	worker_drain(unsigned int st);
+
+    /// Signal the worker that no more input follows.
+    void	worker_close_input(unsigned int st);
+
+    /// Make the worker quit without processing its queued input or calling
+    /// eof(), as its output cannot be delivered anymore.
+    void	worker_interrupt(unsigned int st);
+
+    /// Read from the fd into chunks for the worker's input queue until the
+    /// pipe is drained or the queue is full. Returns false at end of file.
+    bool	worker_fill(ThreadWorker* worker, int fd, unsigned int edge);
+
+    /// Poll the input source on the worker thread until it ends.
+    void	source_worker_main();
+
+    /// Write chunks produced by the source's worker into the input pipe, and
+    /// close it after the last one.
+    void	source_worker_write();
+
+    /// Cancel the source's worker if the input pipe was closed early, and
+    /// join it once it finished.
+    void	source_worker_check();
+
+    /// Feed the output sink on the worker thread until its input ends.
+    void	sink_worker_main();
+
+    /// Read the output pipe into the sink worker's input queue.
+    void	sink_worker_read();
+
+    /// Join the sink's worker once it finished.
+    void	sink_worker_check();
+
+    /// Return true if the stage's input may be read, which considers the
+    /// outbuffer's watermarks and a full worker input queue.
+    bool	stage_may_read(unsigned int st);
+
+    /// Return true if the output pipe may be read, i.e. the sink's worker
+    /// input queue is not full.
+    bool	sink_may_read();
+
+    /// Keep a read of at most chunk bytes on fd in flight if the event loop
+    /// backend transfers data itself. Returns false if fd must be polled.
+    bool	queue_read(int fd, unsigned int chunk);
+
+    /// Keep a write of the ring buffer's front on fd in flight, see
+    /// queue_read().
+    bool	queue_write(int fd, const RingBuffer& rbuffer);
+
+    /// Close the input of the function or observer stage as if it ended,
+    /// calling eof(). The preceding stage then fails to write with EPIPE.
+    void	stage_input_done(unsigned int st);
+
+    /// Handle EPIPE on the output of the function or observer stage: discard
+    /// its buffered and further output and close its input, which propagates
+    /// the early termination upstream.
+    void	stage_output_broken(unsigned int st);
+
+    /// Abort the pipe if the just reaped exec stage failed under FP_ABORT.
+    void	check_failure(unsigned int i);
+
+    /// Signal the exec stages whose deadline expired and kill those whose
+    /// grace period ended. Returns the milliseconds until the next deadline,
+    /// or -1 if none is pending.
+    int		check_deadlines();
+
+    /// Build the argument and environment arrays of an exec stage, such that
+    /// the launched child only has to issue system calls.
+    void	prepare_exec(Stage& stage);
+
+    /// Launch an exec stage using the correct exec() variant. Called in the
+    /// forked child and only returns if exec() failed.
+    void	exec_stage(const Stage& stage);
+
+    /// Launch exec stage i in a fork()ed child process. Returns the child's
+    /// pid or -1 on error.
+    pid_t	launch_fork(unsigned int i);
+
+    /// Launch exec stage i using posix_spawn(). Returns the child's pid or -1
+    /// with errno set on error.
+    pid_t	launch_spawn(unsigned int i);
+
+    /// In a fork()ed child of stage i: close the file descriptors of all
+    /// other stages, move the stage's to stdin and stdout, and close all
+    /// others except keepfd1 and keepfd2. Returns false if dup2() failed.
+    bool	child_redirect(unsigned int i, int keepfd1, int keepfd2);
+
+    /// Launch FM_PROCESS function stage i in a fork()ed worker process.
+    /// Returns the child's pid or -1 with errno set on error.
+    pid_t	launch_function(unsigned int i);
+
+    /// Run the function of stage i in the worker process on stdin and
+    /// stdout, and write its saved state to statefd. Returns the worker's
+    /// exit status.
+    int		function_process_main(unsigned int i, int statefd);
+
+    /// Write the function's outbuffer to stdout of the worker process.
+    /// Returns false on error.
+    bool	function_process_flush(Stage& stage);
+
+    /// Read the saved state from the FM_PROCESS worker of stage st, and
+    /// close the pipe at its end.
+    void	function_state_read(unsigned int st);
+
+    /// Launch exec stage i via the fork server. Returns the child's pid or -1
+    /// with errno set on error.
+    pid_t	launch_server(unsigned int i);
+
+    /// Collect the exit status of a finished exec stage via its pidfd, or
+    /// wait for it using waitpid() if no pidfd is available. If block is
+    /// false, returns false instead of waiting for a running child.
+    bool	reap_stage(Stage& stage, bool block = true);
+
+    /// Print all arguments of exec() call.
+    void	print_exec(const std::vector<std::string>& args);
+
+    /// Safe close() call and output error if fd was already closed.
+    void	sclose(int fd);
+
+    /// Return the number of bytes the input pipe can take without blocking,
+    /// limited by the buffer's high watermark.
+    unsigned int input_pipe_space();
+
+    /// Poll the PipeSource with a hint of the free input pipe space and write
+    /// the data into the input pipe.
+    void	input_source_poll();
+
+    /// Move data from the list of input files into the input pipe until it is
+    /// full, opening the files lazily in order.
+    void	input_files_write();
+
+    /// Close the current input file and throw an exception after reading it
+    /// failed, instead of silently truncating the input.
+    void	input_files_error() __attribute__((noreturn));
+
+    /// Duplicate data from an observer stage's input to its output using
+    /// tee() and consume it via read() for the observer.
+    void	observer_tee(unsigned int st);
+
+    /// Create the selected event loop backend, falling back to select() if
+    /// it is not available.
+    Poller*	create_poller(enum ExecPipe::PollEngine pe);
+
+    /// association to the pool implementation for create_poller(),
+    /// check_deadlines() and marking pooled pipes in m_step.
+    friend class ExecPipePoolImpl;
+
+    /// Remove a file descriptor from the event loop, close() it and reset the
+    /// variable to -1.
+    void	pclose(int& fd);
+};
+
+// --- ExecPipeImpl ----------------------------------------------------- //
+
+void ExecPipeImpl::print_exec(const std::vector<std::string>& args)
+{
+    std::ostringstream oss;
+    oss << "Exec()";
+    for (unsigned ai = 0; ai < args.size(); ++ai)
+    {
+	oss << " " << args[ai];
+    }
+    LOG_INFO(oss.str());
+}
+
+void ExecPipeImpl::prepare_exec(Stage& stage)
+{
+    // select arguments vector
+    const std::vector<std::string>& args = stage.argsp ? *stage.argsp : stage.args;
+
+    // create const char*[] of prog and arguments for syscall.
+
+    stage.cargs.resize(args.size() + 1);
+
+    for (unsigned ai = 0; ai < args.size(); ++ai)
+    {
+	stage.cargs[ai] = args[ai].c_str();
+    }
+    stage.cargs[ args.size() ] = NULL;
+
+    // create envp const char*[] for syscall.
+
+    stage.cenv.clear();
+
+    if (stage.envp)
+    {
+	stage.cenv.resize(stage.envp->size() + 1);
+
+	for (unsigned ei = 0; ei < stage.envp->size(); ++ei)
+	{
+	    stage.cenv[ei] = (*stage.envp)[ei].c_str();
+	}
+	stage.cenv[ stage.envp->size() ] = NULL;
+    }
+
+    // resolve program via the cache, falling back to execvp() if the
+    // program disappeared since add_execp().
+
+    stage.exec_path.clear();
+    stage.exec_fd = -1;
+
+    if (stage.withpath && ExecCache::instance().mode() != ExecPipe::EC_OFF)
+    {
+	if (!ExecCache::instance().resolve(stage.prog, stage.exec_path, stage.exec_fd))
+	    stage.exec_path.clear();
+    }
+}
+
+void ExecPipeImpl::exec_stage(const Stage& stage)
+{
+    char* const* cargs = const_cast<char* const*>(&stage.cargs[0]);
+
+    if (stage.exec_fd >= 0)
+    {
+	fexecve(stage.exec_fd, cargs, environ);
+
+	// fall back to the resolved path, e.g. if /proc is not mounted.
+    }
+
+    if (!stage.exec_path.empty())
+    {
+	// the resolved path contains a slash, thus execvp() does not search
+	// PATH again, but still runs a script without shebang via /bin/sh.
+	execvp(stage.exec_path.c_str(), cargs);
+    }
+    else if (!stage.envp)
+    {
+	if (stage.withpath)
+	    execvp(stage.prog, cargs);
+	else
+	    execv(stage.prog, cargs);
+    }
+    else
+    {
+	execve(stage.prog, cargs, const_cast<char* const*>(&stage.cenv[0]));
+    }
+}
+
+pid_t ExecPipeImpl::launch_fork(unsigned int i)
+{
+    // the child reports a failed exec() via this close-on-exec pipe, which
+    // reads EOF once the program was executed.
+    int errpipe[2];
+
+    if (pipe_cloexec(errpipe) != 0)
+	return -1;
+
+    sigset_t sigpipe;
+    sigpipe_set(sigpipe);
+
+    pid_t child = fork();
+
+    if (child < 0)
+    {
+	int err = errno;
+	close(errpipe[0]);
+	close(errpipe[1]);
+	errno = err;
+	return -1;
+    }
+
+    if (child > 0)
+    {
+	close(errpipe[1]);
+
+	int err = 0;
+	ssize_t rb;
+
+	do {
+	    rb = read(errpipe[0], &err, sizeof(err));
+	} while (rb < 0 && errno == EINTR);
+
+	close(errpipe[0]);
+
+	if (rb != sizeof(err))
+	    return child;
+
+	// collect the failed child immediately.
+	while (waitpid(child, NULL, 0) < 0 && errno == EINTR) { }
+
+	errno = err;
+	return -1;
+    }
+
+    // inside child process: only async-signal-safe system calls from here on.
+
+    close(errpipe[0]);
+
+    // SIGPIPE is blocked in the parent during run().
+    sigprocmask(SIG_UNBLOCK, &sigpipe, NULL);
+
+    const Stage& stage = m_stages[i];
+
+    if (!child_redirect(i, stage.exec_fd, errpipe[1]))
+	exit_errno(errpipe[1]);
+
+    // run program
+    exec_stage(stage);
+
+    exit_errno(errpipe[1]);
+}
+
+bool ExecPipeImpl::child_redirect(unsigned int i, int keepfd1, int keepfd2)
+{
+    // move assigned file descriptors and close all others
+    if (m_input_fd >= 0)
+	close(m_input_fd);
+
+    for (unsigned int j = 0; j < m_stages.size(); ++j)
+    {
+	if (i == j) continue;
+
+	// close file descriptors of other stages
+
+	if (m_stages[j].stdin_fd >= 0)
+	    close(m_stages[j].stdin_fd);
+
+	if (m_stages[j].stdout_fd >= 0)
+	    close(m_stages[j].stdout_fd);
+    }
+
+    if (m_output_fd >= 0)
+	close(m_output_fd);
+
+    // dup2 file descriptors assigned for this stage as stdin and stdout
+
+    const Stage& stage = m_stages[i];
+
+    if (stage.stdin_fd >= 0)
+    {
+	if (stage.stdin_fd == STDIN_FILENO) {
+	    // dup2() onto itself does not clear close-on-exec.
+	    fcntl(STDIN_FILENO, F_SETFD, 0);
+	}
+	else if (dup2(stage.stdin_fd, STDIN_FILENO) == -1)
+	    return false;
+    }
+
+    if (stage.stdout_fd >= 0)
+    {
+	if (stage.stdout_fd == STDOUT_FILENO) {
+	    fcntl(STDOUT_FILENO, F_SETFD, 0);
+	}
+	else if (dup2(stage.stdout_fd, STDOUT_FILENO) == -1)
+	    return false;
+    }
+
+    // close all other file descriptors, including those opened without
+    // close-on-exec by other threads or libraries.
+    if (!close_from(STDERR_FILENO + 1, keepfd1, keepfd2))
+    {
+	if (stage.stdin_fd > STDERR_FILENO)
+	    close(stage.stdin_fd);
+	if (stage.stdout_fd > STDERR_FILENO)
+	    close(stage.stdout_fd);
+    }
+
+    return true;
+}
+
+pid_t ExecPipeImpl::launch_function(unsigned int i)
+{
+    // the worker passes the function's saved state back via this pipe.
+    int statepipe[2];
+
+    if (pipe_cloexec(statepipe) != 0)
+	return -1;
+
+    if (fcntl(statepipe[0], F_SETFL, O_NONBLOCK) != 0)
+    {
+	int err = errno;
+	close(statepipe[0]);
+	close(statepipe[1]);
+	errno = err;
+	return -1;
+    }
+
+    sigset_t sigpipe;
+    sigpipe_set(sigpipe);
+
+    pid_t child = fork();
+
+    if (child < 0)
+    {
+	int err = errno;
+	close(statepipe[0]);
+	close(statepipe[1]);
+	errno = err;
+	return -1;
+    }
+
+    if (child > 0)
+    {
+	close(statepipe[1]);
+
+	m_stages[i].statefd = statepipe[0];
+	m_stages[i].state.clear();
+
+	return child;
+    }
+
+    // inside worker process: like an exec()ed program, a failed write to a
+    // closed pipe terminates it with SIGPIPE.
+
+    close(statepipe[0]);
+
+    sigprocmask(SIG_UNBLOCK, &sigpipe, NULL);
+
+    if (!child_redirect(i, statepipe[1], -1))
+	_exit(255);
+
+    _exit(function_process_main(i, statepipe[1]));
+}
+
+int ExecPipeImpl::function_process_main(unsigned int i, int statefd)
+{
+    Stage& stage = m_stages[i];
+    PipeFunction* func = stage.func;
+
+    // write() of the function fills the outbuffer, which is flushed to the
+    // blocking stdout after each call.
+    m_poller = NULL;
+    stage.stdout_fd = STDOUT_FILENO;
+
+    try
+    {
+	while (!func->m_done)
+	{
+	    ssize_t rb = read(STDIN_FILENO, &m_buffer[0], m_read_chunk[i].size);
+
+	    if (rb < 0 && errno == EINTR) continue;
+
+	    if (rb < 0)
+	    {
+		LOG_ERROR("Error reading from function stage input: " << strerror(errno));
+		return 1;
+	    }
+
+	    if (rb == 0) break;
+
+	    func->process(&m_buffer[0], rb);
+
+	    if (!function_process_flush(stage))
+		return 1;
+	}
+
+	func->eof();
+
+	if (!function_process_flush(stage))
+	    return 1;
+
+	std::string state = func->save_state();
+
+	for (size_t pos = 0; pos < state.size(); )
+	{
+	    ssize_t wb = write(statefd, state.data() + pos, state.size() - pos);
+
+	    if (wb < 0 && errno == EINTR) continue;
+
+	    if (wb < 0)
+	    {
+		LOG_ERROR("Error writing function stage state: " << strerror(errno));
+		return 1;
+	    }
+
+	    pos += wb;
+	}
+    }
+    catch (std::exception& e)
+    {
+	LOG_ERROR("Exception in function stage process: " << e.what());
+	return 1;
+    }
+    catch (...)
+    {
+	LOG_ERROR("Unknown exception in function stage process.");
+	return 1;
+    }
+
+    return 0;
+}
+
+bool ExecPipeImpl::function_process_flush(Stage& stage)
+{
+    while (stage.outbuffer.size())
+    {
+	if (write_ringbuffer(STDOUT_FILENO, stage.outbuffer) < 0)
+	{
+	    LOG_ERROR("Error writing function stage output: " << strerror(errno));
+	    return false;
+	}
+    }
+
+    return true;
+}
+
+pid_t ExecPipeImpl::launch_spawn(unsigned int i)
+{
+#if STX_EXECPIPE_HAVE_SPAWN
+    const Stage& stage = m_stages[i];
+
+    posix_spawn_file_actions_t actions;
+
+    int err = posix_spawn_file_actions_init(&actions);
+    if (err != 0) {
+	errno = err;
+	return -1;
+    }
+
+    // close file descriptors of the input/output streams and other stages.
+
+    if (m_input_fd >= 0)
+	posix_spawn_file_actions_addclose(&actions, m_input_fd);
+
+    for (unsigned int j = 0; j < m_stages.size(); ++j)
+    {
+	if (i == j) continue;
+
+	if (m_stages[j].stdin_fd >= 0)
+	    posix_spawn_file_actions_addclose(&actions, m_stages[j].stdin_fd);
+
+	if (m_stages[j].stdout_fd >= 0)
+	    posix_spawn_file_actions_addclose(&actions, m_stages[j].stdout_fd);
+    }
+
+    if (m_output_fd >= 0)
+	posix_spawn_file_actions_addclose(&actions, m_output_fd);
+
+    // dup2 file descriptors assigned for this stage as stdin and stdout
+
+    if (stage.stdin_fd >= 0)
+    {
+	posix_spawn_file_actions_adddup2(&actions, stage.stdin_fd, STDIN_FILENO);
+	if (stage.stdin_fd > STDERR_FILENO)
+	    posix_spawn_file_actions_addclose(&actions, stage.stdin_fd);
+    }
+
+    if (stage.stdout_fd >= 0)
+    {
+	posix_spawn_file_actions_adddup2(&actions, stage.stdout_fd, STDOUT_FILENO);
+	if (stage.stdout_fd > STDERR_FILENO)
+	    posix_spawn_file_actions_addclose(&actions, stage.stdout_fd);
+    }
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 34))
+    // close all other file descriptors, including those opened without
+    // close-on-exec by other threads or libraries.
+    posix_spawn_file_actions_addclosefrom_np(&actions, STDERR_FILENO + 1);
+#endif
+
+    // SIGPIPE is blocked in the parent during run().
+    posix_spawnattr_t attr;
+    sigset_t mask;
+
+    posix_spawnattr_init(&attr);
+    child_sigmask(mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+    char* const* cargs = const_cast<char* const*>(&stage.cargs[0]);
+    char* const* cenv = stage.envp
+	? const_cast<char* const*>(&stage.cenv[0]) : environ;
+
+    pid_t child;
+
+    if (!stage.exec_path.empty())
+	err = posix_spawn(&child, stage.exec_path.c_str(), &actions, &attr, cargs, cenv);
+    else if (stage.withpath)
+	err = posix_spawnp(&child, stage.prog, &actions, &attr, cargs, cenv);
+    else
+	err = posix_spawn(&child, stage.prog, &actions, &attr, cargs, cenv);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+
+    // unlike execvp(), posix_spawnp() does not run a script without shebang
+    // via /bin/sh, thus add_execp() stages retry with fork().
+    if (err == ENOEXEC && stage.withpath)
+	return launch_fork(i);
+
+    if (err != 0) {
+	errno = err;
+	return -1;
+    }
+
+    return child;
+#else
+    (void)i;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+void ExecPipeImpl::sclose(int fd)
+{
+    int r = close(fd);
+
+    if (r != 0) {
+	LOG_ERROR("Could not correctly close fd: " << strerror(errno));
+    }
+}
+
+unsigned int ExecPipeImpl::input_pipe_space()
+{
+    int queued = 0;
+
+#ifdef FIONREAD
+    if (ioctl(m_input_fd, FIONREAD, &queued) != 0)
+	queued = 0;
+#endif
+
+    unsigned int space = (m_input_pipe_capacity > static_cast<unsigned int>(queued))
+	? m_input_pipe_capacity - queued : 0;
+
+    if (m_buffer_high && space > m_buffer_high)
+	space = m_buffer_high;
+
+    // the pipe was reported writable, so at least PIPE_BUF bytes fit.
+    return space ? space : PIPE_BUF;
+}
+
+void ExecPipeImpl::input_source_poll()
+{
+    assert(m_input_source);
+
+    while (m_input_fd >= 0)
+    {
+	if (!m_input_rbuffer.size())
+	{
+	    if (m_input_source_eof)
+	    {
+		pclose(m_input_fd);
+
+		LOG_INFO("Closing input file descriptor");
+		return;
+	    }
+
+	    unsigned int hint = input_pipe_space();
+
+	    if (!m_input_source->poll(hint))
+		m_input_source_eof = true;
+
+	    LOG_TRACE("Polled input source with hint " << hint << ": " << m_input_rbuffer.size());
+
+	    // source did not produce data this time, try again next round.
+	    if (!m_input_rbuffer.size() && !m_input_source_eof)
+		return;
+
+	    continue;
+	}
+
+	// write buffered data to first stdin file descriptor.
+
+	ssize_t wb = write_ringbuffer(m_input_fd, m_input_rbuffer);
+
+	LOG_TRACE("Write on input fd: " << wb);
+
+	if (wb < 0)
+	{
+	    if (errno == EAGAIN) return;
+
+	    LOG_INFO("Error writing to input file descriptor: " << strerror(errno));
+
+	    // the source is not polled anymore, drop its data.
+	    m_input_rbuffer.clear();
+	    pclose(m_input_fd);
+
+	    LOG_INFO("Closing input file descriptor: " << strerror(errno));
+	    return;
+	}
+
+	// input pipe is full, wait until it becomes writable.
+	if (m_input_rbuffer.size())
+	    return;
+    }
+}
+
+void ExecPipeImpl::input_files_error()
+{
+    int err = errno;
+
+    sclose(m_input_files_fd);
+    m_input_files_fd = -1;
+
+    throw(std::runtime_error(std::string("Could not read input file ") + (*m_input_files)[m_input_files_pos-1] + ": " + strerror(err)));
+}
+
+void ExecPipeImpl::input_files_write()
+{
+    while (m_input_fd >= 0)
+    {
+	// flush data left over from copying.
+	if (m_input_rbuffer.size())
+	{
+	    ssize_t wb = write_ringbuffer(m_input_fd, m_input_rbuffer);
+
+	    LOG_TRACE("Write on input fd: " << wb);
+
+	    if (wb < 0)
+	    {
+		if (errno == EAGAIN) return;
+
+		LOG_INFO("Error writing to input file descriptor: " << strerror(errno));
+		break;
+	    }
+
+	    // input pipe is full, wait until it becomes writable.
+	    if (m_input_rbuffer.size())
+		return;
+
+	    continue;
+	}
+
+	// open next input file
+	if (m_input_files_fd < 0)
+	{
+	    if (m_input_files_pos >= m_input_files->size())
+		break;
+
+	    const std::string& path = (*m_input_files)[m_input_files_pos++];
+
+	    // the input would be silently truncated if a file is skipped.
+	    m_input_files_fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	    if (m_input_files_fd < 0)
+		throw(std::runtime_error(std::string("Could not open input file ") + path + ": " + strerror(errno)));
+
+	    LOG_INFO("Opened input file " << path);
+
+	    // a previous file which could not be spliced does not affect this one.
+	    m_input_files_splice = true;
+	}
+
+	ssize_t rb = -1;
+
+#if STX_EXECPIPE_HAVE_SPLICE
+	if (m_input_files_splice)
+	{
+	    // move file pages into the pipe without a user-space copy.
+	    rb = splice(m_input_files_fd, NULL, m_input_fd, NULL, 1024*1024,
+			SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	    ++m_syscall_count;
+
+	    LOG_TRACE("Splice on input fd: " << rb);
+
+	    if (rb < 0)
+	    {
+		if (errno == EINTR) continue;
+		if (errno == EAGAIN) return;
+
+		if (errno == EPIPE)
+		{
+		    LOG_INFO("Error splicing to input file descriptor: " << strerror(errno));
+		    break;
+		}
+
+		if (errno != EINVAL && errno != ENOSYS)
+		    input_files_error();
+
+		LOG_DEBUG("Cannot splice() input files, copying instead: " << strerror(errno));
+		m_input_files_splice = false;
+	    }
+	}
+#else
+	m_input_files_splice = false;
+#endif
+
+	if (!m_input_files_splice)
+	{
+	    rb = read(m_input_files_fd, &m_buffer[0], m_buffer.size());
+	    ++m_syscall_count;
+
+	    LOG_TRACE("Read on input file fd: " << rb);
+
+	    if (rb < 0)
+	    {
+		if (errno == EINTR) continue;
+		input_files_error();
+	    }
+	    else
+	    {
+		m_input_rbuffer.write(&m_buffer[0], rb);
+	    }
+	}
+
+	if (rb <= 0)
+	{
+	    // end of current file, continue with next one.
+	    sclose(m_input_files_fd);
+	    m_input_files_fd = -1;
+	}
+    }
+
+    // all files done or output error
+    if (m_input_files_fd >= 0)
+    {
+	sclose(m_input_files_fd);
+	m_input_files_fd = -1;
+    }
+
+    m_input_rbuffer.clear();
+    pclose(m_input_fd);
+
+    LOG_INFO("Closing input file descriptor");
+}
+
+void ExecPipeImpl::observer_tee(unsigned int st)
+{
+#if STX_EXECPIPE_HAVE_SPLICE
+    Stage& stage = m_stages[st];
+    ReadChunk& rc = m_read_chunk[st];
+
+    while (stage.stdin_fd >= 0)
+    {
+	size_t chunk = rc.size;
+
+	ssize_t tb = tee(stage.stdin_fd, stage.stdout_fd,
+			 chunk, SPLICE_F_NONBLOCK);
+	++m_syscall_count;
+
+	LOG_TRACE("Tee on stage fd: " << tb);
+
+	if (tb == 0)
+	{
+	    // zero tee indicates eof
+	    LOG_INFO("Closing stage input file descriptor: " << strerror(errno));
+
+	    stage.observer->eof();
+
+	    pclose(stage.stdin_fd);
+	    return;
+	}
+	else if (tb < 0)
+	{
+	    if (errno == EINTR) continue;
+
+	    if (errno == EAGAIN) {
+		// EAGAIN is returned for an empty input as well as a full
+		// output, also after a full chunk was tee()d. Only the latter
+		// must wait until the output becomes writable.
+		int avail = 0;
+
+		if (ioctl(stage.stdin_fd, FIONREAD, &avail) == 0 && avail > 0)
+		    stage.tee_blocked = true;
+	    }
+	    else if (errno == EPIPE) {
+		stage_output_broken(st);
+	    }
+	    else {
+		// input or output is not a pipe: copy data via outbuffer.
+		LOG_DEBUG("Cannot tee() on stage file descriptors, copying instead: " << strerror(errno));
+		stage.tee_copy = true;
+	    }
+	    return;
+	}
+
+	// consume the duplicated data from the input pipe for the observer.
+	ssize_t rb = 0;
+
+	while (rb < tb)
+	{
+	    ssize_t r = read(stage.stdin_fd, &m_buffer[rb], tb - rb);
+	    ++m_syscall_count;
+
+	    if (r <= 0)
+	    {
+		if (r < 0 && errno == EINTR) continue;
+		throw(std::runtime_error(std::string("Could not read tee()d data from stage input: ") + strerror(errno)));
+	    }
+
+	    rb += r;
+	}
+
+	stage.observer->process(&m_buffer[0], tb);
+
+	rc.update(tb, m_read_adaptive);
+
+	if (stage.observer->m_done)
+	{
+	    stage_input_done(st);
+	    return;
+	}
+
+	// a short tee() means the input pipe was drained.
+	if (static_cast<size_t>(tb) < chunk)
+	    return;
+    }
+#else
+    m_stages[st].tee_copy = true;
+#endif
+}
+
+pid_t ExecPipeImpl::launch_server(unsigned int i)
+{
+    Stage& stage = m_stages[i];
+
+    const char* prog = stage.exec_path.empty() ? stage.prog : stage.exec_path.c_str();
+
+    // with a resolved path, execvp() only adds the /bin/sh retry of scripts.
+    return ForkServer::instance().spawn(
+	prog, stage.withpath,
+	&stage.cargs[0], stage.envp ? &stage.cenv[0] : environ,
+	stage.stdin_fd, stage.stdout_fd, stage.statusfd);
+}
+
+bool ExecPipeImpl::reap_stage(Stage& stage, bool block)
+{
+    int status = 0;
+
+    if (stage.statusfd >= 0)
+    {
+	// the fork server writes the wait() status and closes the pipe.
+	ssize_t rb;
+	while ((rb = read(stage.statusfd, &status, sizeof(status))) < 0 && errno == EINTR) { }
+
+	pclose(stage.statusfd);
+
+	if (rb != sizeof(status))
+	{
+	    LOG_ERROR("Error reading exit status from fork server for pid " << stage.pid);
+	    stage.retstatus = 255 << 8;
+	    stage.reaped = true;
+	    return true;
+	}
+    }
+#if STX_EXECPIPE_HAVE_PIDFD
+    else if (stage.pidfd >= 0)
+    {
+	siginfo_t info;
+	memset(&info, 0, sizeof(info));
+
+	int r;
+	while ((r = waitid(static_cast<idtype_t>(P_PIDFD), stage.pidfd, &info, WEXITED)) != 0 && errno == EINTR) { }
+
+	pclose(stage.pidfd);
+
+	if (r != 0)
+	{
+	    LOG_ERROR("Error calling waitid(): " << strerror(errno));
+	    stage.reaped = true;
+	    return true;
+	}
+
+	// reassemble the wait() status from the siginfo.
+	if (info.si_code == CLD_EXITED)
+	    status = (info.si_status & 0xFF) << 8;
+	else if (info.si_code == CLD_DUMPED)
+	    status = (info.si_status & 0x7F) | 0x80;
+	else
+	    status = (info.si_status & 0x7F);
+    }
+#endif
+    else
+    {
+	int r;
+	while ((r = waitpid(stage.pid, &status, block ? 0 : WNOHANG)) < 0 && errno == EINTR) { }
+
+	if (r == 0)
+	    return false;
+
+	if (r < 0)
+	{
+	    LOG_ERROR("Error calling waitpid(): " << strerror(errno));
+	    stage.reaped = true;
+	    return true;
+	}
+    }
+
+    stage.retstatus = status;
+    stage.reaped = true;
+
+    if (WIFEXITED(status))
+    {
+	LOG_INFO("Finished exec() stage " << stage.pid << " with retcode " << WEXITSTATUS(status));
+    }
+    else if (WIFSIGNALED(status))
+    {
+	LOG_INFO("Finished exec() stage " << stage.pid << " with signal " << WTERMSIG(status));
+    }
+    else
+    {
+	LOG_ERROR("Error in wait(): unknown return status for pid " << stage.pid);
+    }
+
+    return true;
+}
+
+Poller* ExecPipeImpl::create_poller(enum ExecPipe::PollEngine pe)
+{
+#if STX_EXECPIPE_HAVE_IO_URING
+    if (pe == ExecPipe::PE_IO_URING)
+    {
+	try {
+	    return new IoUringPoller;
+	}
+	catch (std::runtime_error& e)
+	{
+	    LOG_INFO(e.what() << ", falling back to epoll().");
+	}
+    }
+#else
+    if (pe == ExecPipe::PE_IO_URING)
+	LOG_INFO("io_uring backend not compiled in, falling back to epoll().");
+#endif
+
+#if STX_EXECPIPE_HAVE_EPOLL
+    if (pe != ExecPipe::PE_SELECT)
+    {
+	try {
+	    return new EpollPoller;
+	}
+	catch (std::runtime_error& e)
+	{
+	    LOG_INFO(e.what() << ", falling back to select().");
+	}
+    }
+#else
+    if (pe != ExecPipe::PE_AUTO && pe != ExecPipe::PE_SELECT)
+	LOG_INFO("epoll() backend not compiled in, falling back to select().");
+#endif
+
+    return new SelectPoller;
+}
+
+void ExecPipeImpl::pclose(int& fd)
+{
+    if (m_poller) m_poller->unwatch(fd);
+    sclose(fd);
+    fd = -1;
+}
+
+void ExecPipeImpl::function_state_read(unsigned int st)
+{
+    Stage& stage = m_stages[st];
+
+    while (1)
+    {
+	ssize_t rb = read(stage.statefd, &m_buffer[0], m_buffer.size());
+	++m_syscall_count;
+
+	LOG_TRACE("Read on state fd: " << rb);
+
+	if (rb > 0)
+	{
+	    stage.state.append(&m_buffer[0], rb);
+	    continue;
+	}
+
+	if (rb < 0 && errno == EINTR) continue;
+	if (rb < 0 && errno == EAGAIN) return;
+
+	if (rb < 0)
+	    LOG_ERROR("Error reading function stage state: " << strerror(errno));
+
+	pclose(stage.statefd);
+	return;
+    }
+}
+
+void ExecPipeImpl::abort_pipe(int sig)
+{
+    for (unsigned int i = 0; i < m_stages.size(); ++i)
+    {
+	Stage& stage = m_stages[i];
+
+	if (stage.in_parent())
+	{
+	    if (stage.stdin_fd >= 0)
+		pclose(stage.stdin_fd);
+
+	    if (stage.stdout_fd >= 0)
+		pclose(stage.stdout_fd);
+
+	    // discard buffered data, it cannot be delivered anymore.
+	    stage.outbuffer.clear();
+	    stage.tee_blocked = false;
+	    stage.throttled = false;
+	    stage.broken = true;
+
+	    // the worker quits and is joined by the event loop.
+	    if (stage.worker_busy)
+		worker_interrupt(i);
+	}
+	else if (stage.pid > 0 && !stage.reaped)
+	{
+	    LOG_INFO("Sending signal " << sig << " to stage " << i << " pid " << stage.pid);
+
+	    kill(stage.pid, sig);
+	}
+    }
+
+    if (m_input_files_fd >= 0)
+    {
+	sclose(m_input_files_fd);
+	m_input_files_fd = -1;
+    }
+
+    m_input_rbuffer.clear();
+
+    if (m_input_fd >= 0)
+	pclose(m_input_fd);
+
+    if (m_output_fd >= 0)
+	pclose(m_output_fd);
+
+#if STX_EXECPIPE_HAVE_THREADS
+    // a threaded sink quits without eof() like an inline one, its worker is
+    // joined by the event loop.
+    if (m_sink_worker && !m_sink_worker->joined)
+	m_sink_worker->interrupt();
+#endif
+}
+
+bool ExecPipeImpl::stage_may_read(unsigned int st)
+{
+    if (!m_stages[st].may_read())
+	return false;
+
+#if STX_EXECPIPE_HAVE_THREADS
+    if (m_stages[st].worker_busy && m_stages[st].worker->input.full())
+	return false;
+#endif
+
+    return true;
+}
+
+bool ExecPipeImpl::sink_may_read()
+{
+#if STX_EXECPIPE_HAVE_THREADS
+    if (m_sink_worker && m_sink_worker->input.full())
+	return false;
+#endif
+
+    return true;
+}
+
+bool ExecPipeImpl::queue_read(int fd, unsigned int chunk)
+{
+    if (m_poller->busy(fd)) return true;
+
+    unsigned int size;
+    if (!m_poller->transfer_buffer(fd, size)) return false;
+
+    // the completion marks fd ready, a poll would race with the transfer.
+    m_poller->watch(fd, 0);
+    m_poller->read_async(fd, std::min(chunk, size));
+    return true;
+}
+
+bool ExecPipeImpl::queue_write(int fd, const RingBuffer& rbuffer)
+{
+    if (m_poller->busy(fd)) return true;
+
+    unsigned int size;
+    char* buffer = m_poller->transfer_buffer(fd, size);
+    if (!buffer) return false;
+
+    // copy both segments, the ring buffer may grow or wrap until the write
+    // completes and its bytes are consumed.
+    unsigned int len = std::min(rbuffer.bottomsize(), size);
+    memcpy(buffer, rbuffer.bottom(), len);
+
+    unsigned int wlen = std::min(rbuffer.wrappedsize(), size - len);
+    memcpy(buffer + len, rbuffer.wrapped(), wlen);
+
+    m_poller->watch(fd, 0);
+    m_poller->write_async(fd, len + wlen);
+    return true;
+}
+
+void ExecPipeImpl::start_workers()
+{
+    for (unsigned int i = 0; i < m_stages.size(); ++i)
+    {
+	Stage& stage = m_stages[i];
+
+	if (!stage.func || stage.mode != ExecPipe::FM_THREAD) continue;
+
+#if STX_EXECPIPE_HAVE_THREADS
+	launch_worker(stage.worker, new ThreadWorker(this, ThreadWorker::TW_FUNCTION, i));
+	stage.worker_busy = true;
+
+	LOG_DEBUG("Started worker thread for function stage " << i);
+#else
+	LOG_DEBUG("Running function stage " << i << " inline, no thread support");
+#endif
+    }
+
+#if STX_EXECPIPE_HAVE_THREADS
+    if (m_input == ST_OBJECT && m_input_source_mode == ExecPipe::FM_THREAD && m_input_fd >= 0)
+    {
+	launch_worker(m_source_worker, new ThreadWorker(this, ThreadWorker::TW_SOURCE));
+
+	LOG_DEBUG("Started worker thread for input source");
+    }
+
+    if (m_output == ST_OBJECT && m_output_sink_mode == ExecPipe::FM_THREAD && m_output_fd >= 0)
+    {
+	launch_worker(m_sink_worker, new ThreadWorker(this, ThreadWorker::TW_SINK));
+
+	LOG_DEBUG("Started worker thread for output sink");
+    }
+#endif
+}
+
+#if STX_EXECPIPE_HAVE_THREADS
+void ExecPipeImpl::launch_worker(ThreadWorker*& slot, ThreadWorker* worker)
+{
+    // the thread looks up its state via the slot.
+    slot = worker;
+
+    int err = pthread_create(&worker->thread, NULL, &ExecPipeImpl::worker_thread, worker);
+    if (err != 0)
+    {
+	slot = NULL;
+	delete worker;
+	throw(std::runtime_error(std::string("Could not create worker thread: ") + strerror(err)));
+    }
+}
+#endif
+
+void ExecPipeImpl::stop_worker(ThreadWorker*& slot)
+{
+#if STX_EXECPIPE_HAVE_THREADS
+    if (!slot) return;
+
+    // a worker which was not joined yet is still watched.
+    if (m_poller && !slot->joined)
+	m_poller->unwatch(slot->wake_loop.fd());
+
+    slot->stop();
+
+    delete slot;
+    slot = NULL;
+#else
+    (void)slot;
+#endif
+}
+
+void ExecPipeImpl::stop_workers()
+{
+    for (unsigned int i = 0; i < m_stages.size(); ++i)
+    {
+	stop_worker(m_stages[i].worker);
+	m_stages[i].worker_busy = false;
+    }
+
+    stop_worker(m_source_worker);
+    stop_worker(m_sink_worker);
+}
+
+void* ExecPipeImpl::worker_thread(void* arg)
+{
+#if STX_EXECPIPE_HAVE_THREADS
+    ThreadWorker* worker = static_cast<ThreadWorker*>(arg);
+
+    switch (worker->role)
+    {
+    case ThreadWorker::TW_FUNCTION:
+	worker->impl->worker_main(worker->stageid);
+	break;
+    case ThreadWorker::TW_SOURCE:
+	worker->impl->source_worker_main();
+	break;
+    case ThreadWorker::TW_SINK:
+	worker->impl->sink_worker_main();
+	break;
+    }
+#else
+    (void)arg;
+#endif
+    return NULL;
+}
+
+void ExecPipeImpl::worker_main(unsigned int st)
+{
+#if STX_EXECPIPE_HAVE_THREADS
+    // only the function and the worker state are used on this thread.
+    PipeFunction* func = m_stages[st].func;
+    ThreadWorker& worker = *m_stages[st].worker;
+
+    ThreadWorker::Chunk* chunk = NULL;
+
+    try
+    {
+	while ((chunk = worker.pop_input()) != NULL)
+	{
+	    func->process(&(*chunk)[0], chunk->size());
+
+	    delete chunk;
+	    chunk = NULL;
+
+	    worker.flush();
+
+	    if (func->m_done) break;
+	}
+
+	if (!__atomic_load_n(&worker.cancel, __ATOMIC_ACQUIRE))
+	{
+	    func->eof();
+	    worker.flush();
+	}
+    }
+    catch (std::exception& e)
+    {
+	worker.error = std::string("Exception in function stage thread: ") + e.what();
+    }
+    catch (...)
+    {
+	worker.error = "Unknown exception in function stage thread.";
+    }
+
+    delete chunk;
+
+    // all output was pushed before finished is seen.
+    __atomic_store_n(&worker.finished, true, __ATOMIC_RELEASE);
+    worker.wake_loop.notify();
+#else
+    (void)st;
+#endif
+}
+
+bool ExecPipeImpl::worker_fill(ThreadWorker* worker, int fd, unsigned int edge)
+{
+#if STX_EXECPIPE_HAVE_THREADS
+    while (!worker->input.full())
+    {
+	size_t size = m_read_chunk[edge].size;
+
+	// read directly into the chunk passed to the worker.
+	ThreadWorker::Chunk* chunk = new ThreadWorker::Chunk(size);
+
+	ssize_t rb = read(fd, &(*chunk)[0], size);
+	++m_syscall_count;
+
+	LOG_TRACE("Read on fd for worker: " << rb);
+
+	if (rb <= 0)
+	{
+	    delete chunk;
+
+	    // zero read indicates eof
+	    if (rb == 0)
+		return false;
+
+	    if (errno == EINTR)
+		continue;
+
+	    if (errno != EAGAIN)
+		LOG_ERROR("Error reading from file descriptor for worker: " << strerror(errno));
+
+	    return true;
+	}
+
+	chunk->resize(rb);
+
+	worker->input.push(chunk);
+	worker->wake_worker.notify();
+
+	m_read_chunk[edge].update(rb, m_read_adaptive);
+
+	// a short read means the pipe was drained.
+	if (static_cast<size_t>(rb) < size)
+	    return true;
+    }
+#else
+    (void)worker; (void)fd; (void)edge;
+#endif
+    return true;
+}
+
+void ExecPipeImpl::worker_read(unsigned int st)
+{
+    Stage& stage = m_stages[st];
+
+    if (!worker_fill(stage.worker, stage.stdin_fd, st))
+    {
+	LOG_INFO("Closing stage input file descriptor");
+
+	worker_close_input(st);
+	pclose(stage.stdin_fd);
+    }
+}
+
+void ExecPipeImpl::worker_drain(unsigned int st)
+{
+#if STX_EXECPIPE_HAVE_THREADS
+    Stage& stage = m_stages[st];
+    ThreadWorker* worker = stage.worker;
+
+    // read finished before the queue, the worker pushed its output before.
+    bool finished = __atomic_load_n(&worker->finished, __ATOMIC_ACQUIRE);
+
+    ThreadWorker::Chunk* chunk;
+
+    // output without a pipe to write it to is discarded unthrottled.
+    while ((stage.buffer_high == 0 || stage.stdout_fd < 0
+	    || stage.outbuffer.size() < stage.buffer_high)
+	   && worker->output.pop(chunk))
+    {
+	if (!stage.broken && stage.stdout_fd >= 0)
+	    stage.outbuffer.write(&(*chunk)[0], chunk->size());
+
+	delete chunk;
+
+	// space in the output queue for a waiting worker.
+	worker->wake_worker.notify();
+    }
+
+    if (!finished || !worker->output.empty())
+	return;
+
+    pthread_join(worker->thread, NULL);
+    worker->joined = true;
+
+    m_poller->unwatch(worker->wake_loop.fd());
+    stage.worker_busy = false;
+
+    LOG_DEBUG("Joined worker thread of function stage " << st);
+
+    if (!worker->error.empty())
+	throw(std::runtime_error(worker->error));
+
+    // the function called done() and needs no more input.
+    if (stage.stdin_fd >= 0)
+    {
+	LOG_INFO("Closing stage input file descriptor early");
+	pclose(stage.stdin_fd);
+    }
+#else
+    (void)st;
+#endif
+}
+
+void ExecPipeImpl::worker_close_input(unsigned int st)
+{
+#if STX_EXECPIPE_HAVE_THREADS
+    m_stages[st].worker->close_input();
+#else
+    (void)st;
+#endif
+}
+
+void ExecPipeImpl::worker_interrupt(unsigned int st)
+{
+#if STX_EXECPIPE_HAVE_THREADS
+    m_stages[st].worker->interrupt();
+#else
+    (void)st;
+#endif
+}
+
+void ExecPipeImpl::source_worker_main()
+{
+#if STX_EXECPIPE_HAVE_THREADS
+    // only the source and the worker state are used on this thread.
+    ThreadWorker& worker = *m_source_worker;
+
+    try
+    {
+	// poll() may block, each call may generate about a chunk of data.
+	while (!__atomic_load_n(&worker.cancel, __ATOMIC_ACQUIRE))
+	{
+	    bool more = m_input_source->poll(ThreadWorker::chunk_max);
+	    worker.flush();
+
+	    if (!more) break;
+	}
+    }
+    catch (std::exception& e)
+    {
+	worker.error = std::string("Exception in input source thread: ") + e.what();
+    }
+    catch (...)
+    {
+	worker.error = "Unknown exception in input source thread.";
+    }
+
+    // all output was pushed before finished is seen.
+    __atomic_store_n(&worker.finished, true, __ATOMIC_RELEASE);
+    worker.wake_loop.notify();
+#endif
+}
+
+void ExecPipeImpl::source_worker_write()
+{
+#if STX_EXECPIPE_HAVE_THREADS
+    ThreadWorker* worker = m_source_worker;
+
+    while (m_input_fd >= 0)
+    {
+	if (!m_input_rbuffer.size())
+	{
+	    // read finished before the queue, the source pushed its data before.
+	    bool finished = worker->is_finished();
+
+	    ThreadWorker::Chunk* chunk;
+
+	    if (worker->output.pop(chunk))
+	    {
+		m_input_rbuffer.write(&(*chunk)[0], chunk->size());
+		delete chunk;
+
+		// space in the queue for a waiting source.
+		worker->wake_worker.notify();
+		continue;
+	    }
+
+	    if (!finished) return;
+
+	    pclose(m_input_fd);
+
+	    LOG_INFO("Closing input file descriptor");
+	    return;
+	}
+
+	// write buffered data to first stdin file descriptor.
+
+	ssize_t wb = write_ringbuffer(m_input_fd, m_input_rbuffer);
+
+	LOG_TRACE("Write on input fd: " << wb);
+
+	if (wb < 0)
+	{
+	    if (errno == EAGAIN) return;
+
+	    LOG_INFO("Error writing to input file descriptor: " << strerror(errno));
+
+	    // the worker is cancelled by source_worker_check().
+	    m_input_rbuffer.clear();
+	    pclose(m_input_fd);
+	    return;
+	}
+
+	// input pipe is full, wait until it becomes writable.
+	if (m_input_rbuffer.size())
+	    return;
+    }
+#endif
+}
+
+void ExecPipeImpl::source_worker_check()
+{
+#if STX_EXECPIPE_HAVE_THREADS
+    ThreadWorker* worker = m_source_worker;
+
+    if (worker->joined) return;
+
+    bool finished = worker->is_finished();
+
+    if (m_input_fd >= 0)
+    {
+	// keep forwarding data, unless the source failed.
+	if (!finished || worker->error.empty())
+	    return;
+    }
+    else if (!finished)
+    {
+	// the input pipe was closed early, no more data is needed.
+	worker->interrupt();
+	return;
+    }
+
+    m_poller->unwatch(worker->wake_loop.fd());
+    worker->stop();
+
+    LOG_DEBUG("Joined worker thread of input source");
+
+    if (!worker->error.empty())
+	throw(std::runtime_error(worker->error));
+#endif
+}
+
+void ExecPipeImpl::sink_worker_main()
+{
+#if STX_EXECPIPE_HAVE_THREADS
+    // only the sink and the worker state are used on this thread.
+    ThreadWorker& worker = *m_sink_worker;
+
+    ThreadWorker::Chunk* chunk = NULL;
+
+    try
+    {
+	while ((chunk = worker.pop_input()) != NULL)
+	{
+	    m_output_sink->process(&(*chunk)[0], chunk->size());
+
+	    delete chunk;
+	    chunk = NULL;
+
+	    if (m_output_sink->m_done) break;
+	}
+
+	if (!__atomic_load_n(&worker.cancel, __ATOMIC_ACQUIRE))
+	    m_output_sink->eof();
+    }
+    catch (std::exception& e)
+    {
+	worker.error = std::string("Exception in output sink thread: ") + e.what();
+    }
+    catch (...)
+    {
+	worker.error = "Unknown exception in output sink thread.";
+    }
+
+    delete chunk;
+
+    __atomic_store_n(&worker.finished, true, __ATOMIC_RELEASE);
+    worker.wake_loop.notify();
+#endif
+}
+
+void ExecPipeImpl::sink_worker_read()
+{
+#if STX_EXECPIPE_HAVE_THREADS
+    if (!worker_fill(m_sink_worker, m_output_fd, m_stages.size()))
+    {
+	LOG_INFO("Closing output file descriptor");
+
+	m_sink_worker->close_input();
+	pclose(m_output_fd);
+    }
+#endif
+}
+
+void ExecPipeImpl::sink_worker_check()
+{
+#if STX_EXECPIPE_HAVE_THREADS
+    ThreadWorker* worker = m_sink_worker;
+
+    if (worker->joined || !worker->is_finished()) return;
+
+    m_poller->unwatch(worker->wake_loop.fd());
+    worker->stop();
+
+    LOG_DEBUG("Joined worker thread of output sink");
+
+    if (!worker->error.empty())
+	throw(std::runtime_error(worker->error));
+
+    // the sink called done() and needs no more data, the last stage then
+    // fails to write with EPIPE.
+    if (m_output_fd >= 0)
+    {
+	LOG_INFO("Closing output file descriptor early");
+	pclose(m_output_fd);
+    }
+#endif
+}
+
+void ExecPipeImpl::stage_input_done(unsigned int st)
+{
+    Stage& stage = m_stages[st];
+
+    LOG_INFO("Closing stage input file descriptor early");
+
+    // a worker whose output broke discards its queued input.
+    if (stage.worker_busy && stage.broken)
+	worker_interrupt(st);
+    else if (stage.worker_busy)
+	worker_close_input(st);
+    else
+	stage.sink()->eof();
+
+    pclose(stage.stdin_fd);
+}
+
+void ExecPipeImpl::stage_output_broken(unsigned int st)
+{
+    Stage& stage = m_stages[st];
+
+    LOG_INFO("Stage " << st << " output was closed by the next stage");
+
+    pclose(stage.stdout_fd);
+
+    stage.outbuffer.clear();
+    stage.tee_blocked = false;
+    stage.broken = true;
+
+    if (stage.stdin_fd >= 0)
+	stage_input_done(st);
+}
+
+void ExecPipeImpl::check_failure(unsigned int i)
+{
+    if (m_failure_policy != ExecPipe::FP_ABORT || m_failed_stage >= 0)
+	return;
+
+    if (!stage_failed(m_stages[i]))
+	return;
+
+    LOG_ERROR("Aborting pipe after stage " << i << " failed");
+
+    // the event loop then only waits for the terminated children.
+    m_failed_stage = i;
+    abort_pipe(SIGTERM);
+}
+
+int ExecPipeImpl::check_deadlines()
+{
+    long long now = monotonic_msec(), next = -1;
+
+    if (m_deadline && !m_timed_out)
+    {
+	if (now >= m_deadline)
+	{
+	    LOG_ERROR("Aborting pipe after its deadline expired");
+
+	    m_timed_out = true;
+
+	    for (unsigned int i = 0; i < m_stages.size(); ++i)
+	    {
+		Stage& stage = m_stages[i];
+		if (stage.in_parent() || stage.pid <= 0 || stage.reaped) continue;
+
+		stage.timed_out = true;
+		stage.kill_time = now + m_timeout_grace;
+	    }
+
+	    abort_pipe(m_timeout_signal);
+	}
+	else
+	    next = m_deadline - now;
+    }
+
+    for (unsigned int i = 0; i < m_stages.size(); ++i)
+    {
+	Stage& stage = m_stages[i];
+	if (stage.in_parent() || stage.pid <= 0 || stage.reaped) continue;
+
+	if (stage.deadline && !stage.timed_out)
+	{
+	    if (now >= stage.deadline)
+	    {
+		LOG_ERROR("Sending signal " << m_timeout_signal << " to stage " << i
+			  << " pid " << stage.pid << " after its deadline expired");
+
+		kill(stage.pid, m_timeout_signal);
+
+		stage.timed_out = true;
+		stage.kill_time = now + m_timeout_grace;
+	    }
+	    else if (next < 0 || stage.deadline - now < next)
+		next = stage.deadline - now;
+	}
+
+	if (stage.kill_time)
+	{
+	    if (now >= stage.kill_time)
+	    {
+		LOG_ERROR("Killing stage " << i << " pid " << stage.pid << " after its grace period");
+
+		kill(stage.pid, SIGKILL);
+		stage.kill_time = 0;
+	    }
+	    else if (next < 0 || stage.kill_time - now < next)
+		next = stage.kill_time - now;
+	}
+    }
+
+    return static_cast<int>(next);
+}
+
+// --- ExecPipeImpl::run() ---------------------------------------------- //
+
+void ExecPipeImpl::run_start(Poller* poller)
+{
+    if (m_stages.size() == 0)
+	throw(std::runtime_error("No stages to in exec pipe."));
+
+    if (m_step != SS_NONE)
+	throw(std::runtime_error("Exec pipe is still running."));
+
+    // free worker threads and the event loop backend left over by an
+    // exception in the last run().
+    stop_workers();
+
+    if (m_poller && m_poller_owned) delete m_poller;
+    m_poller = NULL;
+
+    // children are only reaped once they were launched.
+    for (unsigned int i = 0; i < m_stages.size(); ++i)
+    {
+	if (m_stages[i].in_parent()) continue;
+
+	m_stages[i].pid = 0;
+	m_stages[i].reaped = true;
+    }
+
+    // *** Phase 1: prepare all file descriptors ************************* //
+
+    m_syscall_count = 0;
+    m_poll_count = 0;
+
+    // the pipe's deadline includes launching the children.
+    m_deadline = m_timeout ? monotonic_msec() + m_timeout : 0;
+    m_timed_out = false;
+
+    m_deadlines = (m_timeout != 0);
+
+    // edge i is the pipe into stage i, edge size() the output pipe.
+    m_edge_granted.assign(m_stages.size() + 1, 0);
+
+    unsigned int pipe_max_size = read_pipe_max_size();
+
+    // set up input stream accordingly
+    switch(m_input)
+    {
+    case ST_NONE:
+	// no file change of file descriptor after fork.
+	m_stages[0].stdin_fd = -1;
+	break;
+
+    case ST_FILELIST:
+	// check that all input files are readable before launching anything.
+	assert(m_input_files);
+	for (unsigned int i = 0; i < m_input_files->size(); ++i)
+	{
+	    if (access((*m_input_files)[i].c_str(), R_OK) != 0)
+		throw(std::runtime_error(std::string("Could not read input file ") + (*m_input_files)[i] + ": " + strerror(errno)));
+	}
+
+	m_input_files_pos = 0;
+	m_input_files_fd = -1;
+	m_input_files_splice = true;
+	m_input_rbuffer.clear();
+
+	// the input pipe is created like for strings and objects
+	// fall through
+
+    case ST_STRING:
+    case ST_OBJECT: {
+	// create input pipe for strings, file lists and function objects.
+	int pipefd[2];
+
+	if (pipe_cloexec(pipefd) != 0)
+	    throw(std::runtime_error(std::string("Could not create an input pipe: ") + strerror(errno)));
+
+	if (fcntl(pipefd[1], F_SETFL, O_NONBLOCK) != 0)
+	    throw(std::runtime_error(std::string("Could not set non-block mode on input pipe: ") + strerror(errno)));
+
+	// a function stage in the parent must not block on its input.
+	if (m_stages[0].in_parent())
+	{
+	    if (fcntl(pipefd[0], F_SETFL, O_NONBLOCK) != 0)
+		throw(std::runtime_error(std::string("Could not set non-block mode on input pipe: ") + strerror(errno)));
+	}
+
+	m_input_fd = pipefd[1];
+	m_stages[0].stdin_fd = pipefd[0];
+
+	m_input_string_pos = 0;
+	m_input_source_eof = false;
+	m_input_rbuffer.clear();
+
+	setup_pipe_capacity(0, m_input_fd, pipe_max_size);
+	m_input_pipe_capacity = m_edge_granted[0];
+	break;
+    }
+    case ST_FILE: {
+	// open input file
+
+	int infd = open(m_input_file, O_RDONLY | O_CLOEXEC);
+	if (infd < 0)
+	    throw(std::runtime_error(std::string("Could not open input file: ") + strerror(errno)));
+
+	m_stages[0].stdin_fd = infd;
+	break;
+    }
+    case ST_FD:
+	// assign user-provided fd to first process
+	m_stages[0].stdin_fd = m_input_fd;
+	m_input_fd = -1;
+	break;
+    }
+
+    // apply default buffer limits and reset run state of function stages
+    for (unsigned int i = 0; i < m_stages.size(); ++i)
+    {
+	if (!m_stages[i].buffer_user)
+	{
+	    m_stages[i].buffer_high = m_buffer_high;
+	    m_stages[i].buffer_low = m_buffer_low;
+	}
+
+	m_stages[i].throttled = false;
+	m_stages[i].buffer_peak = 0;
+	m_stages[i].broken = false;
+
+	if (m_stages[i].sink())
+	    m_stages[i].sink()->m_done = false;
+    }
+
+    if (m_output == ST_OBJECT)
+	m_output_sink->m_done = false;
+
+    // create pipes between exec stages
+    for (unsigned int i = 0; i < m_stages.size() - 1; ++i)
+    {
+	int pipefd[2];
+
+	if (pipe_cloexec(pipefd) != 0)
+	    throw(std::runtime_error(std::string("Could not create a stage pipe: ") + strerror(errno)));
+
+	m_stages[i].stdout_fd = pipefd[1];
+	m_stages[i+1].stdin_fd = pipefd[0];
+
+	setup_pipe_capacity(i+1, pipefd[1], pipe_max_size);
+
+	if (m_stages[i].in_parent())
+	{
+	    if (fcntl(m_stages[i].stdout_fd, F_SETFL, O_NONBLOCK) != 0)
+		throw(std::runtime_error(std::string("Could not set non-block mode on a stage pipe: ") + strerror(errno)));
+	}
+	if (m_stages[i+1].in_parent())
+	{
+	    if (fcntl(m_stages[i+1].stdin_fd, F_SETFL, O_NONBLOCK) != 0)
+		throw(std::runtime_error(std::string("Could not set non-block mode on a stage pipe: ") + strerror(errno)));
+	}
+    }
+
+    // set up output stream accordingly
+    switch(m_output)
+    {
+    case ST_NONE:
+	// no file change of file descriptor after fork.
+	m_stages.back().stdout_fd = -1;
+	break;
+
+    case ST_STRING: 
+    case ST_OBJECT: {
+	// create output pipe for strings and objects.
+	int pipefd[2];
+
+	if (pipe_cloexec(pipefd) != 0)
+	    throw(std::runtime_error(std::string("Could not create an output pipe: ") + strerror(errno)));
+
+	if (fcntl(pipefd[0], F_SETFL, O_NONBLOCK) != 0)
+	    throw(std::runtime_error(std::string("Could not set non-block mode on output pipe: ") + strerror(errno)));
+
+	// a function stage in the parent must not block on its output.
+	if (m_stages.back().in_parent())
+	{
+	    if (fcntl(pipefd[1], F_SETFL, O_NONBLOCK) != 0)
+		throw(std::runtime_error(std::string("Could not set non-block mode on output pipe: ") + strerror(errno)));
+	}
+
+	m_stages.back().stdout_fd = pipefd[1];
+	m_output_fd = pipefd[0];
+
+	setup_pipe_capacity(m_stages.size(), m_output_fd, pipe_max_size);
+	break;
+    }
+    case ST_FILE: {
+	// create or truncate output file
+
+	int outfd = open(m_output_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, m_output_file_mode);
+	if (outfd < 0)
+	    throw(std::runtime_error(std::string("Could not open output file: ") + strerror(errno)));
+
+	m_stages.back().stdout_fd = outfd;
+	break;
+    }
+    case ST_FD:
+	// assign user-provided fd to last process
+	m_stages.back().stdout_fd = m_output_fd;
+	m_output_fd = -1;
+	break;
+
+    case ST_FILELIST:
+	// file lists can only be used as input stream.
+	assert(0);
+	break;
+    }
+
+    setup_read_chunks();
+
+    // *** Phase 2: launch child processes ******************************* //
+
+    m_failed_stage = -1;
+
+    for (unsigned int i = 0; i < m_stages.size(); ++i)
+    {
+	if (m_stages[i].in_parent()) continue;
+
+	m_stages[i].pid = 0;
+	m_stages[i].pidfd = -1;
+	m_stages[i].statusfd = -1;
+	m_stages[i].exec_errno = 0;
+	m_stages[i].deadline = 0;
+	m_stages[i].kill_time = 0;
+	m_stages[i].timed_out = false;
+
+	// left over by an exception in the last run().
+	if (m_stages[i].statefd >= 0)
+	    pclose(m_stages[i].statefd);
+
+	if (m_failed_stage >= 0)
+	{
+	    // not launched after an earlier stage failed.
+	    m_stages[i].retstatus = SIGTERM;
+	    m_stages[i].reaped = true;
+	    continue;
+	}
+
+	m_stages[i].reaped = false;
+
+	pid_t child;
+
+	if (m_stages[i].func)
+	{
+	    // the function runs in a copy of this process, thus always fork.
+	    child = launch_function(i);
+	}
+	else
+	{
+	    print_exec(m_stages[i].args);
+
+	    prepare_exec(m_stages[i]);
+
+	    if ((m_launch_engine == ExecPipe::LE_AUTO || m_launch_engine == ExecPipe::LE_SERVER)
+		&& ForkServer::instance().running())
+		child = launch_server(i);
+#if STX_EXECPIPE_HAVE_SPAWN
+	    else if (m_launch_engine != ExecPipe::LE_FORK)
+		child = launch_spawn(i);
+#endif
+	    else
+		child = launch_fork(i);
+	}
+
+	if (child < 0)
+	{
+	    LOG_ERROR("Error executing child process "
+		      << (m_stages[i].func ? "of function stage" : m_stages[i].prog)
+		      << ": " << strerror(errno));
+
+	    // report like a child which failed to exec().
+	    child = 0;
+	    m_stages[i].exec_errno = errno;
+	    m_stages[i].retstatus = 255 << 8;
+	    m_stages[i].reaped = true;
+
+	    m_failed_stage = i;
+	}
+#if STX_EXECPIPE_HAVE_PIDFD
+	else if (m_stages[i].statusfd < 0)
+	{
+	    // pidfds are close-on-exec, failure means an old kernel.
+	    m_stages[i].pidfd = syscall(SYS_pidfd_open, child, 0);
+	}
+#endif
+
+	if (m_stages[i].exec_fd >= 0)
+	{
+	    sclose(m_stages[i].exec_fd);
+	    m_stages[i].exec_fd = -1;
+	}
+
+	m_stages[i].pid = child;
+
+	if (child > 0 && m_stages[i].timeout)
+	{
+	    m_stages[i].deadline = monotonic_msec() + m_stages[i].timeout;
+	    m_deadlines = true;
+	}
+    }
+
+    // parent process: close all unneeded file descriptors of exec stages.
+
+    for (stagelist_type::const_iterator st = m_stages.begin();
+	 st != m_stages.end(); ++st)
+    {
+	if (st->in_parent()) continue;
+
+	if (st->stdin_fd >= 0)
+	    sclose(st->stdin_fd);
+
+	if (st->stdout_fd >= 0)
+	    sclose(st->stdout_fd);
+    }
+
+    // a failed exec() aborts the pipe before any data is processed.
+
+    if (m_failed_stage >= 0)
+    {
+	LOG_ERROR("Aborting pipe after stage " << m_failed_stage << " failed to execute");
+
+	// the event loop then only waits for the terminated children.
+	abort_pipe(SIGTERM);
+    }
+
+    // *** Phase 3: prepare event loop ********************************** //
+
+    m_poller_owned = (poller == NULL);
+    m_poller = poller ? poller : create_poller(m_poll_engine);
+
+    m_poll_engine_used = m_poller->engine();
+
+    LOG_DEBUG("Using " << m_poller->name() << " event loop backend");
+
+    start_workers();
+
+    // vmsplice() may be disabled during the run if the kernel refuses it.
+    m_run_vmsplice = m_input_vmsplice;
+}
+
+bool ExecPipeImpl::run_prepare(int& timeout)
+{
+    // signal children whose deadline expired, this may abort the pipe.
+
+    timeout = m_deadlines ? check_deadlines() : -1;
+
+    // collect output of function stages running on worker threads.
+
+    for (unsigned int i = 0; i < m_stages.size(); ++i)
+    {
+	if (m_stages[i].worker_busy)
+	    worker_drain(i);
+    }
+
+    if (m_source_worker)
+	source_worker_check();
+
+    if (m_sink_worker)
+	sink_worker_check();
+
+    // update the interest set, the backend only changes its registration
+    // when a file descriptor's interest differs from the last round.
+
+    bool active = false;
+
+    if (m_input_fd >= 0)
+    {
+	// the PipeSource is only polled once the input pipe is writable. a
+	// threaded source's data is written once its worker passed it.
+	if (m_source_worker && !m_input_rbuffer.size())
+	    m_poller->watch(m_input_fd, 0);
+	else
+	    m_poller->watch(m_input_fd, Poller::PL_WRITE);
+	active = true;
+
+	LOG_DEBUG("Poll on input file descriptor");
+    }
+
+    for (unsigned int i = 0; i < m_stages.size(); ++i)
+    {
+	if (!m_stages[i].in_parent()) continue;
+
+	if (m_stages[i].stdin_fd >= 0)
+	{
+	    // a blocked tee() or a full outbuffer must wait for the output
+	    // to drain, this pushes back on the upstream stages.
+	    if (!stage_may_read(i))
+	    {
+		m_poller->watch(m_stages[i].stdin_fd, 0);
+
+		LOG_DEBUG("Throttle stage input file descriptor");
+	    }
+	    else if ((!m_stages[i].observer || m_stages[i].tee_copy) && !m_stages[i].worker_busy
+		     && queue_read(m_stages[i].stdin_fd, m_read_chunk[i].size))
+	    {
+		LOG_DEBUG("Read on stage input file descriptor");
+	    }
+	    else
+	    {
+		m_poller->watch(m_stages[i].stdin_fd,
+				m_stages[i].tee_blocked ? 0 : Poller::PL_READ);
+
+		LOG_DEBUG("Poll on stage input file descriptor");
+	    }
+	    active = true;
+	}
+
+	if (m_stages[i].stdout_fd >= 0)
+	{
+	    if (m_stages[i].outbuffer.size() && !m_stages[i].tee_blocked
+		&& queue_write(m_stages[i].stdout_fd, m_stages[i].outbuffer))
+	    {
+		active = true;
+
+		LOG_DEBUG("Write on stage output file descriptor");
+	    }
+	    else if (m_stages[i].outbuffer.size() || m_stages[i].tee_blocked)
+	    {
+		m_poller->watch(m_stages[i].stdout_fd, Poller::PL_WRITE);
+		active = true;
+
+		LOG_DEBUG("Poll on stage output file descriptor");
+	    }
+	    else if (m_stages[i].input_done() && !m_stages[i].outbuffer.size())
+	    {
+		pclose(m_stages[i].stdout_fd);
+
+		LOG_INFO("Close stage output file descriptor");
+	    }
+	    else
+	    {
+		m_poller->watch(m_stages[i].stdout_fd, 0);
+	    }
+	}
+    }
+
+    if (m_output_fd >= 0)
+    {
+	// a full queue of the sink's worker throttles the last stage.
+	if (!sink_may_read())
+	    m_poller->watch(m_output_fd, 0);
+	else if (m_sink_worker || !queue_read(m_output_fd, m_read_chunk.back().size))
+	    m_poller->watch(m_output_fd, Poller::PL_READ);
+	active = true;
+
+	LOG_DEBUG("Poll on output file descriptor");
+    }
+
+#if STX_EXECPIPE_HAVE_THREADS
+    // the source's and sink's workers notify about passed chunks and freed
+    // queue slots.
+    if (m_source_worker && !m_source_worker->joined)
+    {
+	m_poller->watch(m_source_worker->wake_loop.fd(), Poller::PL_READ);
+	active = true;
+    }
+    if (m_sink_worker && !m_sink_worker->joined)
+    {
+	m_poller->watch(m_sink_worker->wake_loop.fd(), Poller::PL_READ);
+	active = true;
+    }
+#endif
+
+    for (unsigned int i = 0; i < m_stages.size(); ++i)
+    {
+#if STX_EXECPIPE_HAVE_THREADS
+	// the worker notifies about output and freed input queue slots.
+	if (m_stages[i].worker_busy)
+	{
+	    m_poller->watch(m_stages[i].worker->wake_loop.fd(), Poller::PL_READ);
+	    active = true;
+	}
+#endif
+
+	// a pidfd or fork server status pipe becomes readable when the
+	// child exits.
+	if (m_stages[i].pidfd >= 0)
+	{
+	    m_poller->watch(m_stages[i].pidfd, Poller::PL_READ);
+	    active = true;
+	}
+	if (m_stages[i].statusfd >= 0)
+	{
+	    m_poller->watch(m_stages[i].statusfd, Poller::PL_READ);
+	    active = true;
+	}
+
+	// the state pipe of an FM_PROCESS worker ends when it exits.
+	if (m_stages[i].statefd >= 0)
+	{
+	    m_poller->watch(m_stages[i].statefd, Poller::PL_READ);
+	    active = true;
+	}
+    }
+
+    if (active) ++m_poll_count;
+
+    return active;
+}
+
+void ExecPipeImpl::run_dispatch()
+{
+    // handle file descriptors marked by the event loop backend
+
+    if (m_input_fd >= 0 && (m_poller->ready(m_input_fd) & Poller::PL_WRITE))
+    {
+	if (m_input == ST_STRING)
+	{
+	    // write string data to first stdin file descriptor.
+
+	    assert(m_input_string);
+	    assert(m_input_string_pos < m_input_string->size());
+
+	    ssize_t wb;
+
+	    do
+	    {
+		const char* data = m_input_string->data() + m_input_string_pos;
+		size_t len = m_input_string->size() - m_input_string_pos;
+
+		bool spliced = false;
+
+#if STX_EXECPIPE_HAVE_SPLICE
+		if (m_run_vmsplice && len >= VMSPLICE_MINIMUM)
+		{
+		    // map string pages into the pipe. vmsplice() is limited
+		    // to the free pipe capacity like write().
+		    struct iovec iov;
+		    iov.iov_base = const_cast<char*>(data);
+		    iov.iov_len = len;
+
+		    wb = vmsplice(m_input_fd, &iov, 1, SPLICE_F_NONBLOCK);
+		    ++m_syscall_count;
+		    spliced = true;
+
+		    LOG_TRACE("Vmsplice on input fd: " << wb);
+
+		    if (wb < 0 && (errno == EINVAL || errno == ENOSYS))
+		    {
+			LOG_DEBUG("Cannot vmsplice() into input pipe, writing instead: " << strerror(errno));
+			m_run_vmsplice = spliced = false;
+		    }
+		}
+#endif
+		if (!spliced)
+		{
+		    wb = write(m_input_fd, data, len);
+		    ++m_syscall_count;
+
+		    LOG_TRACE("Write on input fd: " << wb);
+		}
+
+		if (wb < 0)
+		{
+		    if (errno == EAGAIN || errno == EINTR)
+		    {
+		    }
+		    else
+		    {
+			LOG_DEBUG("Error writing to input file descriptor: " << strerror(errno));
+
+			pclose(m_input_fd);
+
+			LOG_INFO("Closing input file descriptor: " << strerror(errno));
+		    }
+		}
+		else if (wb > 0)
+		{
+		    m_input_string_pos += wb;
+
+		    if (m_input_string_pos >= m_input_string->size())
+		    {
+			pclose(m_input_fd);
+
+			LOG_INFO("Closing input file descriptor: " << strerror(errno));
+			break;
+		    }
+
+		    // a short write means the input pipe is full.
+		    if (static_cast<size_t>(wb) < len)
+			break;
+		}
+	    } while (wb > 0);
+
+	}
+	else if (m_input == ST_OBJECT && m_source_worker)
+	{
+	    source_worker_write();
+	}
+	else if (m_input == ST_OBJECT)
+	{
+	    input_source_poll();
+	}
+	else if (m_input == ST_FILELIST)
+	{
+	    input_files_write();
+	}
+    }
+
+#if STX_EXECPIPE_HAVE_THREADS
+    if (m_source_worker && !m_source_worker->joined
+	&& (m_poller->ready(m_source_worker->wake_loop.fd()) & Poller::PL_READ))
+    {
+	m_source_worker->wake_loop.wait();
+	source_worker_write();
+    }
+
+    if (m_sink_worker && !m_sink_worker->joined
+	&& (m_poller->ready(m_sink_worker->wake_loop.fd()) & Poller::PL_READ))
+    {
+	// a finished sink is joined at the top of the loop.
+	m_sink_worker->wake_loop.wait();
+    }
+#endif
+
+    if (m_output_fd >= 0 && (m_poller->ready(m_output_fd) & Poller::PL_READ)
+	&& m_sink_worker)
+    {
+	sink_worker_read();
+    }
+
+    if (m_output_fd >= 0 && (m_poller->ready(m_output_fd) & Poller::PL_READ)
+	&& !m_sink_worker)
+    {
+	// read data from last stdout file descriptor
+
+	ssize_t rb;
+
+	do
+	{
+	    errno = 0;
+
+	    size_t chunk = m_read_chunk.back().size;
+	    char* data = &m_buffer[0];
+
+	    // take the data of a read completed by the backend.
+	    bool queued = m_poller->result(m_output_fd, rb, data);
+
+	    if (!queued)
+	    {
+		rb = read(m_output_fd, data, chunk);
+		++m_syscall_count;
+	    }
+
+	    LOG_TRACE("Read on output fd: " << rb);
+
+	    if (rb <= 0)
+	    {
+		if (rb == 0 && errno == 0)
+		{
+		    // zero read indicates eof
+
+		    LOG_INFO("Closing output file descriptor: " << strerror(errno));
+
+		    if (m_output == ST_OBJECT)
+		    {
+			assert(m_output_sink);
+			m_output_sink->eof();
+		    }
+
+		    pclose(m_output_fd);
+		}
+		else if (errno == EAGAIN || errno == EINTR)
+		{
+		}
+		else
+		{
+		    LOG_ERROR("Error reading from output file descriptor: " << strerror(errno));
+		}
+	    }
+	    else
+	    {
+		if (m_output == ST_STRING)
+		{
+		    assert(m_output_string);
+		    m_output_string->append(data, rb);
+		}
+		else if (m_output == ST_OBJECT)
+		{
+		    assert(m_output_sink);
+		    m_output_sink->process(data, rb);
+
+		    if (m_output_sink->m_done)
+		    {
+			// the sink needs no more data, the last stage
+			// then fails to write with EPIPE.
+			LOG_INFO("Closing output file descriptor early");
+
+			m_output_sink->eof();
+
+			pclose(m_output_fd);
+			break;
+		    }
+		}
+
+		m_read_chunk.back().update(rb, m_read_adaptive);
+
+		// the next loop turn queues another read, a short read means
+		// the pipe was drained.
+		if (queued || static_cast<size_t>(rb) < chunk)
+		    break;
+	    }
+	} while (rb > 0);
+    }
+
+    for (unsigned int i = 0; i < m_stages.size(); ++i)
+    {
+	if (!m_stages[i].in_parent()) continue;
+
+#if STX_EXECPIPE_HAVE_THREADS
+	if (m_stages[i].worker_busy
+	    && (m_poller->ready(m_stages[i].worker->wake_loop.fd()) & Poller::PL_READ))
+	{
+	    // output is collected at the top of the loop.
+	    m_stages[i].worker->wake_loop.wait();
+	}
+#endif
+
+	if (m_stages[i].stdin_fd >= 0 && (m_poller->ready(m_stages[i].stdin_fd) & Poller::PL_READ)
+	    && m_stages[i].observer && !m_stages[i].tee_copy)
+	{
+	    observer_tee(i);
+	}
+
+	if (m_stages[i].stdin_fd >= 0 && (m_poller->ready(m_stages[i].stdin_fd) & Poller::PL_READ)
+	    && m_stages[i].worker_busy)
+	{
+	    worker_read(i);
+	}
+
+	if (m_stages[i].stdin_fd >= 0 && (m_poller->ready(m_stages[i].stdin_fd) & Poller::PL_READ)
+	    && (!m_stages[i].observer || m_stages[i].tee_copy) && !m_stages[i].worker_busy)
+	{
+	    ssize_t rb;
+
+	    do
+	    {
+		errno = 0;
+
+		size_t chunk = m_read_chunk[i].size;
+		char* data = &m_buffer[0];
+
+		bool queued = m_poller->result(m_stages[i].stdin_fd, rb, data);
+
+		if (!queued)
+		{
+		    rb = read(m_stages[i].stdin_fd, data, chunk);
+		    ++m_syscall_count;
+		}
+
+		LOG_TRACE("Read on stage fd: " << rb);
+
+		if (rb <= 0)
+		{
+		    if (rb == 0 && errno == 0)
+		    {
+			// zero read indicates eof
+
+			LOG_INFO("Closing stage input file descriptor: " << strerror(errno));
+
+			m_stages[i].sink()->eof();
+
+			pclose(m_stages[i].stdin_fd);
+		    }
+		    else if (errno == EAGAIN || errno == EINTR)
+		    {
+		    }
+		    else
+		    {
+			LOG_ERROR("Error reading from stage input file descriptor: " << strerror(errno));
+		    }
+		}
+		else
+		{
+		    m_stages[i].sink()->process(data, rb);
+
+		    if (m_stages[i].observer && m_stages[i].stdout_fd >= 0)
+			m_stages[i].outbuffer.write(data, rb);
+
+		    if (m_stages[i].sink()->m_done)
+		    {
+			stage_input_done(i);
+			break;
+		    }
+
+		    m_read_chunk[i].update(rb, m_read_adaptive);
+
+		    // stop reading once the high watermark is reached.
+		    if (!m_stages[i].may_read())
+			break;
+
+		    // the next loop turn queues another read, a short read
+		    // means the pipe was drained.
+		    if (queued || static_cast<size_t>(rb) < chunk)
+			break;
+		}
+	    } while (rb > 0);
+	}
+
+	if (m_stages[i].stdout_fd >= 0 && (m_poller->ready(m_stages[i].stdout_fd) & Poller::PL_WRITE))
+	{
+	    m_stages[i].tee_blocked = false;
+
+	    ssize_t wb;
+	    char* data;
+
+	    // consume the bytes of a write completed by the backend.
+	    if (m_poller->result(m_stages[i].stdout_fd, wb, data))
+	    {
+		if (wb > 0) m_stages[i].outbuffer.advance(wb);
+	    }
+	    else
+		wb = write_ringbuffer(m_stages[i].stdout_fd, m_stages[i].outbuffer);
+
+	    LOG_TRACE("Write on stage fd: " << wb);
+
+	    if (wb < 0 && errno == EPIPE)
+	    {
+		stage_output_broken(i);
+	    }
+	    else if (wb < 0 && errno != EAGAIN)
+	    {
+		LOG_INFO("Error writing to stage output file descriptor: " << strerror(errno));
+	    }
+
+	    if (m_stages[i].stdout_fd >= 0 &&
+		m_stages[i].input_done() && !m_stages[i].outbuffer.size())
+	    {
+		LOG_INFO("Closing stage output file descriptor: " << strerror(errno));
+
+		pclose(m_stages[i].stdout_fd);
+	    }
+	}
+    }
+
+    // record exits of exec stages as they happen.
+    for (unsigned int i = 0; i < m_stages.size(); ++i)
+    {
+	if (m_stages[i].statefd >= 0 && (m_poller->ready(m_stages[i].statefd) & Poller::PL_READ))
+	    function_state_read(i);
+
+	if (m_stages[i].pidfd >= 0 && (m_poller->ready(m_stages[i].pidfd) & Poller::PL_READ))
+	    reap_stage(m_stages[i]);
+	else if (m_stages[i].statusfd >= 0 && (m_poller->ready(m_stages[i].statusfd) & Poller::PL_READ))
+	    reap_stage(m_stages[i]);
+	else
+	    continue;
+
+	check_failure(i);
+    }
+}
+
+void ExecPipeImpl::run_stop()
+{
+    // all workers were joined when their stages finished.
+    stop_workers();
+
+    m_syscalls_saved = 0;
+
+    // a shared backend is owned by the ExecPipePool.
+    if (m_poller_owned)
+    {
+	m_syscalls_saved = m_poller->syscalls_saved();
+
+	if (m_syscalls_saved)
+	    LOG_INFO("Saved " << m_syscalls_saved << " system calls in " << m_poller->name() << " event loop");
+
+	delete m_poller;
+    }
+
+    m_poller = NULL;
+}
+
+bool ExecPipeImpl::run_reap(bool block)
+{
+    bool running = false;
+
+    for (unsigned int i = 0; i < m_stages.size(); ++i)
+    {
+	if (m_stages[i].in_parent() || m_stages[i].reaped) continue;
+
+	if (!reap_stage(m_stages[i], block))
+	    running = true;
+	else
+	    check_failure(i);
+    }
+
+    return !running;
+}
+
+void ExecPipeImpl::run_finish()
+{
+    // pass results of successful FM_PROCESS workers to the parent's objects.
+    for (unsigned int i = 0; i < m_stages.size(); ++i)
+    {
+	Stage& stage = m_stages[i];
+
+	if (!stage.func || stage.in_parent() || stage.pid <= 0) continue;
+
+	if (WIFEXITED(stage.retstatus) && WEXITSTATUS(stage.retstatus) == 0)
+	    stage.func->restore_state(stage.state);
+    }
+
+    LOG_INFO("Finished running pipe.");
+}
+
+void ExecPipeImpl::run()
+{
+    // writes into pipes closed early fail with EPIPE instead of SIGPIPE.
+    SigPipeGuard sigpipe_guard;
+
+    run_start(NULL);
+
+    // *** Phase 3: run event loop and process data ********************** //
+
+    int timeout;
+
+    while (run_prepare(timeout))
+    {
+	int retval = m_poller->wait(timeout);
+
+	LOG_TRACE(m_poller->name() << " wait on " << retval << " file descriptors: " << strerror(errno));
+
+	run_dispatch();
+    }
+
+    run_stop();
+
+    // *** Phase 4: wait for all remaining children processes ************ //
+
+    // only children without pidfd are left, wait for exactly those.
+    bool polling = m_deadlines || m_failure_policy == ExecPipe::FP_ABORT;
+
+    while (!run_reap(!polling))
+    {
+	// without pidfds, poll the children to enforce deadlines and the
+	// failure policy.
+
+	int timeout = check_deadlines();
+
+	if (timeout < 0 || timeout > 10)
+	    timeout = 10;
+
+	poll(NULL, 0, timeout);
+    }
+
+    run_finish();
+}
+
+void ExecPipeImpl::start()
+{
+    // writes into pipes closed early fail with EPIPE instead of SIGPIPE.
+    SigPipeGuard sigpipe_guard;
+
+    // the backend only collects the interest set for get_poll_fds().
+    ExternalPoller* poller = new ExternalPoller;
+
+    try {
+	run_start(poller);
+    }
+    catch (...) {
+	if (m_poller == poller) m_poller = NULL;
+	delete poller;
+	throw;
+    }
+
+    m_poller_owned = true;
+    m_step = SS_EVENTS;
+
+    step_advance();
+}
+
+int ExecPipeImpl::get_poll_fds(std::vector<ExecPipe::PollFd>& fds) const
+{
+    fds.clear();
+
+    if (m_step == SS_EVENTS)
+	static_cast<const ExternalPoller*>(m_poller)->interest_list(fds);
+
+    return (m_step == SS_NONE || m_step == SS_POOLED) ? -1 : m_step_timeout;
+}
+
+void ExecPipeImpl::on_ready(int fd, int events)
+{
+    if (m_step == SS_NONE || m_step == SS_POOLED) return;
+
+    // writes into pipes closed early fail with EPIPE instead of SIGPIPE.
+    SigPipeGuard sigpipe_guard;
+
+    try {
+	if (m_step == SS_EVENTS)
+	{
+	    ExternalPoller* poller = static_cast<ExternalPoller*>(m_poller);
+
+	    poller->set_ready(fd, events);
+	    run_dispatch();
+	    poller->reset_ready();
+	}
+
+	step_advance();
+    }
+    catch (...) {
+	// the pipe then only waits for its launched children.
+	if (m_step == SS_EVENTS)
+	    abort_pipe(SIGTERM);
+	throw;
+    }
+}
+
+void ExecPipeImpl::step_advance()
+{
+    if (m_step == SS_EVENTS)
+    {
+	if (run_prepare(m_step_timeout))
+	    return;
+
+	run_stop();
+	m_step = SS_REAPING;
+    }
+
+    // children without pidfd are polled, which never blocks.
+    if (!run_reap(false))
+    {
+	m_step_timeout = check_deadlines();
+
+	if (m_step_timeout < 0 || m_step_timeout > 10)
+	    m_step_timeout = 10;
+
+	return;
+    }
+
+    m_step = SS_NONE;
+
+    run_finish();
+}
+
+// --- ExecPipe --------------------------------------------------------- //
+
+ExecPipe::ExecPipe()
+    : m_impl(new ExecPipeImpl)
+{
+    m_impl->ref();
+}
+
+ExecPipe::~ExecPipe()
+{
+    if (m_impl->unref())
+	delete m_impl;
+}
+
+ExecPipe::ExecPipe(const ExecPipe& ep)
+    : m_impl(ep.m_impl)
+{
+    m_impl->ref();
+}
+
+ExecPipe& ExecPipe::operator=(const ExecPipe& ep)
+{
+    if (this != &ep)
+    {
+	ep.m_impl->ref();
+
+	if (m_impl->unref())
+	    delete m_impl;
+
+	m_impl = ep.m_impl;
+    }
+    return *this;
+}
+
+void ExecPipe::set_debug_level(enum DebugLevel dl)
+{
+    return m_impl->set_debug_level(dl);
+}
+
+void ExecPipe::set_debug_output(void (*output)(const char *line))
+{
+    return m_impl->set_debug_output(output);
+}
+
+void ExecPipe::set_poll_engine(enum PollEngine pe)
+{
+    return m_impl->set_poll_engine(pe);
+}
+
+void ExecPipe::set_launch_engine(enum LaunchEngine le)
+{
+    return m_impl->set_launch_engine(le);
+}
+
+void ExecPipe::set_exec_cache(enum ExecCacheMode ec)
+{
+    return ExecCache::instance().set_mode(ec);
+}
+
+void ExecPipe::clear_exec_cache()
+{
+    return ExecCache::instance().clear();
+}
+
+void ExecPipe::start_fork_server()
+{
+    if (!ForkServer::instance().start())
+	throw(std::runtime_error(std::string("Could not start fork server: ") + strerror(errno)));
+}
+
+void ExecPipe::stop_fork_server()
+{
+    return ForkServer::instance().stop();
+}
+
+void ExecPipe::set_input_fd(int fd)
+{
+    return m_impl->set_input_fd(fd);
+}
+
+void ExecPipe::set_input_file(const char* path)
+{
+    return m_impl->set_input_file(path);
+}
+
+void ExecPipe::set_input_string(const std::string* input, bool zerocopy)
+{
+    return m_impl->set_input_string(input, zerocopy);
+}
+
+void ExecPipe::set_input_files(const std::vector<std::string>* paths)
+{
+    return m_impl->set_input_files(paths);
+}
+
+void ExecPipe::set_input_source(PipeSource* source, enum FunctionMode fm)
+{
+    return m_impl->set_input_source(source, fm);
+}
+   
+void ExecPipe::set_output_fd(int fd)
+{
+    return m_impl->set_output_fd(fd);
+}
+
+void ExecPipe::set_output_file(const char* path, int mode)
+{
+    return m_impl->set_output_file(path, mode);
+}
+
+void ExecPipe::set_output_string(std::string* output)
+{
+    return m_impl->set_output_string(output);
+}
+
+void ExecPipe::set_output_sink(PipeSink* sink, enum FunctionMode fm)
+{
+    return m_impl->set_output_sink(sink, fm);
+}
+
+unsigned int ExecPipe::size() const
+{
+    return m_impl->size();
+}
+
+void ExecPipe::add_exec(const char* prog)
+{
+    return m_impl->add_exec(prog);
+}
+
+void ExecPipe::add_exec(const char* prog, const char* arg1)
+{
+    return m_impl->add_exec(prog, arg1);
+}
+
+void ExecPipe::add_exec(const char* prog, const char* arg1, const char* arg2)
+{
+    return m_impl->add_exec(prog, arg1, arg2);
+}
+
+void ExecPipe::add_exec(const char* prog, const char* arg1, const char* arg2, const char* arg3)
+{
+    return m_impl->add_exec(prog, arg1, arg2, arg3);
+}
+
+void ExecPipe::add_exec(const std::vector<std::string>* args)
+{
+    return m_impl->add_exec(args);
+}
+
+void ExecPipe::add_execp(const char* prog)
+{
+    return m_impl->add_execp(prog);
+}
+
+void ExecPipe::add_execp(const char* prog, const char* arg1)
+{
+    return m_impl->add_execp(prog, arg1);
+}
+
+void ExecPipe::add_execp(const char* prog, const char* arg1, const char* arg2)
+{
+    return m_impl->add_execp(prog, arg1, arg2);
+}
+
+void ExecPipe::add_execp(const char* prog, const char* arg1, const char* arg2, const char* arg3)
+{
+    return m_impl->add_execp(prog, arg1, arg2, arg3);
+}
+
+void ExecPipe::add_execp(const std::vector<std::string>* args)
+{
+    return m_impl->add_execp(args);
+}
+
+void ExecPipe::add_exece(const char* path,
+			 const std::vector<std::string>* args,
+			 const std::vector<std::string>* env)
+{
+    return m_impl->add_exece(path, args, env);
+}
+
+void ExecPipe::add_function(PipeFunction* func, enum FunctionMode fm)
+{	
+    return m_impl->add_function(func, fm);
+}
+
+void ExecPipe::add_observer(PipeSink* observer)
+{
+    return m_impl->add_observer(observer);
+}
+
+void ExecPipe::add_coprocess(Coprocess* coprocess)
+{
+    return m_impl->add_function(coprocess, ExecPipe::FM_INLINE);
+}
+
+ExecPipe& ExecPipe::run()
+{
+    m_impl->run();
+    return *this;
+}
+
+ExecPipe& ExecPipe::start()
+{
+    m_impl->start();
+    return *this;
+}
+
+int ExecPipe::get_poll_fds(std::vector<PollFd>& fds) const
+{
+    return m_impl->get_poll_fds(fds);
+}
+
+void ExecPipe::on_ready(int fd, int events)
+{
+    return m_impl->on_ready(fd, events);
+}
+
+bool ExecPipe::is_finished() const
+{
+    return m_impl->is_finished();
+}
+
+int ExecPipe::get_return_status(unsigned int stageid) const
+{
+    return m_impl->get_return_status(stageid);
+}
+
+int ExecPipe::get_return_code(unsigned int stageid) const
+{
+    return m_impl->get_return_code(stageid);
+}
+
+int ExecPipe::get_return_signal(unsigned int stageid) const
+{
+    return m_impl->get_return_signal(stageid);
+}
+
+void ExecPipe::set_pipe_capacity(unsigned int bytes)
+{
+    return m_impl->set_pipe_capacity(bytes);
+}
+
+void ExecPipe::set_pipe_capacity(unsigned int edge, unsigned int bytes)
+{
+    return m_impl->set_pipe_capacity(edge, bytes);
+}
+
+unsigned int ExecPipe::get_pipe_capacity(unsigned int edge) const
+{
+    return m_impl->get_pipe_capacity(edge);
+}
+
+void ExecPipe::set_read_size(unsigned int bytes)
+{
+    return m_impl->set_read_size(bytes);
+}
+
+void ExecPipe::set_read_size_adaptive(unsigned int minsize, unsigned int maxsize)
+{
+    return m_impl->set_read_size_adaptive(minsize, maxsize);
+}
+
+void ExecPipe::set_failure_policy(enum FailurePolicy fp)
+{
+    return m_impl->set_failure_policy(fp);
+}
+
+void ExecPipe::set_stage_critical(unsigned int stageid, bool critical)
+{
+    return m_impl->set_stage_critical(stageid, critical);
+}
+
+void ExecPipe::set_timeout(unsigned int msec)
+{
+    return m_impl->set_timeout(msec);
+}
+
+void ExecPipe::set_stage_timeout(unsigned int stageid, unsigned int msec)
+{
+    return m_impl->set_stage_timeout(stageid, msec);
+}
+
+void ExecPipe::set_timeout_signal(int sig, unsigned int grace_msec)
+{
+    return m_impl->set_timeout_signal(sig, grace_msec);
+}
+
+std::vector<unsigned long> ExecPipe::get_read_histogram(unsigned int edge) const
+{
+    return m_impl->get_read_histogram(edge);
+}
+
+unsigned long ExecPipe::get_syscall_count() const
+{
+    return m_impl->get_syscall_count();
+}
+
+unsigned long ExecPipe::get_poll_count() const
+{
+    return m_impl->get_poll_count();
+}
+
+void ExecPipe::set_buffer_limits(unsigned int high, unsigned int low)
+{
+    return m_impl->set_buffer_limits(high, low);
+}
+
+void ExecPipe::set_buffer_limits(unsigned int stageid, unsigned int high, unsigned int low)
+{
+    return m_impl->set_buffer_limits(stageid, high, low);
+}
+
+unsigned int ExecPipe::get_buffer_peak(unsigned int stageid) const
+{
+    return m_impl->get_buffer_peak(stageid);
+}
+
+unsigned long ExecPipe::get_syscalls_saved() const
+{
+    return m_impl->get_syscalls_saved();
+}
+
+enum ExecPipe::PollEngine ExecPipe::get_poll_engine_used() const
+{
+    return m_impl->get_poll_engine_used();
+}
+
+bool ExecPipe::all_return_codes_zero() const
+{
+    return m_impl->all_return_codes_zero();
+}
+
+int ExecPipe::get_exec_error(unsigned int stageid) const
+{
+    return m_impl->get_exec_error(stageid);
+}
+
+int ExecPipe::get_failed_stage() const
+{
+    return m_impl->get_failed_stage();
+}
+
+bool ExecPipe::get_timed_out() const
+{
+    return m_impl->get_timed_out();
+}
+
+bool ExecPipe::get_stage_timed_out(unsigned int stageid) const
+{
+    return m_impl->get_stage_timed_out(stageid);
+}
+
+// --- PipeSource ------------------------------------------------------- //
+
+PipeSource::PipeSource()
+    : m_impl(NULL)
+{
+}
+
+bool PipeSource::poll()
+{
+    throw(std::runtime_error("PipeSource overrides neither poll(hint) nor poll()."));
+}
+
+bool PipeSource::poll(unsigned int /* hint */)
+{
+    return poll();
+}
+
+void PipeSource::write(const void* data, unsigned int datalen)
+{
+    assert(m_impl);
+    return m_impl->input_source_write(data, datalen);
+}
+
+// --- PipeSink --------------------------------------------------------- //
+
+PipeSink::PipeSink()
+    : m_done(false)
+{
+}
+
+void PipeSink::done()
+{
+    m_done = true;
+}
+
+// --- PipeFunction ----------------------------------------------------- //
+
+PipeFunction::PipeFunction()
+    : m_impl(NULL), m_stageid(0)
+{
+}
+
+std::string PipeFunction::save_state()
+{
+    return std::string();
+}
+
+void PipeFunction::restore_state(const std::string& /* state */)
+{
+}
+
+void PipeFunction::write(const void* data, unsigned int datalen)
+{
+    assert(m_impl);
+    return m_impl->stage_function_write(m_stageid, data, datalen);
 }
 
-void ExecPipeImpl::exec_stage(const Stage& stage)
+int PipeFunction::get_timeout_left() const
 {
-    // select arguments vector
-    const std::vector<std::string>& args = stage.argsp ? *stage.argsp : stage.args;
+    if (!m_impl) return -1;
+    return m_impl->stage_function_timeout_left();
+}
 
-    // create const char*[] of prog and arguments for syscall.
+// --- Coprocess -------------------------------------------------------- //
 
-    const char* cargs[args.size()+1];
+Coprocess::Coprocess(const std::vector<std::string>& args)
+    : m_args(args),
+      m_framing(FR_DELIMITER),
+      m_request_delim(1, '\0'), m_reply_delim(1, '\0'),
+      m_lines(1),
+      m_pid(0), m_stdin(-1), m_stdout(-1),
+      m_requests(0),
+      m_reply_timeout(0), m_stop_grace(1000)
+{
+    assert(args.size() > 0);
+}
 
-    for (unsigned ai = 0; ai < args.size(); ++ai)
-    {
-	cargs[ai] = args[ai].c_str();
-    }
-    cargs[ args.size() ] = NULL;
+Coprocess::~Coprocess()
+{
+    stop();
+}
 
-    if (!stage.envp)
-    {
-	if (stage.withpath)
-	    execvp(stage.prog, (char* const*)cargs);
-	else
-	    execv(stage.prog, (char* const*)cargs);
-    }
-    else
-    {
-	// create envp const char*[] for syscall.
+void Coprocess::set_framing_delimiter(const std::string& request_delim,
+				      const std::string& reply_delim)
+{
+    assert(reply_delim.size() > 0);
 
-	const char* cenv[args.size()+1];
+    m_framing = FR_DELIMITER;
+    m_request_delim = request_delim;
+    m_reply_delim = reply_delim;
+}
 
-	for (unsigned ei = 0; ei < stage.envp->size(); ++ei)
-	{	
-	    cenv[ei] = (*stage.envp)[ei].c_str();
-	}
-	cenv[ stage.envp->size() ] = NULL;
+void Coprocess::set_framing_length()
+{
+    m_framing = FR_LENGTH;
+}
 
-	execve(stage.prog, (char* const*)cargs, (char* const*)cenv);
-    }
+void Coprocess::set_framing_lines(unsigned int lines)
+{
+    m_framing = FR_LINES;
+    m_lines = lines;
+}
 
-    LOG_ERROR("Error executing child process: " << strerror(errno));
+void Coprocess::set_reply_timeout(unsigned int msec)
+{
+    m_reply_timeout = msec;
 }
 
-void ExecPipeImpl::sclose(int fd)
+void Coprocess::set_stop_grace(unsigned int msec)
 {
-    int r = close(fd);
+    m_stop_grace = msec;
+}
 
-    if (r != 0) {
-	LOG_ERROR("Could not correctly close fd: " << strerror(errno));
-    }
+int Coprocess::get_pid() const
+{
+    return m_pid;
 }
 
-// --- ExecPipeImpl::run() ---------------------------------------------- //
+unsigned int Coprocess::get_requests() const
+{
+    return m_requests;
+}
 
-void ExecPipeImpl::run()
+void Coprocess::start()
 {
-    if (m_stages.size() == 0)
-	throw(std::runtime_error("No stages to in exec pipe."));
+    if (m_pid) return;
 
-    // *** Phase 1: prepare all file descriptors ************************* //
+    int inpipe[2], outpipe[2];
 
-    // set up input stream accordingly
-    switch(m_input)
+    if (pipe_cloexec(inpipe) != 0)
+	throw(std::runtime_error(std::string("Could not create a coprocess pipe: ") + strerror(errno)));
+
+    if (pipe_cloexec(outpipe) != 0)
     {
-    case ST_NONE:
-	// no file change of file descriptor after fork.
-	m_stages[0].stdin_fd = -1;
-	break;
+	close(inpipe[0]); close(inpipe[1]);
+	throw(std::runtime_error(std::string("Could not create a coprocess pipe: ") + strerror(errno)));
+    }
 
-    case ST_STRING:
-    case ST_OBJECT: {
-	// create input pipe for strings and function objects.
-	int pipefd[2];
+    std::vector<const char*> cargs(m_args.size() + 1);
+    for (unsigned int i = 0; i < m_args.size(); ++i)
+	cargs[i] = m_args[i].c_str();
+    cargs[m_args.size()] = NULL;
 
-	if (pipe(pipefd) != 0)
-	    throw(std::runtime_error(std::string("Could not create an input pipe: ") + strerror(errno)));
+    pid_t child;
 
-	if (fcntl(pipefd[1], F_SETFL, O_NONBLOCK) != 0)
-	    throw(std::runtime_error(std::string("Could not set non-block mode on input pipe: ") + strerror(errno)));
+#if STX_EXECPIPE_HAVE_SPAWN
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, inpipe[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, outpipe[1], STDOUT_FILENO);
 
-	m_input_fd = pipefd[1];
-	m_stages[0].stdin_fd = pipefd[0];
-	break;
-    }
-    case ST_FILE: {
-	// open input file
+    // SIGPIPE is blocked if started by a running pipe.
+    posix_spawnattr_t attr;
+    sigset_t mask;
 
-	int infd = open(m_input_file, O_RDONLY);
-	if (infd < 0)
-	    throw(std::runtime_error(std::string("Could not open input file: ") + strerror(errno)));
+    posix_spawnattr_init(&attr);
+    child_sigmask(mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
 
-	m_stages[0].stdin_fd = infd;
-	break;
-    }
-    case ST_FD:
-	// assign user-provided fd to first process
-	m_stages[0].stdin_fd = m_input_fd;
-	m_input_fd = -1;
-	break;
+    int err = posix_spawnp(&child, cargs[0], &actions, &attr,
+			   const_cast<char* const*>(&cargs[0]), environ);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (err != 0) {
+	errno = err;
+	child = -1;
     }
+#else
+    sigset_t sigpipe;
+    sigpipe_set(sigpipe);
 
-    // create pipes between exec stages
-    for (unsigned int i = 0; i < m_stages.size() - 1; ++i)
+    child = fork();
+    if (child == 0)
     {
-	int pipefd[2];
+	sigprocmask(SIG_UNBLOCK, &sigpipe, NULL);
 
-	if (pipe(pipefd) != 0)
-	    throw(std::runtime_error(std::string("Could not create a stage pipe: ") + strerror(errno)));
-
-	m_stages[i].stdout_fd = pipefd[1];
-	m_stages[i+1].stdin_fd = pipefd[0];
+	if (dup2(inpipe[0], STDIN_FILENO) == -1) _exit(255);
+	if (dup2(outpipe[1], STDOUT_FILENO) == -1) _exit(255);
 
-	if (m_stages[i].func)
-	{
-	    if (fcntl(m_stages[i].stdout_fd, F_SETFL, O_NONBLOCK) != 0)
-		throw(std::runtime_error(std::string("Could not set non-block mode on a stage pipe: ") + strerror(errno)));
-	}
-	if (m_stages[i+1].func)
-	{
-	    if (fcntl(m_stages[i+1].stdin_fd, F_SETFL, O_NONBLOCK) != 0)
-		throw(std::runtime_error(std::string("Could not set non-block mode on a stage pipe: ") + strerror(errno)));
-	}
+	execvp(cargs[0], const_cast<char* const*>(&cargs[0]));
+	_exit(255);
     }
+#endif
 
-    // set up output stream accordingly
-    switch(m_output)
-    {
-    case ST_NONE:
-	// no file change of file descriptor after fork.
-	m_stages.back().stdout_fd = -1;
-	break;
+    int err2 = errno;
 
-    case ST_STRING: 
-    case ST_OBJECT: {
-	// create output pipe for strings and objects.
-	int pipefd[2];
+    close(inpipe[0]);
+    close(outpipe[1]);
 
-	if (pipe(pipefd) != 0)
-	    throw(std::runtime_error(std::string("Could not create an output pipe: ") + strerror(errno)));
+    if (child < 0)
+    {
+	close(inpipe[1]);
+	close(outpipe[0]);
+	throw(std::runtime_error(std::string("Could not launch coprocess: ") + strerror(err2)));
+    }
 
-	if (fcntl(pipefd[0], F_SETFL, O_NONBLOCK) != 0)
-	    throw(std::runtime_error(std::string("Could not set non-block mode on output pipe: ") + strerror(errno)));
+    m_pid = child;
+    m_stdin = inpipe[1];
+    m_stdout = outpipe[0];
 
-	m_stages.back().stdout_fd = pipefd[1];
-	m_output_fd = pipefd[0];
-	break;
-    }
-    case ST_FILE: {
-	// create or truncate output file
+    fcntl(m_stdin, F_SETFL, O_NONBLOCK);
+    fcntl(m_stdout, F_SETFL, O_NONBLOCK);
+}
 
-	int outfd = open(m_output_file, O_WRONLY | O_CREAT | O_TRUNC, m_output_file_mode);
-	if (outfd < 0)
-	    throw(std::runtime_error(std::string("Could not open output file: ") + strerror(errno)));
+int Coprocess::stop()
+{
+    if (!m_pid) return -1;
 
-	m_stages.back().stdout_fd = outfd;
-	break;
-    }
-    case ST_FD:
-	// assign user-provided fd to last process
-	m_stages.back().stdout_fd = m_output_fd;
-	m_output_fd = -1;
-	break;
-    }
+    close(m_stdin);
+    close(m_stdout);
+    m_stdin = m_stdout = -1;
+    m_pending.clear();
 
-    // *** Phase 2: launch child processes ******************************* //
+    // the program should exit on end of input, otherwise it is terminated.
+    int status;
 
-    for (unsigned int i = 0; i < m_stages.size(); ++i)
+    if (!wait_exit(m_stop_grace, status))
     {
-	if (m_stages[i].func) continue;
-
-	print_exec(m_stages[i].args);
+	kill(m_pid, SIGTERM);
 
-	pid_t child = fork();
-	if (child == 0)
+	if (!wait_exit(m_stop_grace, status))
 	{
-	    // inside child process
+	    kill(m_pid, SIGKILL);
 
-	    // move assigned file descriptors and close all others
-	    if (m_input_fd >= 0)
-		sclose(m_input_fd);
-
-	    for (unsigned int j = 0; j < m_stages.size(); ++j)
+	    while (waitpid(m_pid, &status, 0) < 0)
 	    {
-		if (i == j)
-		{
-		    // dup2 file descriptors assigned for this stage as stdin and stdout
-
-		    if (m_stages[i].stdin_fd >= 0)
-		    {
-			if (dup2(m_stages[i].stdin_fd, STDIN_FILENO) == -1) {
-			    LOG_ERROR("Could not redirect file descriptor: " << strerror(errno));
-			    exit(255);
-			}
-		    }
-
-		    if (m_stages[i].stdout_fd >= 0)
-		    {
-			if (dup2(m_stages[i].stdout_fd, STDOUT_FILENO) == -1) {
-			    LOG_ERROR("Could not redirect file descriptor: " << strerror(errno));
-			    exit(255);
-			}
-		    }
+		if (errno != EINTR) {
+		    status = -1;
+		    break;
 		}
-		else
-		{
-		    // close file descriptors of other stages
+	    }
+	}
+    }
 
-		    if (m_stages[j].stdin_fd >= 0)
-			sclose(m_stages[j].stdin_fd);
+    m_pid = 0;
+    return status;
+}
 
-		    if (m_stages[j].stdout_fd >= 0)
-			sclose(m_stages[j].stdout_fd);
-		}
-	    }
+bool Coprocess::wait_exit(unsigned int msec, int& status)
+{
+    long long deadline = monotonic_msec() + msec;
 
-	    if (m_output_fd >= 0)
-		sclose(m_output_fd);
+    while (1)
+    {
+	pid_t r = waitpid(m_pid, &status, WNOHANG);
 
-	    // run program
-	    exec_stage(m_stages[i]);
+	if (r > 0) return true;
 
-	    exit(255);
+	if (r < 0)
+	{
+	    if (errno == EINTR) continue;
+	    status = -1;
+	    return true;
 	}
 
-	m_stages[i].pid = child;
+	if (monotonic_msec() >= deadline) return false;
+
+	// no portable way to wait for a child with a timeout, thus poll.
+	struct timespec ts = { 0, 10 * 1000000L };
+	nanosleep(&ts, NULL);
     }
+}
 
-    // parent process: close all unneeded file descriptors of exec stages.
+bool Coprocess::round_trip(std::string& reply)
+{
+    // frame request
 
-    for (stagelist_type::const_iterator st = m_stages.begin();
-	 st != m_stages.end(); ++st)
+    std::string out;
+
+    if (m_framing == FR_LENGTH)
+    {
+	unsigned int len = m_request.size();
+	unsigned char prefix[4] = {
+	    static_cast<unsigned char>(len >> 24), static_cast<unsigned char>(len >> 16),
+	    static_cast<unsigned char>(len >> 8), static_cast<unsigned char>(len)
+	};
+	out.assign(reinterpret_cast<char*>(prefix), 4);
+	out += m_request;
+    }
+    else
     {
-	if (st->func) continue;
+	out = m_request;
+	if (m_framing == FR_DELIMITER)
+	    out += m_request_delim;
+    }
 
-	if (st->stdin_fd >= 0)
-	    sclose(st->stdin_fd);
+    // send the request while reading the reply, the program may start
+    // answering before it has read everything. Output read beyond the end of
+    // the previous reply is its start.
 
-	if (st->stdout_fd >= 0)
-	    sclose(st->stdout_fd);
-    }
+    std::string::size_type outpos = 0;
 
-    // *** Phase 3: run select() loop and process data ******************* //
+    std::string input;
+    input.swap(m_pending);
 
-    while(1)
-    {
-	// build file descriptor sets
+    long long reply_deadline = m_reply_timeout ? monotonic_msec() + m_reply_timeout : 0;
 
-	int max_fds = -1;
-	fd_set read_fds, write_fds;
+    while (1)
+    {
+	// check whether the reply is complete
 
-	FD_ZERO(&read_fds);
-	FD_ZERO(&write_fds);
+	std::string::size_type begin = 0, end = std::string::npos, next = 0;
 
-	if (m_input_fd >= 0)
+	if (m_framing == FR_DELIMITER)
 	{
-	    if (m_input == ST_OBJECT)
+	    end = input.find(m_reply_delim);
+	    if (end != std::string::npos)
+		next = end + m_reply_delim.size();
+	}
+	else if (m_framing == FR_LENGTH)
+	{
+	    if (input.size() >= 4)
 	    {
-		assert(m_input_source);
-
-		if (!m_input_rbuffer.size() && !m_input_source->poll() && !m_input_rbuffer.size())
-		{
-		    sclose(m_input_fd);
-		    m_input_fd = -1;
-
-		    LOG_INFO("Closing input file descriptor: " << strerror(errno));
-		}
-		else
-		{
-		    FD_SET(m_input_fd, &write_fds);
-		    if (max_fds < m_input_fd) max_fds = m_input_fd;
-
-		    LOG_DEBUG("Select on input file descriptor");
+		const unsigned char* p = reinterpret_cast<const unsigned char*>(input.data());
+		std::string::size_type len =
+		    (static_cast<std::string::size_type>(p[0]) << 24) |
+		    (static_cast<std::string::size_type>(p[1]) << 16) |
+		    (static_cast<std::string::size_type>(p[2]) << 8) | p[3];
+
+		if (input.size() >= 4 + len) {
+		    begin = 4;
+		    end = next = 4 + len;
 		}
 	    }
-	    else
-	    {
-		FD_SET(m_input_fd, &write_fds);
-		if (max_fds < m_input_fd) max_fds = m_input_fd;
-
-		LOG_DEBUG("Select on input file descriptor");
-	    }
 	}
-
-	for (unsigned int i = 0; i < m_stages.size(); ++i)
+	else if (m_framing == FR_LINES)
 	{
-	    if (!m_stages[i].func) continue;
+	    std::string::size_type pos = 0;
+	    unsigned int lines = 0;
 
-	    if (m_stages[i].stdin_fd >= 0)
+	    while (lines < m_lines && (pos = input.find('\n', pos)) != std::string::npos)
 	    {
-		FD_SET(m_stages[i].stdin_fd, &read_fds);
-		if (max_fds < m_stages[i].stdin_fd) max_fds = m_stages[i].stdin_fd;
-
-		LOG_DEBUG("Select on stage input file descriptor");
+		++pos;
+		++lines;
 	    }
 
-	    if (m_stages[i].stdout_fd >= 0)
-	    {
-		if (m_stages[i].outbuffer.size())
-		{
-		    FD_SET(m_stages[i].stdout_fd, &write_fds);
-		    if (max_fds < m_stages[i].stdout_fd) max_fds = m_stages[i].stdout_fd;
-
-		    LOG_DEBUG("Select on stage output file descriptor");
-		}
-		else if (m_stages[i].stdin_fd < 0 && !m_stages[i].outbuffer.size())
-		{
-		    sclose(m_stages[i].stdout_fd);
-		    m_stages[i].stdout_fd = -1;
-
-		    LOG_INFO("Close stage output file descriptor");
-		}
-	    }
+	    if (lines == m_lines)
+		end = next = (m_lines ? pos : 0);
 	}
 
-	if (m_output_fd >= 0)
+	if (end != std::string::npos && outpos == out.size())
 	{
-	    FD_SET(m_output_fd, &read_fds);
-	    if (max_fds < m_output_fd) max_fds = m_output_fd;
-
-	    LOG_DEBUG("Select on output file descriptor");
+	    reply.assign(input, begin, end - begin);
+	    m_pending.assign(input, next, std::string::npos);
+	    return true;
 	}
 
-	// issue select() call
-
-	if (max_fds < 0)
-	    break;
-
-	int retval = select(max_fds+1, &read_fds, &write_fds, NULL, NULL);
-	if (retval < 0)
-	    throw(std::runtime_error(std::string("Error during select() on file descriptors: ") + strerror(errno)));
+	// wait at most until the pipe's or the reply's deadline.
 
-	LOG_TRACE("select() on " << retval << " file descriptors: " << strerror(errno));
+	int timeout = get_timeout_left();
 
-	// handle file descriptors marked by select() in both sets
+	if (timeout == 0)
+	    return false;
 
-	if (m_input_fd >= 0 && FD_ISSET(m_input_fd, &write_fds))
+	if (reply_deadline)
 	{
-	    if (m_input == ST_STRING)
-	    {
-		// write string data to first stdin file descriptor.
-
-		assert(m_input_string);
-		assert(m_input_string_pos < m_input_string->size());
-
-		ssize_t wb;
-
-		do
-		{
-		    wb = write(m_input_fd,
-			       m_input_string->data() + m_input_string_pos,
-			       m_input_string->size() - m_input_string_pos);
-
-		    LOG_TRACE("Write on input fd: " << wb);
-
-		    if (wb < 0)
-		    {
-			if (errno == EAGAIN || errno == EINTR)
-			{
-			}
-			else
-			{
-			    LOG_DEBUG("Error writing to input file descriptor: " << strerror(errno));
-
-			    sclose(m_input_fd);
-			    m_input_fd = -1;
-
-			    LOG_INFO("Closing input file descriptor: " << strerror(errno));
-			}
-		    }
-		    else if (wb > 0)
-		    {
-			m_input_string_pos += wb;
+	    long long left = reply_deadline - monotonic_msec();
 
-			if (m_input_string_pos >= m_input_string->size())
-			{
-			    sclose(m_input_fd);
-			    m_input_fd = -1;
+	    if (left <= 0)
+		throw(std::runtime_error("Coprocess did not reply within its timeout."));
 
-			    LOG_INFO("Closing input file descriptor: " << strerror(errno));
-			    break;
-			}
-		    }
-		} while (wb > 0);
-
-	    }
-	    else if (m_input == ST_OBJECT)
-	    {
-		// write buffered data to first stdin file descriptor.
-		
-		ssize_t wb;
-
-		do
-		{
-		    wb = write(m_input_fd,
-			       m_input_rbuffer.bottom(),
-			       m_input_rbuffer.bottomsize());
+	    if (timeout < 0 || left < timeout)
+		timeout = static_cast<int>(left);
+	}
 
-		    LOG_TRACE("Write on input fd: " << wb);
+	struct pollfd pfd[2];
+	pfd[0].fd = m_stdout;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = m_stdin;
+	pfd[1].events = POLLOUT;
 
-		    if (wb < 0)
-		    {
-			if (errno == EAGAIN || errno == EINTR)
-			{
-			}
-			else
-			{
-			    LOG_INFO("Error writing to input file descriptor: " << strerror(errno));
-
-			    sclose(m_input_fd);
-			    m_input_fd = -1;
-
-			    LOG_INFO("Closing input file descriptor: " << strerror(errno));
-			}
-		    }
-		    else if (wb > 0)
-		    {
-			m_input_rbuffer.advance(wb);
-		    }
-		} while (wb > 0);
-	    }
+	if (::poll(pfd, (outpos < out.size()) ? 2 : 1, timeout) < 0)
+	{
+	    if (errno == EINTR) continue;
+	    throw(std::runtime_error(std::string("Error polling coprocess: ") + strerror(errno)));
 	}
 
-	if (m_output_fd >= 0 && FD_ISSET(m_output_fd, &read_fds))
+	if (outpos < out.size() && pfd[1].revents)
 	{
-	    // read data from last stdout file descriptor
-
-	    ssize_t rb;
+	    ssize_t wb = ::write(m_stdin, out.data() + outpos, out.size() - outpos);
 
-	    do
-	    {
-		errno = 0;
-
-		rb = read(m_output_fd, 
-			  m_buffer, sizeof(m_buffer));
-
-		LOG_TRACE("Read on output fd: " << rb);
-
-		if (rb <= 0)
-		{
-		    if (rb == 0 && errno == 0)
-		    {
-			// zero read indicates eof
-
-			LOG_INFO("Closing output file descriptor: " << strerror(errno));
+	    if (wb < 0 && errno != EAGAIN && errno != EINTR)
+		throw(std::runtime_error(std::string("Error writing to coprocess: ") + strerror(errno)));
 
-			if (m_output == ST_OBJECT)
-			{
-			    assert(m_output_sink);
-			    m_output_sink->eof();
-			}
-
-			sclose(m_output_fd);
-			m_output_fd = -1;
-		    }
-		    else if (errno == EAGAIN || errno == EINTR)
-		    {
-		    }
-		    else
-		    {
-			LOG_ERROR("Error reading from output file descriptor: " << strerror(errno));
-		    }
-		}
-		else
-		{
-		    if (m_output == ST_STRING)
-		    {
-			assert(m_output_string);
-			m_output_string->append(m_buffer, rb);
-		    }
-		    else if (m_output == ST_OBJECT)
-		    {
-			assert(m_output_sink);
-			m_output_sink->process(m_buffer, rb);
-		    }
-		}
-	    } while (rb > 0);
+	    if (wb > 0) outpos += wb;
 	}
-	    
-	for (unsigned int i = 0; i < m_stages.size(); ++i)
+
+	if (pfd[0].revents)
 	{
-	    if (!m_stages[i].func) continue;
+	    char buffer[4096];
 
-	    if (m_stages[i].stdin_fd >= 0 && FD_ISSET(m_stages[i].stdin_fd, &read_fds))
+	    ssize_t rb = read(m_stdout, buffer, sizeof(buffer));
+
+	    if (rb == 0)
+		throw(std::runtime_error("Coprocess closed its output."));
+
+	    if (rb < 0)
 	    {
-		ssize_t rb;
+		if (errno == EAGAIN || errno == EINTR) continue;
+		throw(std::runtime_error(std::string("Error reading from coprocess: ") + strerror(errno)));
+	    }
 
-		do
-		{
-		    errno = 0;
+	    input.append(buffer, rb);
+	}
+    }
+}
 
-		    rb = read(m_stages[i].stdin_fd, 
-			      m_buffer, sizeof(m_buffer));
+void Coprocess::process(const void* data, unsigned int datalen)
+{
+    if (m_framing == FR_LENGTH && datalen > 0xFFFFFFFFU - m_request.size())
+	throw(std::runtime_error("Coprocess request exceeds the 32-bit length prefix."));
 
-		    LOG_TRACE("Read on stage fd: " << rb);
+    m_request.append(static_cast<const char*>(data), datalen);
+}
 
-		    if (rb <= 0)
-		    {
-			if (rb == 0 && errno == 0)
-			{
-			    // zero read indicates eof
-
-			    LOG_INFO("Closing stage input file descriptor: " << strerror(errno));
-
-			    m_stages[i].func->eof();
-
-			    sclose(m_stages[i].stdin_fd);
-			    m_stages[i].stdin_fd = -1;
-			}
-			else if (errno == EAGAIN || errno == EINTR)
-			{
-			}
-			else
-			{
-			    LOG_ERROR("Error reading from stage input file descriptor: " << strerror(errno));
-			}
-		    }
-		    else
-		    {
-			m_stages[i].func->process(m_buffer, rb);
-		    }
-		} while (rb > 0);
-	    }
+void Coprocess::eof()
+{
+    start();
 
-	    if (m_stages[i].stdout_fd >= 0 && FD_ISSET(m_stages[i].stdout_fd, &write_fds))
-	    {
-		while (m_stages[i].outbuffer.size() > 0)
-		{
-		    ssize_t wb = write(m_stages[i].stdout_fd,
-				       m_stages[i].outbuffer.bottom(),
-				       m_stages[i].outbuffer.bottomsize());
+    std::string reply;
+    bool replied;
 
-		    LOG_TRACE("Write on stage fd: " << wb);
+    try {
+	replied = round_trip(reply);
+    }
+    catch (...) {
+	// the program's state is unknown, relaunch it for the next request.
+	m_request.clear();
+	kill(m_pid, SIGKILL);
+	stop();
+	throw;
+    }
 
-		    if (wb < 0)
-		    {
-			if (errno == EAGAIN || errno == EINTR)
-			{
-			}
-			else
-			{
-			    LOG_INFO("Error writing to stage output file descriptor: " << strerror(errno));
-			}
-			break;
-		    }
-		    else if (wb > 0)
-		    {
-			m_stages[i].outbuffer.advance(wb);
-		    }
-		}
+    m_request.clear();
 
-		if (m_stages[i].stdin_fd < 0 && !m_stages[i].outbuffer.size())
-		{
-		    LOG_INFO("Closing stage output file descriptor: " << strerror(errno));
+    if (!replied)
+    {
+	// the event loop aborts the pipe after its deadline expired.
+	kill(m_pid, SIGKILL);
+	stop();
+	return;
+    }
 
-		    sclose(m_stages[i].stdout_fd);
-		    m_stages[i].stdout_fd = -1;
-		}
-	    }
+    ++m_requests;
+
+    write(reply.data(), reply.size());
+}
+
+// --- ExecPipePool ---------------------------------------------------- //
+
+/**
+ * \brief Pool implementation (internal object)
+ *
+ * Drives the run steps of many ExecPipeImpl objects, which all register their
+ * file descriptors with one shared Poller.
+ */
+class ExecPipePoolImpl
+{
+private:
+    /// Structure representing a queued or running pipe.
+    struct Entry
+    {
+	/// reference to the pipe.
+	ExecPipe	pipe;
+
+	/// notified once the pipe finished, or NULL.
+	PipeCallback*	callback;
+
+	/// number of child processes counted against the cap.
+	unsigned int	children;
+
+	/// set once the event loop of the pipe finished and the remaining
+	/// children are reaped.
+	bool		reaping;
+
+	/// message of the first exception thrown by a run step.
+	std::string	error;
+
+	/// Constructor reseting all variables.
+	Entry(const ExecPipe& ep, PipeCallback* cb)
+	    : pipe(ep), callback(cb), children(0), reaping(false)
+	{
 	}
-    }
+    };
 
-    // *** Phase 4: call wait() for all children processes *************** //
+    /// pipes waiting to be started, in order.
+    std::deque<Entry>	m_waiting;
 
-    unsigned int donepid = 0;
+    /// pipes currently running.
+    std::list<Entry>	m_running;
 
-    for (unsigned int i = 0; i < m_stages.size(); ++i)
+    /// maximum number of concurrently running children, zero for none.
+    unsigned int	m_max_children;
+
+    /// number of children of all running pipes.
+    unsigned int	m_children;
+
+    /// requested type of the shared event loop backend.
+    enum ExecPipe::PollEngine	m_poll_engine;
+
+    /// shared event loop backend during run().
+    Poller*		m_poller;
+
+    /// Return the implementation object of the entry's pipe.
+    static ExecPipeImpl* impl(Entry& entry)
     {
-	if (!m_stages[i].func) continue;
-	++donepid;
+	return entry.pipe.m_impl;
     }
 
-    while (donepid != m_stages.size())
+    /// Abort the entry's pipe after a run step threw an exception.
+    void fail(Entry& entry, const char* what)
     {
-	int status;
-	int p = wait(&status);
+	if (entry.error.empty())
+	    entry.error = what;
 
-	if (p < 0)
+	impl(entry)->run_abort(m_poller);
+    }
+
+    /// Start waiting pipes while the cap on children permits.
+    void start_waiting()
+    {
+	while (!m_waiting.empty())
 	{
-	    LOG_ERROR("Error calling wait(): " << strerror(errno));
-	    break;
-	}
+	    unsigned int children = impl(m_waiting.front())->get_child_count();
 
-	bool found = false;
+	    // a pipe exceeding the cap alone is only started by itself.
+	    if (m_max_children && m_children + children > m_max_children
+		&& !m_running.empty())
+		break;
 
-	for (unsigned int i = 0; i < m_stages.size(); ++i)
-	{
-	    if (p == m_stages[i].pid)
-	    {
-		m_stages[i].retstatus = status;
+	    m_running.push_back(m_waiting.front());
+	    m_waiting.pop_front();
 
-		if (WIFEXITED(status))
-		{
-		    LOG_INFO("Finished exec() stage " << p << " with retcode " << WEXITSTATUS(status));
-		}
-		else if (WIFSIGNALED(status))
-		{
-		    LOG_INFO("Finished exec() stage " << p << " with signal " << WTERMSIG(status));
-		}
-		else
-		{
-		    LOG_ERROR("Error in wait(): unknown return status for pid " << p);
-		}
+	    Entry& entry = m_running.back();
+	    entry.children = children;
+	    m_children += children;
 
-		++donepid;
-		found = true;
-		break;
+	    if (!m_poller)
+		m_poller = impl(entry)->create_poller(m_poll_engine);
+
+	    // the pipe stays marked as pooled, except while run_start() checks
+	    // that it is not running.
+	    impl(entry)->m_step = ExecPipeImpl::SS_NONE;
+
+	    try {
+		impl(entry)->run_start(m_poller);
+	    }
+	    catch (std::exception& e) {
+		fail(entry, e.what());
 	    }
-	}
 
-	if (!found)
-	{
-	    LOG_ERROR("Error in wait(): syscall returned an unknown child pid.");
+	    impl(entry)->m_step = ExecPipeImpl::SS_POOLED;
 	}
     }
 
-    LOG_INFO("Finished running pipe.");
-}
+    /// Free the shared event loop backend.
+    void delete_poller()
+    {
+	if (m_poller) delete m_poller;
+	m_poller = NULL;
+    }
 
-// --- ExecPipe --------------------------------------------------------- //
+public:
+    /// Construct an empty pool.
+    ExecPipePoolImpl()
+	: m_max_children(0), m_children(0),
+	  m_poll_engine(ExecPipe::PE_AUTO),
+	  m_poller(NULL)
+    {
+    }
 
-ExecPipe::ExecPipe()
-    : m_impl(new ExecPipeImpl)
-{
-    ++m_impl->refs();
-}
+    /// Free the event loop backend, if left over by an exception in run(),
+    /// and release the pipes still queued.
+    ~ExecPipePoolImpl()
+    {
+	for (unsigned int i = 0; i < m_waiting.size(); ++i)
+	    impl(m_waiting[i])->m_step = ExecPipeImpl::SS_NONE;
 
-ExecPipe::~ExecPipe()
-{
-    if (--m_impl->refs() == 0)
-	delete m_impl;
-}
+	for (std::list<Entry>::iterator it = m_running.begin(); it != m_running.end(); ++it)
+	    impl(*it)->m_step = ExecPipeImpl::SS_NONE;
 
-ExecPipe::ExecPipe(const ExecPipe& ep)
-    : m_impl(ep.m_impl)
-{
-    ++m_impl->refs();
-}
+	delete_poller();
+    }
 
-ExecPipe& ExecPipe::operator=(const ExecPipe& ep)
-{
-    if (this != &ep)
+    /// Select the type of the shared event loop backend.
+    void set_poll_engine(enum ExecPipe::PollEngine pe)
     {
-	if (--m_impl->refs() == 0)
-	    delete m_impl;
+	m_poll_engine = pe;
+    }
 
-	m_impl = ep.m_impl;
-	++m_impl->refs();
+    /// Set the maximum number of concurrently running children.
+    void set_max_children(unsigned int n)
+    {
+	m_max_children = n;
     }
-    return *this;
-}
 
-void ExecPipe::set_debug_level(enum DebugLevel dl)
-{
-    return m_impl->set_debug_level(dl);
-}
+    /// Queue a pipe, which must not be running or pooled already.
+    void add(const ExecPipe& ep, PipeCallback* callback)
+    {
+	if (ep.m_impl->m_step != ExecPipeImpl::SS_NONE)
+	    throw(std::runtime_error("Exec pipe is still running."));
 
-void ExecPipe::set_debug_output(void (*output)(const char *line))
-{
-    return m_impl->set_debug_output(output);
-}
+	m_waiting.push_back(Entry(ep, callback));
+	ep.m_impl->m_step = ExecPipeImpl::SS_POOLED;
+    }
 
-void ExecPipe::set_input_fd(int fd)
-{
-    return m_impl->set_input_fd(fd);
-}
+    /// Return the number of queued and running pipes.
+    unsigned int size() const
+    {
+	return m_waiting.size() + m_running.size();
+    }
 
-void ExecPipe::set_input_file(const char* path)
-{
-    return m_impl->set_input_file(path);
-}
+    /// Run all pipes until all finished.
+    void run()
+    {
+	// writes into pipes closed early fail with EPIPE instead of SIGPIPE.
+	SigPipeGuard sigpipe_guard;
 
-void ExecPipe::set_input_string(const std::string* input)
-{
-    return m_impl->set_input_string(input);
-}
+	while (!m_waiting.empty() || !m_running.empty())
+	{
+	    start_waiting();
 
-void ExecPipe::set_input_source(PipeSource* source)
-{
-    return m_impl->set_input_source(source);
-}
-   
-void ExecPipe::set_output_fd(int fd)
-{
-    return m_impl->set_output_fd(fd);
-}
+	    // collect the interest set of all pipes, and finish those without
+	    // any file descriptors left to wait for.
 
-void ExecPipe::set_output_file(const char* path, int mode)
-{
-    return m_impl->set_output_file(path, mode);
-}
+	    int timeout = -1;
 
-void ExecPipe::set_output_string(std::string* output)
-{
-    return m_impl->set_output_string(output);
-}
+	    for (std::list<Entry>::iterator it = m_running.begin(); it != m_running.end(); )
+	    {
+		Entry& entry = *it;
+		int t = -1;
 
-void ExecPipe::set_output_sink(PipeSink* sink)
-{
-    return m_impl->set_output_sink(sink);
-}
+		if (!entry.reaping)
+		{
+		    bool active = true;
 
-unsigned int ExecPipe::size() const
-{
-    return m_impl->size();
-}
+		    try {
+			active = impl(entry)->run_prepare(t);
+		    }
+		    catch (std::exception& e) {
+			fail(entry, e.what());
+		    }
 
-void ExecPipe::add_exec(const char* prog)
-{
-    return m_impl->add_exec(prog);
-}
+		    if (!active)
+		    {
+			impl(entry)->run_stop();
+			entry.reaping = true;
+		    }
+		}
 
-void ExecPipe::add_exec(const char* prog, const char* arg1)
-{
-    return m_impl->add_exec(prog, arg1);
-}
+		if (entry.reaping)
+		{
+		    // children without pidfd are polled, which never blocks.
+		    if (!impl(entry)->run_reap(false))
+		    {
+			t = impl(entry)->check_deadlines();
 
-void ExecPipe::add_exec(const char* prog, const char* arg1, const char* arg2)
-{
-    return m_impl->add_exec(prog, arg1, arg2);
-}
+			if (t < 0 || t > 10)
+			    t = 10;
+		    }
+		    else
+		    {
+			impl(entry)->m_step = ExecPipeImpl::SS_NONE;
+			impl(entry)->run_finish();
 
-void ExecPipe::add_exec(const char* prog, const char* arg1, const char* arg2, const char* arg3)
-{
-    return m_impl->add_exec(prog, arg1, arg2, arg3);
-}
+			m_children -= entry.children;
 
-void ExecPipe::add_exec(const std::vector<std::string>* args)
-{
-    return m_impl->add_exec(args);
-}
+			ExecPipe pipe = entry.pipe;
+			PipeCallback* callback = entry.callback;
+			std::string error = entry.error;
 
-void ExecPipe::add_execp(const char* prog)
-{
-    return m_impl->add_execp(prog);
-}
+			it = m_running.erase(it);
 
-void ExecPipe::add_execp(const char* prog, const char* arg1)
-{
-    return m_impl->add_execp(prog, arg1);
-}
+			// the callback may add further pipes.
+			if (callback)
+			    callback->finished(pipe, error);
 
-void ExecPipe::add_execp(const char* prog, const char* arg1, const char* arg2)
-{
-    return m_impl->add_execp(prog, arg1, arg2);
-}
+			continue;
+		    }
+		}
 
-void ExecPipe::add_execp(const char* prog, const char* arg1, const char* arg2, const char* arg3)
-{
-    return m_impl->add_execp(prog, arg1, arg2, arg3);
-}
+		if (t >= 0 && (timeout < 0 || t < timeout))
+		    timeout = t;
 
-void ExecPipe::add_execp(const std::vector<std::string>* args)
-{
-    return m_impl->add_execp(args);
-}
+		++it;
+	    }
 
-void ExecPipe::add_exece(const char* path,
-			 const std::vector<std::string>* args,
-			 const std::vector<std::string>* env)
-{
-    return m_impl->add_exece(path, args, env);
-}
+	    if (m_running.empty())
+		continue;
 
-void ExecPipe::add_function(PipeFunction* func)
-{	
-    return m_impl->add_function(func);
-}
+	    m_poller->wait(timeout);
 
-ExecPipe& ExecPipe::run()
-{
-    m_impl->run();
-    return *this;
-}
+	    for (std::list<Entry>::iterator it = m_running.begin(); it != m_running.end(); ++it)
+	    {
+		if (it->reaping) continue;
 
-int ExecPipe::get_return_status(unsigned int stageid) const
-{
-    return m_impl->get_return_status(stageid);
-}
+		try {
+		    impl(*it)->run_dispatch();
+		}
+		catch (std::exception& e) {
+		    fail(*it, e.what());
+		}
+	    }
+	}
 
-int ExecPipe::get_return_code(unsigned int stageid) const
+	delete_poller();
+    }
+};
+
+ExecPipePool::ExecPipePool()
+    : m_impl(new ExecPipePoolImpl)
 {
-    return m_impl->get_return_code(stageid);
 }
 
-int ExecPipe::get_return_signal(unsigned int stageid) const
+ExecPipePool::~ExecPipePool()
 {
-    return m_impl->get_return_signal(stageid);
+    delete m_impl;
 }
 
-bool ExecPipe::all_return_codes_zero() const
+void ExecPipePool::set_poll_engine(enum ExecPipe::PollEngine pe)
 {
-    return m_impl->all_return_codes_zero();
+    return m_impl->set_poll_engine(pe);
 }
 
-// --- PipeSource ------------------------------------------------------- //
-
-PipeSource::PipeSource()
-    : m_impl(NULL)
+void ExecPipePool::set_max_children(unsigned int n)
 {
+    return m_impl->set_max_children(n);
 }
 
-void PipeSource::write(const void* data, unsigned int datalen)
+void ExecPipePool::add(const ExecPipe& ep, PipeCallback* callback)
 {
-    assert(m_impl);
-    return m_impl->input_source_write(data, datalen);
+    return m_impl->add(ep, callback);
 }
 
-// --- PipeFunction ----------------------------------------------------- //
-
-PipeFunction::PipeFunction()
-    : m_impl(NULL), m_stageid(0)
+unsigned int ExecPipePool::size() const
 {
+    return m_impl->size();
 }
 
-void PipeFunction::write(const void* data, unsigned int datalen)
+void ExecPipePool::run()
 {
-    assert(m_impl);
-    return m_impl->stage_function_write(m_stageid, data, datalen);
+    return m_impl->run();
 }
 
 // ---------------------------------------------------------------------- //
@@ -35,9 +35,17 @@ namespace stx {
  * source. Data generated by this class is written to the first stage of the
  * pipe.
  *
- * When data is needed by the pipe the function poll() is called. This pure
+ * When data is needed by the pipe the function poll() is called. This
  * virtual function must generate data and push it into a buffer using the
  * write() function. The input stream is terminated when poll() returns false.
+ *
+ * The pipe only polls the source when the first stage's input can take more
+ * data. Derived classes should override poll(unsigned int hint), which is
+ * told how many bytes can be written without blocking, and may generate about
+ * that much data per call. Classes overriding the plain poll() are still
+ * supported. A class must override one of the two, otherwise run() throws.
+ * Since overriding one overload hides the other, derived classes should
+ * declare "using PipeSource::poll;".
  */
 class PipeSource
 {
@@ -52,9 +60,20 @@ public:
     /// Constructor which clears m_impl.
     PipeSource();
 
+    /// Virtual destructor for derived classes.
+    virtual ~PipeSource() {}
+
     /// Poll the input source for new data. The input stream is closed when
-    /// this function returns false, otherwise it will be polled again.
-    virtual bool poll() = 0;
+    /// this function returns false, otherwise it will be polled again. The
+    /// default implementation of poll(hint) calls this function, which
+    /// throws if it is not overridden either.
+    virtual bool poll();
+
+    /// Poll the input source for about hint bytes of new data, which is the
+    /// amount the input pipe can currently take. More or less data may be
+    /// written. The input stream is closed when this function returns false,
+    /// otherwise it will be polled again.
+    virtual bool poll(unsigned int hint);
 
     /// Write input data to the first stage via a buffer.
     void write(const void* data, unsigned int datalen);
@@ -69,10 +88,26 @@ public:
  * Data read from the final or preceding stage is passed to the class via
  * process(). When the final stage closes the pipe, the function eof() is
  * called.
+ *
+ * A sink which needs no more data, e.g. after sampling the first records of
+ * a huge stream, calls done() from process(). The pipe then closes the
+ * sink's input as if the stream ended and calls eof(). The preceding stages
+ * fail to write with EPIPE or SIGPIPE and end as well, thus upstream work
+ * stops early.
  */
 class PipeSink
 {
+private:
+    /// set by done(), reset by each ExecPipe::run().
+    bool		m_done;
+
+    /// association to the pipe implementation for read access to m_done.
+    friend class ExecPipeImpl;
+
 public:
+    /// Constructor which clears m_done.
+    PipeSink();
+
     /// Pure virtual function which receives the output stream as read from the
     /// final or preceding pipe stage.
     virtual void process(const void* data, unsigned int datalen) = 0;
@@ -80,6 +115,10 @@ public:
     /// Pure virtual function called when the final or preceding pipe stage
     /// finishes.
     virtual void eof() = 0;
+
+    /// Signal from within process() that no more input is needed. Further
+    /// output of a function stage is still forwarded.
+    void done();
 };
 
 /**
@@ -114,6 +153,151 @@ public:
 
     /// Write input data to the next pipe stage via a buffer.
     void write(const void* data, unsigned int datalen);
+
+    /// Return the milliseconds left until the running pipe's deadline, zero
+    /// if it expired, or -1 if the pipe has no deadline. Blocking waits in
+    /// process() or eof() should not exceed it, as the event loop can only
+    /// abort the pipe once they return.
+    int get_timeout_left() const;
+
+    /// Called in the worker process of an FM_PROCESS stage after eof(),
+    /// returns the object's results to pass back to the parent. The default
+    /// returns an empty string.
+    virtual std::string save_state();
+
+    /// Called on the parent's object after the FM_PROCESS worker exited
+    /// successfully, with the string returned by its save_state(). The
+    /// default does nothing.
+    virtual void restore_state(const std::string& state);
+};
+
+/**
+ * Persistent program used as a function stage, which stays running across
+ * many pipe runs.
+ *
+ * The program is launched on first use and kept alive until stop() or the
+ * object's destruction, thus repeated runs over small inputs do not pay
+ * fork(), exec() and dynamic linking again, and can share the program's warm
+ * caches. Each run's stage input forms one request, which is sent to the
+ * program when the preceding stage finishes. The program's reply is then read
+ * back and forwarded to the next stage. Request and reply boundaries are
+ * marked by one of the framings:
+ *
+ * - FR_DELIMITER: a delimiter string is appended to the request and the reply
+ *   ends with a (possibly different) delimiter, which is removed.
+ * - FR_LENGTH: request and reply are prefixed by their length as 32-bit
+ *   big-endian integer.
+ * - FR_LINES: the request is sent unchanged and the reply consists of a fixed
+ *   number of lines.
+ *
+ * The round trip blocks the event loop of the running pipe, thus coprocess
+ * stages are intended for small requests: the whole request is held in memory
+ * until the preceding stage finishes. The round trip waits at most until the
+ * pipe's deadline (see ExecPipe::set_timeout()) and the optional reply
+ * timeout. On expiry the program is killed and relaunched for the next
+ * request. The object may be added to several ExecPipe objects, but they must
+ * not run concurrently.
+ */
+class Coprocess : public PipeFunction
+{
+public:
+    /// Enumeration of the request and reply framings.
+    enum Framing
+    {
+	FR_DELIMITER=0, ///< requests and replies end with delimiters.
+	FR_LENGTH=1,    ///< requests and replies are prefixed by their length.
+	FR_LINES=2      ///< replies consist of a fixed number of lines.
+    };
+
+private:
+    /// program and arguments, args[0] is searched in PATH.
+    std::vector<std::string>	m_args;
+
+    /// selected framing
+    enum Framing		m_framing;
+
+    /// for FR_DELIMITER the delimiters of requests and replies
+    std::string			m_request_delim, m_reply_delim;
+
+    /// for FR_LINES the number of lines per reply
+    unsigned int		m_lines;
+
+    /// pid of the running program or zero
+    int				m_pid;
+
+    /// file descriptors of the program's stdin and stdout pipes
+    int				m_stdin, m_stdout;
+
+    /// request collected from the stage input during a run, limited to the
+    /// 32-bit length prefix for FR_LENGTH
+    std::string			m_request;
+
+    /// output read beyond the end of the last reply
+    std::string			m_pending;
+
+    /// number of completed requests
+    unsigned int		m_requests;
+
+    /// milliseconds a round trip may take, zero for no limit
+    unsigned int		m_reply_timeout;
+
+    /// milliseconds stop() waits after closing stdin and after SIGTERM
+    unsigned int		m_stop_grace;
+
+    /// Send the framed request and read back the framed reply. Returns false
+    /// if the pipe's deadline expired first, throws if the reply timeout did.
+    bool round_trip(std::string& reply);
+
+    /// Wait up to msec milliseconds for the program to exit. Returns true and
+    /// fills status if it was reaped.
+    bool wait_exit(unsigned int msec, int& status);
+
+public:
+    /// Construct a coprocess running the given program and arguments. The
+    /// default framing is FR_DELIMITER with a zero byte.
+    Coprocess(const std::vector<std::string>& args);
+
+    /// Stop the program.
+    virtual ~Coprocess();
+
+    /// Use delimiters to mark the end of requests and replies.
+    void set_framing_delimiter(const std::string& request_delim,
+			       const std::string& reply_delim);
+
+    /// Prefix requests and replies with their 32-bit big-endian length.
+    void set_framing_length();
+
+    /// Send requests unchanged and read replies of the given number of lines.
+    void set_framing_lines(unsigned int lines);
+
+    /// Set the number of milliseconds the program may take to reply to a
+    /// request, zero for no limit (default). On expiry eof() throws.
+    void set_reply_timeout(unsigned int msec);
+
+    /// Set the grace period in milliseconds stop() waits for the program to
+    /// exit after closing its stdin, and again after SIGTERM before sending
+    /// SIGKILL. The default is one second.
+    void set_stop_grace(unsigned int msec);
+
+    /// Launch the program if it is not running. Throws if this fails.
+    void start();
+
+    /// Close the program's stdin and wait for it to exit, sending SIGTERM and
+    /// then SIGKILL if it outlasts the grace periods. Returns the wait()
+    /// status, or -1 if it was not running.
+    int stop();
+
+    /// Return the pid of the running program or zero.
+    int get_pid() const;
+
+    /// Return the number of completed requests.
+    unsigned int get_requests() const;
+
+    /// Collect the stage's input as request.
+    virtual void process(const void* data, unsigned int datalen);
+
+    /// Perform the request's round trip and forward the reply.
+    virtual void eof();
 };
 
 /**
@@ -123,6 +307,11 @@ public:
  * counted pointer implementation, so you can easily copy and pass around
  * without duplicating the inside object. See the \ref index "main page" for
  * detailed information and examples.
+ *
+ * Different ExecPipe objects may be run concurrently in multiple threads: all
+ * file descriptors are created close-on-exec and launched children close all
+ * descriptors besides stdin, stdout and stderr, thus no pipeline's children
+ * hold another pipeline's pipes open. The reference counter is atomic.
  */
 class ExecPipe
 {
@@ -130,6 +319,9 @@ protected:
     /// reference-counted pointer implementation
     class ExecPipeImpl*		m_impl;
 
+    /// association to the pool implementation for access to m_impl.
+    friend class ExecPipePoolImpl;
+
 public:
     /// Construct a new uninitialize execution pipe.
     ExecPipe();
@@ -161,6 +353,95 @@ public:
     /// the debug lines are printed to stdout.
     void set_debug_output(void (*output)(const char *line));
 
+    // *** Event Loop Backend ***
+
+    /// Enumeration of the event loop backends used by run() to wait for the
+    /// file descriptors of the parent process.
+    enum PollEngine
+    {
+	PE_AUTO=0,   ///< use the best backend available at run time (default).
+	PE_SELECT=1, ///< portable select(), limited to fds below FD_SETSIZE.
+	PE_EPOLL=2,  ///< Linux epoll() with a persistent interest set.
+	PE_IO_URING=3 ///< Linux io_uring, one system call per loop turn for
+		      ///< all registration changes, the wait, and the reads
+		      ///< and writes of function stages and the output,
+		      ///< which use registered buffers.
+    };
+
+    /// Select the event loop backend. If the requested backend was not
+    /// compiled in (see STX_EXECPIPE_NO_EPOLL and STX_EXECPIPE_NO_IO_URING)
+    /// or is not supported by the kernel, run() falls back to epoll() and
+    /// then to select().
+    void set_poll_engine(enum PollEngine pe);
+
+    // *** Launch Engine ***
+
+    /// Enumeration of the methods used by run() to launch exec stages.
+    enum LaunchEngine
+    {
+	LE_AUTO=0,  ///< use posix_spawn() if compiled in (default).
+	LE_FORK=1,  ///< fork() a copy of the parent, then exec().
+	LE_SPAWN=2, ///< posix_spawn(), which avoids copying the parent's page
+		    ///< tables and thus is fast for parents with large memory.
+	LE_SERVER=3 ///< the fork server, see start_fork_server().
+    };
+
+    /// Select the method used to launch exec stages. LE_AUTO and LE_SERVER
+    /// use the fork server if it was started, otherwise posix_spawn(). The
+    /// latter may be disabled at build time by defining
+    /// STX_EXECPIPE_NO_SPAWN, in which case fork() is used.
+    void set_launch_engine(enum LaunchEngine le);
+
+    /**
+     * Start the process-wide fork server. This forks a small helper process,
+     * which then launches the exec stages of all pipes, thus the parent
+     * process never has to fork() itself. Call this early in main(), while
+     * the process is still small and single-threaded. The server's children
+     * receive the caller's environment and working directory at launch time,
+     * all other process attributes are those at start_fork_server(). Throws
+     * if the server cannot be started.
+     */
+    static void start_fork_server();
+
+    /// Stop the process-wide fork server, waiting until its remaining
+    /// children exited.
+    static void stop_fork_server();
+
+    // *** Executable Cache ***
+
+    /// Enumeration of the modes of the process-wide cache of programs found
+    /// via PATH for execp() stages.
+    enum ExecCacheMode
+    {
+	EC_OFF=0,  ///< no cache, execvp() searches PATH in the child.
+	EC_PATH=1, ///< cache resolved paths (default).
+	EC_FD=2    ///< additionally keep an O_PATH file descriptor of each
+		   ///< binary and launch fork()ed stages with fexecve().
+    };
+
+    /**
+     * Select the mode of the process-wide executable cache. When enabled,
+     * add_execp() resolves the program via PATH and throws if it cannot be
+     * found. Cached paths are revalidated on each run() and invalidated if
+     * PATH or the mtime of a searched directory changed. Changing the mode
+     * drops all cached entries.
+     */
+    static void set_exec_cache(enum ExecCacheMode ec);
+
+    /// Drop all entries of the process-wide executable cache.
+    static void clear_exec_cache();
+
+    // *** Threading ***
+
+    /// Enumeration of the threads on which user objects, i.e. function
+    /// stages, input sources and output sinks, are called.
+    enum FunctionMode
+    {
+	FM_INLINE=0, ///< in the thread calling run() (default).
+	FM_THREAD=1, ///< on a dedicated worker thread per object.
+	FM_PROCESS=2 ///< in a forked worker process, function stages only.
+    };
+
     // *** Input Selectors ***
 
     ///@{ \name Input Selectors
@@ -180,16 +461,38 @@ public:
     /**
      * Assign a std::string as input stream source. The contents of the string
      * will be written to the first exec stage. The string object is not copied
-     * and must still exist when run() is called.
+     * and must still exist while the pipe runs, see run().
+     *
+     * If zerocopy is true, large strings are not copied into the pipe, instead
+     * their pages are mapped into it using vmsplice(). The pages stay mapped
+     * until the pipe finished, thus the string must neither be modified nor
+     * freed before, i.e. until run() returns, is_finished() is true after
+     * start(), or the pool's PipeCallback::finished() was called. Small
+     * inputs and kernels without vmsplice() support are written as usual.
      */
-    void set_input_string(const std::string* input);
+    void set_input_string(const std::string* input, bool zerocopy = false);
+
+    /**
+     * Assign a list of files as input stream source. The files are
+     * concatenated in order and moved into the first stage's input by the
+     * parent using splice(), like a "cat" stage without its fork and copy.
+     * The files are opened lazily one at a time. The vector is not copied and
+     * must still exist while the pipe runs, see run().
+     */
+    void set_input_files(const std::vector<std::string>* paths);
 
     /**
      * Assign a PipeSource as input stream source. The object will be queried
      * via the read() function for data which is then written to the first exec
      * stage.
+     *
+     * In FM_THREAD mode, poll() is called in a loop on a worker thread
+     * started by run(), thus a source which blocks, e.g. on a database
+     * cursor, does not stall the other file descriptors of the pipe. The
+     * written data is handed to the event loop in chunks via a bounded
+     * lock-free queue, a full queue blocks the source's write().
      */
-    void set_input_source(PipeSource* source);
+    void set_input_source(PipeSource* source, enum FunctionMode fm = FM_INLINE);
     
     ///@}
 
@@ -212,15 +515,21 @@ public:
     /**
      * Assign a std::string as output stream destination. The output of the
      * last exec stage will be stored as the contents of the string. The string
-     * object is not copied and must still exist when run() is called.
+     * object is not copied and must still exist while the pipe runs, see
+     * run().
      */
     void set_output_string(std::string* output);
 
     /**
      * Assign a PipeSink as output stream destination. The object will receive
      * data via the process() function and is informed via eof()
+     *
+     * In FM_THREAD mode, process() and eof() are called on a worker thread
+     * started by run(). The event loop reads the output into chunks which are
+     * passed to the thread via a bounded lock-free queue, a full queue
+     * throttles the last stage.
      */
-    void set_output_sink(PipeSink* sink);
+    void set_output_sink(PipeSink* sink, enum FunctionMode fm = FM_INLINE);
 
     ///@}
 
@@ -259,8 +568,8 @@ public:
 
     /**
      * Add an exec() stage to the pipe with given arguments. The vector of
-     * arguments is not copied, so it must still exist when run() is
-     * called. Note that the program called is args[0].
+     * arguments is not copied, so it must still exist while the pipe
+     * runs. Note that the program called is args[0].
      */
     void add_exec(const std::vector<std::string>* args);
 
@@ -268,7 +577,8 @@ public:
     /**
      * Add an execp() stage to the pipe with given arguments. The PATH variable
      * is search for programs not containing a slash / character. Note that
-     * argv[0] is set to prog.
+     * argv[0] is set to prog. Throws if the program cannot be found and the
+     * executable cache is enabled, see set_exec_cache().
      */
     void add_execp(const char* prog);
 
@@ -296,8 +606,8 @@ public:
     /**
      * Add an execp() stage to the pipe with given arguments. The PATH variable
      * is search for programs not containing a slash / character. The vector of
-     * arguments is not copied, so it must still exist when run() is
-     * called. Note that the program called is args[0].
+     * arguments is not copied, so it must still exist while the pipe
+     * runs. Note that the program called is args[0].
      */
     void add_execp(const std::vector<std::string>* args);
 
@@ -305,7 +615,7 @@ public:
      * Add an exece() stage to the pipe with the given arguments and
      * environments. This is the most flexible exec() call. The vector of
      * arguments and environment variables is not copied, so it must still
-     * exist when run() is called. The args[0] is _not_ override with path, so
+     * exist while the pipe runs. The args[0] is _not_ override with path, so
      * you can fake program name calls.
      */
     void add_exece(const char* path,
@@ -316,8 +626,160 @@ public:
      * Add a function stage to the pipe. This function object will be called in
      * the parent process with data passing through the stage. See PipeFunction
      * for more information.
+     *
+     * In FM_THREAD mode, process() and eof() are called on a worker thread
+     * started by run(), thus several CPU-heavy function stages use multiple
+     * cores. Data is passed between the event loop and the worker through
+     * lock-free queues of chunks. The function's write() calls remain on
+     * the worker thread, the object must therefore not be shared with other
+     * stages. Builds with STX_EXECPIPE_NO_THREADS run all stages inline.
+     *
+     * In FM_PROCESS mode, run() forks a worker process which calls the
+     * function on its own stdin and stdout pipes, like an exec stage. This
+     * isolates crash-prone code and uses another core. The stage is treated
+     * as an exec stage: its exit status, deadline and failure policy apply,
+     * a crash or an exception in the worker fails the stage. Results of
+     * eof() are passed back via save_state() in the worker and
+     * restore_state() on the parent's object. The fork happens before any
+     * worker threads are started, other threads of the program must not
+     * hold locks needed by the function.
+     */
+    void add_function(PipeFunction* func, enum FunctionMode fm = FM_INLINE);
+
+    /**
+     * Add an observer stage to the pipe. The PipeSink object receives all
+     * data passing through the stage via process() and eof(), but cannot
+     * modify it. The data is forwarded unmodified to the next stage by the
+     * kernel via tee(), so observing costs only one copy into the parent. If
+     * the adjacent stages are not connected by pipes, the data is copied.
+     */
+    void add_observer(PipeSink* observer);
+
+    /**
+     * Add a coprocess stage to the pipe. The persistent program receives the
+     * stage's input as one request and its reply is forwarded to the next
+     * stage. See Coprocess for more information.
+     */
+    void add_coprocess(Coprocess* coprocess);
+
+    ///@}
+
+    // *** Buffer Limits ***
+
+    ///@{ \name Buffer Limits
+
+    /**
+     * Set the default high and low watermarks in bytes of the output buffers
+     * of function and observer stages. When a stage has buffered more than
+     * the high watermark, its input is not read until the buffer drains below
+     * the low watermark, thus slow consumers push back on upstream stages via
+     * the kernel pipes. A high watermark of zero disables the limit. The
+     * default is 4 MiB high and 1 MiB low.
+     */
+    void set_buffer_limits(unsigned int high, unsigned int low);
+
+    /**
+     * Set the high and low watermarks in bytes of one function or observer
+     * stage's output buffer, overriding the pipe's defaults.
+     */
+    void set_buffer_limits(unsigned int stageid, unsigned int high, unsigned int low);
+
+    ///@}
+
+    // *** Pipe Capacity ***
+
+    ///@{ \name Pipe Capacity
+
+    /**
+     * Set the capacity in bytes requested via F_SETPIPE_SZ for all pipes
+     * created by run(). Larger pipes reduce the number of context switches
+     * between high-throughput stages. The request is capped at
+     * /proc/sys/fs/pipe-max-size, and zero keeps the kernel's default of
+     * usually 64 KiB.
      */
-    void add_function(PipeFunction* func);
+    void set_pipe_capacity(unsigned int bytes);
+
+    /**
+     * Set the capacity in bytes requested for one edge's pipe, overriding the
+     * default. Edge i is the pipe into stage i, thus edge 0 is the input
+     * stream's pipe and edge size() the output stream's pipe.
+     */
+    void set_pipe_capacity(unsigned int edge, unsigned int bytes);
+
+    ///@}
+
+    // *** Read Chunk Size ***
+
+    ///@{ \name Read Chunk Size
+
+    /**
+     * Set a fixed number of bytes requested by each read() on the inputs of
+     * function and observer stages and on the output stream. This disables
+     * the adaptive mode.
+     */
+    void set_read_size(unsigned int bytes);
+
+    /**
+     * Enable the adaptive read chunk size, which is the default. The chunk
+     * size starts at minsize and doubles while reads return full chunks, up
+     * to maxsize, and halves again when reads return less than a quarter,
+     * e.g. for latency-sensitive trickle traffic. A maxsize of zero selects
+     * the capacity of each edge's pipe. The default is 4 KiB to pipe
+     * capacity.
+     */
+    void set_read_size_adaptive(unsigned int minsize, unsigned int maxsize = 0);
+
+    ///@}
+
+    // *** Failure Policy ***
+
+    ///@{ \name Failure Policy
+
+    /// Enumeration of the reactions of run() to a failed exec stage.
+    enum FailurePolicy
+    {
+	FP_IGNORE=0, ///< keep processing until all streams close (default).
+	FP_ABORT=1   ///< terminate the other stages with SIGTERM, discard
+		     ///< buffered data and stop polling the input source.
+    };
+
+    /**
+     * Select the reaction to a critical exec stage which exits with a
+     * non-zero return code or is killed by a signal other than SIGPIPE, like
+     * the shell's pipefail option. The exit is noticed by the event loop if
+     * the kernel supports pidfds or the stage was launched by the fork
+     * server, otherwise only after all streams closed. The aborting stage is
+     * reported by get_failed_stage().
+     */
+    void set_failure_policy(enum FailurePolicy fp);
+
+    /// Select whether an exec stage's failure triggers the failure policy.
+    /// All exec stages are critical by default.
+    void set_stage_critical(unsigned int stageid, bool critical);
+
+    ///@}
+
+    // *** Deadlines ***
+
+    ///@{ \name Deadlines
+
+    /**
+     * Set the number of milliseconds the whole pipe may run, measured on the
+     * monotonic clock from the start of run(), zero for no limit (default).
+     * On expiry the pipe is aborted: all running exec stages receive the
+     * timeout signal and all streams are closed.
+     */
+    void set_timeout(unsigned int msec);
+
+    /// Set the number of milliseconds an exec stage may run after its launch,
+    /// zero for no limit (default). On expiry only this stage receives the
+    /// timeout signal.
+    void set_stage_timeout(unsigned int stageid, unsigned int msec);
+
+    /// Set the signal sent to exec stages whose deadline expired, and the
+    /// grace period in milliseconds after which SIGKILL follows if they are
+    /// still running. The default is SIGTERM with one second grace.
+    void set_timeout_signal(int sig, unsigned int grace_msec);
 
     ///@}
 
@@ -329,9 +791,69 @@ public:
      *
      * This function call should be wrapped into a try-catch block as it will
      * throw() if a system call fails.
+     *
+     * SIGPIPE is blocked in the calling thread during run(), thus a stage
+     * closing its input early does not kill the process. Such SIGPIPEs are
+     * discarded, and exec stages are launched with SIGPIPE unblocked.
+     *
+     * The strings, vectors and objects passed to the pipe are not copied and
+     * are used while it runs: until run() returns, until is_finished() is
+     * true after start(), or until the PipeCallback::finished() of an
+     * ExecPipePool was called for it.
      */
     ExecPipe& run();
 
+    // *** Run Pipe in External Event Loop ***
+
+    /// Event flags of the file descriptors watched by an external event loop.
+    enum PollEvents {
+	PL_READ=1,  ///< wait until the file descriptor is readable.
+	PL_WRITE=2  ///< wait until the file descriptor is writable.
+    };
+
+    /// File descriptor and the events an external event loop waits for.
+    struct PollFd
+    {
+	int	fd;	 ///< file descriptor to watch.
+	int	events;  ///< combination of PollEvents.
+    };
+
+    /**
+     * Launch the configured pipe sequence like run(), but return immediately
+     * instead of waiting for it. The pipe is then advanced by an external
+     * event loop, which watches the file descriptors of get_poll_fds() and
+     * calls on_ready() until is_finished() returns true. Afterwards the
+     * return codes are inspected as after run().
+     *
+     * The external event loop must be level-triggered. Neither run() nor
+     * start() may be called again before the pipe finished.
+     */
+    ExecPipe& start();
+
+    /**
+     * Fill fds with the file descriptors and events the started pipe waits
+     * for, replacing its previous contents. Returns the number of
+     * milliseconds after which on_ready(-1, 0) must be called even if no file
+     * descriptor became ready, or -1 for no limit. The set changes after each
+     * on_ready() call and must be queried again.
+     */
+    int get_poll_fds(std::vector<PollFd>& fds) const;
+
+    /**
+     * Handle the events ready on one file descriptor of get_poll_fds(), with
+     * hangups and errors reported as both PL_READ and PL_WRITE. A call with
+     * fd -1 only advances the timeouts and the reaping of children.
+     *
+     * SIGPIPE is blocked in the calling thread during each call like during
+     * run(). If an exception is thrown, the pipe is aborted, but it must
+     * still be driven until is_finished() to reap its children.
+     */
+    void on_ready(int fd, int events);
+
+    /// Return true if the pipe is not running, i.e. all stages of the last
+    /// start() finished and all children were reaped.
+    bool is_finished() const;
+
     // *** Inspection After Pipe Execution ***
 
     ///@{ \name Inspect Return Codes
@@ -359,9 +881,160 @@ public:
      */
     bool all_return_codes_zero() const;
 
+    /**
+     * Return the largest number of bytes held in a function or observer
+     * stage's output buffer during the last run().
+     */
+    unsigned int get_buffer_peak(unsigned int stageid) const;
+
+    /**
+     * Return the capacity in bytes the kernel granted to an edge's pipe during
+     * the last run(), or zero if the edge was not a pipe created by run().
+     */
+    unsigned int get_pipe_capacity(unsigned int edge) const;
+
+    /**
+     * Return the distribution of the number of bytes returned by read() on an
+     * edge during the last run(). Slot k of the vector counts reads which
+     * returned between 2^k and 2^(k+1)-1 bytes.
+     */
+    std::vector<unsigned long> get_read_histogram(unsigned int edge) const;
+
+    /**
+     * Return the number of read(), write(), writev(), splice(), tee() and
+     * vmsplice() calls issued on the data path during the last run().
+     */
+    unsigned long get_syscall_count() const;
+
+    /**
+     * Return the number of times the event loop waited for events during the
+     * last run(). Each wait costs at least one system call, plus the
+     * registration changes of the backend.
+     */
+    unsigned long get_poll_count() const;
+
+    /**
+     * Return the number of system calls the event loop backend saved during
+     * the last run() by batching registration changes, waits and data
+     * transfers into one call per loop turn. Only PE_IO_URING saves system
+     * calls, its transfers are not counted by get_syscall_count().
+     */
+    unsigned long get_syscalls_saved() const;
+
+    /**
+     * Return the event loop backend used during the last run(), after falling
+     * back from an unavailable one. Pipes driven by an external event loop
+     * via start() report PE_AUTO.
+     */
+    enum PollEngine get_poll_engine_used() const;
+
+    /**
+     * Return the errno with which the exec() stage's program failed to be
+     * executed during the last run(), e.g. ENOENT, or zero if it was
+     * executed.
+     */
+    int get_exec_error(unsigned int stageid) const;
+
+    /**
+     * Return the exec() stage which failed and thereby aborted the last
+     * run(), or -1 if the pipe was not aborted. A failed exec() always aborts
+     * the pipe immediately: stages already running are terminated with
+     * SIGTERM, later stages are not launched and report termination by
+     * SIGTERM as well, and no data is processed. The failed stage itself
+     * reports return code 255. Other failures abort the pipe under the
+     * FP_ABORT failure policy.
+     */
+    int get_failed_stage() const;
+
+    /// Return true if the pipe's deadline expired during the last run().
+    bool get_timed_out() const;
+
+    /// Return true if the exec stage was signaled during the last run()
+    /// because its own or the pipe's deadline expired.
+    bool get_stage_timed_out(unsigned int stageid) const;
+
     ///@}
 };
- 
+
+/**
+ * Abstract class notified by an ExecPipePool when one of its pipes finished.
+ */
+class PipeCallback
+{
+public:
+    /// Virtual destructor for derived classes.
+    virtual ~PipeCallback() {}
+
+    /// Called once the pipe finished running and all its children were
+    /// reaped. If the run failed with an exception, error contains its
+    /// message and the pipe was aborted, otherwise error is empty. The
+    /// callback must not throw.
+    virtual void finished(ExecPipe& ep, const std::string& error) = 0;
+};
+
+/**
+ * \brief Runs many pipes concurrently in one event loop
+ *
+ * Instead of occupying one thread per ExecPipe::run(), the pool drives all
+ * added pipes from a single event loop in the thread calling run(): their
+ * file descriptors, child exits and deadlines are multiplexed via one shared
+ * event loop backend.
+ *
+ * The number of concurrently running child processes can be capped, pipes
+ * are then started in the order they were added once enough of the earlier
+ * ones finished. A pipe needing more children than the cap is started when
+ * it is the only one running. After each pipe finishes, its PipeCallback is
+ * called, which may add further pipes to the pool.
+ *
+ * An ExecPipe cannot be added again or run by itself while it is queued or
+ * running in the pool: add(), ExecPipe::run() and ExecPipe::start() then
+ * throw. Blocking calls of inline function stages, sources
+ * or sinks stall all pipes of the pool, use FM_THREAD for those.
+ */
+class ExecPipePool
+{
+protected:
+    /// pointer implementation
+    class ExecPipePoolImpl*	m_impl;
+
+private:
+    /// Non-copyable: the pool owns its queued pipes' run state.
+    ExecPipePool(const ExecPipePool& pool);
+
+    /// Non-copyable: the pool owns its queued pipes' run state.
+    ExecPipePool& operator=(const ExecPipePool& pool);
+
+public:
+    /// Construct an empty pool without a cap on children.
+    ExecPipePool();
+
+    /// Release the pool, which must not be running.
+    ~ExecPipePool();
+
+    /// Select the event loop backend shared by all pipes, see
+    /// ExecPipe::set_poll_engine(). The pipes' own selection is ignored.
+    void set_poll_engine(enum ExecPipe::PollEngine pe);
+
+    /// Set the maximum number of concurrently running child processes, i.e.
+    /// exec and FM_PROCESS function stages, of all pipes. Zero (default)
+    /// means unlimited. As each child holds about three descriptors in the
+    /// parent (its pipes and pidfd), the cap also keeps the pool below the
+    /// process' file descriptor limit, which the pool does not check itself.
+    void set_max_children(unsigned int n);
+
+    /// Queue a configured pipe to be run by the pool. The ExecPipe reference
+    /// is kept until the pipe finished and the optional callback was called.
+    /// Throws if the pipe is running or already queued.
+    void add(const ExecPipe& ep, PipeCallback* callback = NULL);
+
+    /// Return the number of pipes queued or running.
+    unsigned int size() const;
+
+    /// Run all queued pipes, including those added by callbacks, until all
+    /// finished.
+    void run();
+};
+
 } // namespace stx
 
 #endif // _STX_EXECPIPE_H_
@@ -23,10 +23,32 @@
 #include "stx-execpipe.h"
 
 #include <assert.h>
+#include <stdlib.h>
+#include <string.h>
 #include <iostream>
+#include <stdexcept>
 #include <sstream>
 #include <iomanip>
 
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/select.h>
+#include <poll.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+#ifndef STX_EXECPIPE_NO_THREADS
+#include <pthread.h>
+#endif
+
+#if defined(__linux__) && !defined(STX_EXECPIPE_NO_IO_URING)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
 // Test pipe: none -> program -> string
 void test_none_program_string()
 {
@@ -63,6 +85,27 @@ void test_string_program_string()
     assert( output == input );
 }
 
+// Test pipe: string -> program -> string with vmsplice() of the input string
+
+void test_string_zerocopy_program_string()
+{
+    stx::ExecPipe ep;
+
+    std::string input = "test123";
+    for (unsigned int i = 0; i < 4*1024*1024; ++i)
+	input += static_cast<char>(i * 7);
+    ep.set_input_string(&input, true);
+
+    std::string output;
+    ep.set_output_string(&output);
+
+    ep.add_exec("/bin/cat");
+
+    assert( ep.run().all_return_codes_zero() );
+
+    assert( output == input );
+}
+
 // Test pipe: string -> program -> program -> string
 void test_string_program_program_string()
 {
@@ -99,6 +142,65 @@ void test_file_program_string()
     assert( output.size() );
 }
 
+// Test pipe: files -> program -> string
+
+void test_files_program_string()
+{
+    stx::ExecPipe ep;
+
+    std::vector<std::string> files;
+    files.push_back("/proc/uptime");	// cannot be spliced, will be copied
+    files.push_back("../testsuite/test_execpipe.cc");
+    files.push_back("/dev/null");
+    files.push_back("../testsuite/test_ringbuffer.cc");
+    ep.set_input_files(&files);
+
+    std::string output;
+    ep.set_output_string(&output);
+
+    ep.add_execp("cat");
+
+    assert( ep.run().all_return_codes_zero() );
+
+    // compare with the same files read by a single cat
+    stx::ExecPipe ep2;
+    ep2.add_execp("cat", files[1].c_str(), files[3].c_str());
+
+    std::string output2;
+    ep2.set_output_string(&output2);
+
+    assert( ep2.run().all_return_codes_zero() );
+
+    assert( output.size() > output2.size() );
+    assert( output.substr(output.size() - output2.size()) == output2 );
+
+    // a file failing to be read after the access() check throws instead of
+    // silently truncating the input.
+    {
+	std::vector<std::string> bad;
+	bad.push_back(files[1]);
+	bad.push_back("/tmp");
+
+	stx::ExecPipe ep5;
+	ep5.set_input_files(&bad);
+	ep5.add_execp("cat");
+
+	std::string output5;
+	ep5.set_output_string(&output5);
+
+	bool thrown = false;
+
+	try {
+	    ep5.run();
+	}
+	catch (std::runtime_error& e) {
+	    thrown = (std::string(e.what()).find("Could not read input file /tmp") != std::string::npos);
+	}
+
+	assert( thrown );
+    }
+}
+
 // Test pipe: string -> program -> object
 
 class TestSink : public stx::PipeSink
@@ -141,6 +243,8 @@ void test_string_program_object()
     assert( sink.m_ok );
 }
 
+// Old-style source which only overrides the plain poll() without hint.
+
 class TestSource : public stx::PipeSource
 {
 public:
@@ -153,6 +257,8 @@ public:
     {
     }
 
+    using stx::PipeSource::poll;
+
     virtual bool poll()
     {
 	for (unsigned int i = 0; i < 1000 && m_count > 0; ++i, --m_count)
@@ -168,6 +274,10 @@ public:
 
 // Test pipe: object -> program -> string
 
+class TestEmptySource : public stx::PipeSource
+{
+};
+
 void test_object_program_string()
 {
     stx::ExecPipe ep;
@@ -183,6 +293,163 @@ void test_object_program_string()
     assert( ep.run().all_return_codes_zero() );
 
     assert( source.m_wrote == output );
+
+    // a source overriding neither poll() is an error, not an empty input
+    {
+	stx::ExecPipe ep;
+
+	TestEmptySource source;
+	ep.set_input_source(&source);
+
+	ep.add_execp("cat");
+
+	bool thrown = false;
+
+	try {
+	    ep.run();
+	}
+	catch (std::runtime_error& e) {
+	    thrown = true;
+	}
+
+	assert( thrown );
+    }
+}
+
+// Test pipe: object with byte hint -> program -> string
+
+class TestHintSource : public stx::PipeSource
+{
+public:
+    unsigned int	m_count;
+
+    unsigned int	m_polls;
+
+    std::string		m_wrote;
+
+    TestHintSource()
+	: m_count(4*1024*1024), m_polls(0)
+    {
+    }
+
+    using stx::PipeSource::poll;
+
+    virtual bool poll(unsigned int hint)
+    {
+	assert( hint > 0 );
+	++m_polls;
+
+	std::string data;
+	for (unsigned int i = 0; i < hint && m_count > 0; ++i, --m_count)
+	    data += static_cast<char>(m_count);
+
+	write(data.data(), data.size());
+	m_wrote += data;
+
+	return (m_count > 0);
+    }
+};
+
+void test_hint_object_program_string()
+{
+    stx::ExecPipe ep;
+
+    TestHintSource source;
+    ep.set_input_source(&source);
+
+    std::string output;
+    ep.set_output_string(&output);
+
+    ep.add_execp("cat");
+
+    assert( ep.run().all_return_codes_zero() );
+
+    assert( source.m_wrote == output );
+    assert( output.size() == 4*1024*1024 );
+
+    // at least one PIPE_BUF per poll, usually much more.
+    assert( source.m_polls <= 4*1024*1024 / 4096 );
+}
+
+// Test pipe: string -> program -> program -> string with enlarged pipes
+
+void test_pipe_capacity_string_program_program_string()
+{
+    stx::ExecPipe ep;
+
+    std::string input(2*1024*1024, 'x');
+    ep.set_input_string(&input);
+
+    std::string output;
+    ep.set_output_string(&output);
+
+    ep.add_execp("cat");
+    ep.add_execp("cat");
+
+    ep.set_pipe_capacity(256*1024);
+    ep.set_pipe_capacity(2, 4096);
+
+    assert( ep.run().all_return_codes_zero() );
+    assert( output == input );
+
+    // capacities depend on the system's limits, but the small edge is
+    // always honoured.
+    assert( ep.get_pipe_capacity(0) >= 64*1024 );
+    assert( ep.get_pipe_capacity(1) >= 64*1024 );
+    assert( ep.get_pipe_capacity(2) == 4096 );
+}
+
+// Test pipe: string -> program -> string with fixed and adaptive read sizes
+
+unsigned long histogram_count(const std::vector<unsigned long>& hist, unsigned int from)
+{
+    unsigned long count = 0;
+    for (unsigned int k = from; k < hist.size(); ++k)
+	count += hist[k];
+    return count;
+}
+
+void test_read_size_string_program_string()
+{
+    std::string input(4*1024*1024, 'y');
+    std::string output;
+
+    {
+	stx::ExecPipe ep;
+	ep.set_input_string(&input);
+	ep.set_output_string(&output);
+	ep.add_execp("cat");
+
+	ep.set_read_size(1024);
+
+	assert( ep.run().all_return_codes_zero() );
+	assert( output == input );
+
+	// no read may return more than the fixed chunk.
+	std::vector<unsigned long> hist = ep.get_read_histogram(1);
+	assert( hist.size() <= 11 );
+	assert( histogram_count(hist, 0) >= input.size() / 1024 );
+    }
+
+    output.clear();
+
+    {
+	stx::ExecPipe ep;
+	ep.set_input_string(&input);
+	ep.set_output_string(&output);
+	ep.add_execp("cat");
+
+	ep.set_read_size_adaptive(4096, 64*1024);
+
+	assert( ep.run().all_return_codes_zero() );
+	assert( output == input );
+
+	// bulk data grows the chunk beyond the minimum.
+	std::vector<unsigned long> hist = ep.get_read_histogram(1);
+	assert( hist.size() <= 17 );
+	assert( histogram_count(hist, 13) > 0 );
+	assert( histogram_count(hist, 0) < input.size() / 4096 );
+    }
 }
 
 // Test pipe: object -> program -> function -> program -> string
@@ -233,6 +500,17 @@ std::string HexString(const std::string& str)
     return os.str();
 }
 
+/// Return size bytes of a pattern which does not repeat within 4 KiB blocks.
+std::string pattern_string(unsigned int size)
+{
+    std::string str(size, 0);
+
+    for (unsigned int i = 0; i < size; ++i)
+	str[i] = static_cast<char>(i * 7 + i / 4096);
+
+    return str;
+}
+
 void test_object_program_object_program_string()
 {
     stx::ExecPipe ep;
@@ -277,37 +555,1732 @@ void test_object_program_object_string()
     assert( output.size() == 100*1024 );
 }
 
-void test_none_program_set_string()
+// Test pipe: string -> program -> function -> string counting system calls
+
+unsigned long syscall_count_string_program_function_string(bool fixed)
 {
     stx::ExecPipe ep;
 
-    std::vector<std::string> args;
-    args.push_back("/bin/sh");
-    args.push_back("-c");
-    args.push_back("set");
+    std::string input(1024*1024, 'z');
+    ep.set_input_string(&input);
 
-    std::vector<std::string> envs;
-    envs.push_back("TEST=123");
+    std::string output;
+    ep.set_output_string(&output);
 
-    ep.add_exece("/bin/sh", &args, &envs);
+    ep.add_execp("cat");
+
+    TestFunctionMD5 md5func;
+    ep.add_function(&md5func);
+
+    if (fixed) ep.set_read_size(4096);
+
+    assert( ep.run().all_return_codes_zero() );
+    assert( output == input );
+
+    return ep.get_syscall_count();
+}
+
+void test_syscall_count_string_program_function_string()
+{
+    unsigned long chunks = 1024*1024 / 4096;
+
+    // each 4 KiB chunk is read once from cat and once from the output pipe,
+    // and written at most once in between.
+    unsigned long fixed = syscall_count_string_program_function_string(true);
+
+    assert( fixed >= 2 * chunks );
+    assert( fixed <= 3 * chunks + 64 );
+
+    // adaptive reads cut the number of calls further.
+    unsigned long adaptive = syscall_count_string_program_function_string(false);
+
+    assert( adaptive < fixed / 2 );
+}
+
+// Test pipe: object -> program -> observer -> program -> string
+
+class TestObserverMD5 : public stx::PipeSink
+{
+public:
+
+    MD5_CTX 	m_ctx;
+
+    std::string m_digest;
+
+    TestObserverMD5()
+    {
+	MD5_Init(&m_ctx);
+    }
+
+    virtual void process(const void* data, unsigned int datalen)
+    {
+	MD5_Update(&m_ctx, data, datalen);
+    }
+
+    virtual void eof()
+    {
+	unsigned char digest[MD5_DIGEST_LENGTH];
+	MD5_Final(digest, &m_ctx);
+
+	m_digest.assign(reinterpret_cast<char*>(digest), sizeof(digest));
+    }
+};
+
+void test_object_program_observer_program_string()
+{
+    stx::ExecPipe ep;
+
+    TestSource source;
+    ep.set_input_source(&source);
 
     std::string output;
     ep.set_output_string(&output);
 
+    ep.add_execp("cat");
+
+    TestObserverMD5 observer;
+    ep.add_observer(&observer);
+
+    ep.add_execp("md5sum");
+
     assert( ep.run().all_return_codes_zero() );
 
-    assert( output.find("TEST=123") != std::string::npos );
+    assert( HexString(observer.m_digest) == "0b66fcadf3a46cce7184487c4dabaf0f" );
+    assert( output == "0b66fcadf3a46cce7184487c4dabaf0f  -\n" );
 }
 
-void test_error_debug_output_null(const char*)
+// Test pipe: file -> observer -> program -> file, where tee() is impossible on
+// the input and data is copied.
+
+void test_file_observer_program_file()
+{
+    stx::ExecPipe ep;
+
+    std::string input = "test123";
+    input += std::string(256*1024, '\1');
+
+    {
+	stx::ExecPipe ep0;
+	ep0.set_input_string(&input);
+	ep0.add_exec("/bin/cat");
+	ep0.set_output_file("/tmp/stx-execpipe-test-observer.in");
+	assert( ep0.run().all_return_codes_zero() );
+    }
+
+    ep.set_input_file("/tmp/stx-execpipe-test-observer.in");
+
+    TestObserverMD5 observer;
+    ep.add_observer(&observer);
+
+    ep.add_execp("md5sum");
+
+    std::string output;
+    ep.set_output_string(&output);
+
+    assert( ep.run().all_return_codes_zero() );
+
+    assert( output == HexString(observer.m_digest) + "  -\n" );
+
+    unlink("/tmp/stx-execpipe-test-observer.in");
+}
+
+// Test pipe: string -> observer -> string. A tee() finding its input drained
+// must not wait for the output to become writable, which would cost an extra
+// event loop turn per chunk.
+
+void test_string_observer_string()
 {
+    std::string input = pattern_string(8*1024*1024);
+
+    stx::ExecPipe ep;
+    ep.set_input_string(&input);
+
+    TestObserverMD5 observer;
+    ep.add_observer(&observer);
+
+    std::string output;
+    ep.set_output_string(&output);
+
+    assert( ep.run().all_return_codes_zero() );
+
+    assert( output == input );
+
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    MD5(reinterpret_cast<const unsigned char*>(input.data()), input.size(), digest);
+    assert( observer.m_digest == std::string(reinterpret_cast<char*>(digest), sizeof(digest)) );
+
+    // each turn writes, tee()s, reads and forwards a chunk, the spurious
+    // waits raised the ratio from a third to a half.
+    assert( ep.get_poll_count() * 5 < ep.get_syscall_count() * 2 );
 }
 
-void test_error_none_program_none()
+// Test pipe: string -> program -> function -> slow program -> string, the
+// function stage's buffer must stay bounded by the watermarks.
+
+class TestFunctionAmplify : public stx::PipeFunction
+{
+public:
+    virtual void process(const void* data, unsigned int datalen)
+    {
+	for (unsigned int i = 0; i < 4; ++i)
+	    write(data, datalen);
+    }
+
+    virtual void eof()
+    {
+    }
+};
+
+void test_string_program_function_slow_string()
+{
+    stx::ExecPipe ep;
+
+    std::string input(2*1024*1024, 'a');
+    ep.set_input_string(&input);
+
+    std::string output;
+    ep.set_output_string(&output);
+
+    ep.add_exec("/bin/cat");
+
+    TestFunctionAmplify func;
+    ep.add_function(&func);
+
+    ep.add_exec("/bin/sh", "-c", "sleep 1; exec cat");
+
+    ep.set_buffer_limits(1, 256*1024, 64*1024);
+
+    // the overshoot above the high watermark is at most one amplified chunk.
+    ep.set_read_size(4096);
+
+    assert( ep.run().all_return_codes_zero() );
+
+    assert( output.size() == 4 * input.size() );
+    assert( ep.get_buffer_peak(1) < 256*1024 + 4 * 4096 );
+}
+
+// Test pipe: string -> program -> function with no output. Without an output
+// pipe nothing drains the function's buffer, thus it must neither fill up
+// beyond the high watermark nor throttle the stage's input.
+
+void test_string_program_function_none()
+{
+    std::string input = pattern_string(6*1024*1024);
+
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    MD5(reinterpret_cast<const unsigned char*>(input.data()), input.size(), digest);
+
+    for (unsigned int mode = 0; mode < 2; ++mode)
+    {
+	stx::ExecPipe ep;
+	ep.set_input_string(&input);
+
+	ep.add_exec("/bin/cat");
+
+	TestFunctionMD5 func;
+	ep.add_function(&func, mode ? stx::ExecPipe::FM_THREAD : stx::ExecPipe::FM_INLINE);
+
+	assert( ep.run().all_return_codes_zero() );
+
+	assert( func.m_digest == std::string(reinterpret_cast<char*>(digest), sizeof(digest)) );
+	assert( ep.get_buffer_peak(1) == 0 );
+    }
+}
+
+void test_none_program_set_string()
+{
+    stx::ExecPipe ep;
+
+    std::vector<std::string> args;
+    args.push_back("/bin/sh");
+    args.push_back("-c");
+    args.push_back("set");
+
+    std::vector<std::string> envs;
+    envs.push_back("TEST=123");
+
+    ep.add_exece("/bin/sh", &args, &envs);
+
+    std::string output;
+    ep.set_output_string(&output);
+
+    assert( ep.run().all_return_codes_zero() );
+
+    assert( output.find("TEST=123") != std::string::npos );
+}
+
+// Test pipe: string -> program -> program -> string launched with fork() and
+// with posix_spawn(), with and without custom environment
+
+void test_launch_string_program_program_string()
+{
+    static const stx::ExecPipe::LaunchEngine engines[] = {
+	stx::ExecPipe::LE_FORK, stx::ExecPipe::LE_SPAWN
+    };
+
+    for (unsigned int e = 0; e < 2; ++e)
+    {
+	stx::ExecPipe ep;
+	ep.set_launch_engine(engines[e]);
+
+	std::string input = "test123";
+	ep.set_input_string(&input);
+
+	std::string output;
+	ep.set_output_string(&output);
+
+	ep.add_execp("cat");
+
+	std::vector<std::string> args, env;
+	args.push_back("sh");
+	args.push_back("-c");
+	args.push_back("cat; echo $TEST");
+	env.push_back("TEST=456");
+	ep.add_exece("/bin/sh", &args, &env);
+
+	assert( ep.run().all_return_codes_zero() );
+	assert( output == "test123456\n" );
+    }
+}
+
+// Test pipe: string -> program -> string with the executable cache, which is
+// invalidated by replacing the program in a PATH directory.
+
+void write_test_program(const std::string& path, const char* output, bool shebang = true)
+{
+    unlink(path.c_str());
+
+    std::string script = std::string(shebang ? "#!/bin/sh\n" : "") + "cat >/dev/null\necho " + output + "\n";
+
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0755);
+    assert( fd >= 0 );
+    assert( write(fd, script.data(), script.size()) == (ssize_t)script.size() );
+    close(fd);
+}
+
+void test_exec_cache_string_program_string()
+{
+    // resolution failures are reported when adding the stage.
+    {
+	stx::ExecPipe ep;
+
+	bool thrown = false;
+	try {
+	    ep.add_execp("xyz-non-existing-program");
+	}
+	catch (std::runtime_error&) {
+	    thrown = true;
+	}
+	assert( thrown );
+    }
+
+    char tmpdir[] = "/tmp/stx-execpipe-XXXXXX";
+    assert( mkdtemp(tmpdir) );
+
+    std::string oldpath = getenv("PATH");
+    setenv("PATH", (std::string(tmpdir) + ":" + oldpath).c_str(), 1);
+
+    std::string program = std::string(tmpdir) + "/stx-execpipe-test";
+    write_test_program(program, "first");
+
+    for (unsigned int mode = stx::ExecPipe::EC_OFF; mode <= stx::ExecPipe::EC_FD; ++mode)
+    {
+	stx::ExecPipe::set_exec_cache((stx::ExecPipe::ExecCacheMode)mode);
+
+	for (unsigned int round = 0; round < 2; ++round)
+	{
+	    stx::ExecPipe ep;
+	    ep.set_launch_engine(round ? stx::ExecPipe::LE_FORK : stx::ExecPipe::LE_SPAWN);
+
+	    std::string input = "test123";
+	    ep.set_input_string(&input);
+
+	    std::string output;
+	    ep.set_output_string(&output);
+
+	    ep.add_execp("cat");
+	    ep.add_execp("stx-execpipe-test");
+
+	    if (round == 1)
+		write_test_program(program, "second");
+
+	    assert( ep.run().all_return_codes_zero() );
+	    assert( output == (round ? "second\n" : "first\n") );
+	}
+
+	write_test_program(program, "first");
+    }
+
+    // like execvp(), cached paths run a script without shebang via /bin/sh.
+    write_test_program(program, "noshebang", false);
+
+    for (unsigned int mode = stx::ExecPipe::EC_OFF; mode <= stx::ExecPipe::EC_FD; ++mode)
+    {
+	stx::ExecPipe::set_exec_cache((stx::ExecPipe::ExecCacheMode)mode);
+
+	for (unsigned int round = 0; round < 2; ++round)
+	{
+	    stx::ExecPipe ep;
+	    ep.set_launch_engine(round ? stx::ExecPipe::LE_FORK : stx::ExecPipe::LE_SPAWN);
+
+	    // the script reads its stdin, which must not be the test's.
+	    std::string input = "test123";
+	    ep.set_input_string(&input);
+
+	    std::string output;
+	    ep.set_output_string(&output);
+
+	    ep.add_execp("stx-execpipe-test");
+
+	    assert( ep.run().all_return_codes_zero() );
+	    assert( output == "noshebang\n" );
+	}
+    }
+
+    stx::ExecPipe::set_exec_cache(stx::ExecPipe::EC_PATH);
+
+    setenv("PATH", oldpath.c_str(), 1);
+    unlink(program.c_str());
+    rmdir(tmpdir);
+}
+
+// Test pipe: none -> program -> string, where the program must not inherit
+// any file descriptors besides stdin, stdout and stderr, even those opened
+// without close-on-exec, as they would keep concurrent pipelines' pipes open.
+
+void test_fd_leak_none_program_string()
+{
+    int leakfd = dup2(STDERR_FILENO, 57);
+    assert( leakfd == 57 );
+
+    for (unsigned int e = 0; e < 2; ++e)
+    {
+	stx::ExecPipe ep;
+	ep.set_launch_engine(e ? stx::ExecPipe::LE_FORK : stx::ExecPipe::LE_SPAWN);
+
+	std::string output;
+	ep.set_output_string(&output);
+
+	ep.add_exec("/bin/ls", "/proc/self/fd");
+
+	assert( ep.run().all_return_codes_zero() );
+
+	// ls itself opens the directory as fd 3.
+	assert( output == "0\n1\n2\n3\n" );
+    }
+
+    close(leakfd);
+}
+
+#ifndef STX_EXECPIPE_NO_THREADS
+
+// Test pipe: none -> program -> program -> string, launched concurrently
+// from two threads. Each child must only see its own stdin and stdout, not
+// the pipes created at the same time by the other thread.
+
+void* test_fd_leak_thread(void* arg)
+{
+    unsigned int e = *static_cast<unsigned int*>(arg);
+
+    for (unsigned int round = 0; round < 50; ++round)
+    {
+	stx::ExecPipe ep;
+	ep.set_launch_engine(e ? stx::ExecPipe::LE_FORK : stx::ExecPipe::LE_SPAWN);
+
+	std::string output;
+	ep.set_output_string(&output);
+
+	ep.add_exec("/bin/ls", "/proc/self/fd");
+	ep.add_exec("/bin/cat");
+
+	assert( ep.run().all_return_codes_zero() );
+
+	// ls itself opens the directory as fd 3.
+	assert( output == "0\n1\n2\n3\n" );
+    }
+
+    return NULL;
+}
+
+void test_fd_leak_threads_none_program_program_string()
+{
+    for (unsigned int e = 0; e < 2; ++e)
+    {
+	unsigned int engine[2] = { e, e };
+	pthread_t thread[2];
+
+	for (unsigned int t = 0; t < 2; ++t)
+	    assert( pthread_create(&thread[t], NULL, test_fd_leak_thread, &engine[t]) == 0 );
+
+	for (unsigned int t = 0; t < 2; ++t)
+	    assert( pthread_join(thread[t], NULL) == 0 );
+    }
+}
+
+#endif // STX_EXECPIPE_NO_THREADS
+
+// Test pipe: string -> program -> program -> string, where the pipe must not
+// reap a child of the process which is not one of its stages.
+
+void test_foreign_child_string_program_program_string()
+{
+    pid_t foreign = fork();
+    if (foreign == 0) _exit(42);
+    assert( foreign > 0 );
+
+    // let the foreign child exit before the pipe's children.
+    usleep(10000);
+
+    stx::ExecPipe ep;
+
+    std::string input = "test123";
+    ep.set_input_string(&input);
+
+    std::string output;
+    ep.set_output_string(&output);
+
+    ep.add_execp("cat");
+    ep.add_exec("/bin/sh", "-c", "exit 3");
+
+    ep.run();
+
+    assert( ep.get_return_code(0) == 0 || ep.get_return_signal(0) == 13 );
+    assert( ep.get_return_code(1) == 3 );
+
+    int status;
+    assert( waitpid(foreign, &status, 0) == foreign );
+    assert( WIFEXITED(status) && WEXITSTATUS(status) == 42 );
+}
+
+void test_error_debug_output_null(const char*)
+{
+}
+
+// Test pipe: string -> program -> program -> string launched via the fork
+// server, which must pick up the current environment and directory.
+
+void test_fork_server_string_program_program_string()
+{
+    stx::ExecPipe::start_fork_server();
+
+    setenv("STX_EXECPIPE_TEST", "server", 1);
+
+    char oldcwd[4096];
+    assert( getcwd(oldcwd, sizeof(oldcwd)) );
+    assert( chdir("/") == 0 );
+
+    for (unsigned int round = 0; round < 2; ++round)
+    {
+	stx::ExecPipe ep;
+	ep.set_launch_engine(stx::ExecPipe::LE_SERVER);
+
+	std::string input = "test123";
+	ep.set_input_string(&input);
+
+	std::string output;
+	ep.set_output_string(&output);
+
+	ep.add_execp("cat");
+	ep.add_execp("sh", "-c", "cat; echo $STX_EXECPIPE_TEST; pwd; echo $PPID; exit 5");
+
+	ep.run();
+
+	assert( ep.get_return_code(0) == 0 );
+	assert( ep.get_return_code(1) == 5 );
+
+	// the stages are children of the server, not of this process.
+	std::ostringstream oss;
+	oss << "test123server\n/\n" << getpid() << "\n";
+
+	assert( output.compare(0, 15, "test123server\n/") == 0 );
+	assert( output != oss.str() );
+    }
+
+    {
+	stx::ExecPipe ep;
+	ep.set_debug_output(test_error_debug_output_null);
+	ep.set_launch_engine(stx::ExecPipe::LE_SERVER);
+
+	ep.add_exec("xyz-non-existing-program");
+	ep.run();
+
+	assert( ep.get_return_code(0) == 255 );
+    }
+
+    assert( chdir(oldcwd) == 0 );
+    unsetenv("STX_EXECPIPE_TEST");
+
+    stx::ExecPipe::stop_fork_server();
+}
+
+// Test pipe: string -> program -> coprocess -> string, reusing the same
+// coprocess for several runs and pipes with all framings.
+
+void test_coprocess_string_program_coprocess_string()
+{
+    std::vector<std::string> catargs;
+    catargs.push_back("cat");
+
+    stx::Coprocess cat(catargs);
+
+    for (unsigned int framing = 0; framing < 3; ++framing)
+    {
+	if (framing == 0)
+	    cat.set_framing_delimiter(std::string(1, '\0'), std::string(1, '\0'));
+	else if (framing == 1)
+	    cat.set_framing_length();
+	else
+	    cat.set_framing_lines(2);
+
+	for (unsigned int round = 0; round < 3; ++round)
+	{
+	    stx::ExecPipe ep;
+
+	    std::ostringstream oss;
+	    oss << "line " << framing << "\nround " << round << "\n";
+	    std::string input = oss.str();
+	    ep.set_input_string(&input);
+
+	    std::string output;
+	    ep.set_output_string(&output);
+
+	    ep.add_execp("cat");
+	    ep.add_coprocess(&cat);
+
+	    assert( ep.run().all_return_codes_zero() );
+	    assert( output == input );
+	}
+    }
+
+    // one process served all requests.
+    assert( cat.get_requests() == 9 );
+    int pid = cat.get_pid();
+    assert( pid > 0 );
+
+    // a line-based filter answering each line
+    std::vector<std::string> shargs;
+    shargs.push_back("sh");
+    shargs.push_back("-c");
+    shargs.push_back("while read l; do echo \"<$l>\"; done");
+
+    stx::Coprocess filter(shargs);
+    filter.set_framing_lines(1);
+
+    for (unsigned int round = 0; round < 3; ++round)
+    {
+	stx::ExecPipe ep;
+
+	std::string input = "abc\n";
+	ep.set_input_string(&input);
+
+	std::string output;
+	ep.set_output_string(&output);
+
+	ep.add_coprocess(&filter);
+
+	assert( ep.run().all_return_codes_zero() );
+	assert( output == "<abc>\n" );
+    }
+
+    assert( filter.get_pid() > 0 );
+    assert( WIFEXITED(filter.stop()) );
+    assert( cat.get_pid() == pid );
+
+    // a program which never replies is killed after the reply timeout or the
+    // pipe's deadline.
+    std::vector<std::string> sleepargs;
+    sleepargs.push_back("sleep");
+    sleepargs.push_back("10");
+
+    stx::Coprocess hung(sleepargs);
+    time_t start = time(NULL);
+
+    for (unsigned int deadline = 0; deadline < 2; ++deadline)
+    {
+	stx::ExecPipe ep;
+
+	std::string input = "abc";
+	ep.set_input_string(&input);
+
+	std::string output;
+	ep.set_output_string(&output);
+
+	ep.add_coprocess(&hung);
+
+	if (deadline)
+	{
+	    hung.set_reply_timeout(0);
+	    ep.set_timeout(200);
+
+	    ep.run();
+	    assert( ep.get_timed_out() );
+	}
+	else
+	{
+	    hung.set_reply_timeout(200);
+
+	    std::string thrown;
+	    try {
+		ep.run();
+	    }
+	    catch (std::runtime_error& e) {
+		thrown = e.what();
+	    }
+	    assert( thrown.find("did not reply") != std::string::npos );
+	}
+
+	assert( hung.get_pid() == 0 );
+	assert( output == "" );
+    }
+
+    assert( hung.get_requests() == 0 );
+
+    // stop() escalates to SIGKILL if the program ignores EOF and SIGTERM.
+    shargs[2] = "trap '' TERM; exec sleep 10";
+
+    stx::Coprocess stubborn(shargs);
+    stubborn.set_stop_grace(100);
+    stubborn.start();
+
+    int status = stubborn.stop();
+    assert( WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL );
+
+    assert( time(NULL) - start < 5 );
+}
+
+// Test pipe: object -> program -> function -> program -> string with select()
+
+void test_select_object_program_object_program_string()
+{
+    stx::ExecPipe ep;
+    ep.set_poll_engine(stx::ExecPipe::PE_SELECT);
+
+    TestSource source;
+    ep.set_input_source(&source);
+
+    std::string output;
+    ep.set_output_string(&output);
+
+    ep.add_execp("cat");
+
+    TestFunctionMD5 func;
+    ep.add_function(&func);
+
+    ep.add_execp("md5sum");
+
+    assert( ep.run().all_return_codes_zero() );
+
+    assert( HexString(func.m_digest) == "0b66fcadf3a46cce7184487c4dabaf0f" );
+    assert( output == "0b66fcadf3a46cce7184487c4dabaf0f  -\n" );
+}
+
+// Test pipe: object -> program -> function -> program -> string with io_uring,
+// which falls back to epoll() if the kernel does not support it.
+
+/// Return true if io_uring is compiled in and the kernel permits it.
+bool io_uring_supported()
+{
+#if defined(__linux__) && !defined(STX_EXECPIPE_NO_IO_URING) && defined(SYS_io_uring_setup)
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    int fd = syscall(SYS_io_uring_setup, 4, &params);
+    if (fd < 0) return false;
+
+    close(fd);
+    return true;
+#else
+    return false;
+#endif
+}
+
+void test_io_uring_object_program_object_program_string()
+{
+    stx::ExecPipe ep;
+    ep.set_poll_engine(stx::ExecPipe::PE_IO_URING);
+
+    TestSource source;
+    ep.set_input_source(&source);
+
+    std::string output;
+    ep.set_output_string(&output);
+
+    ep.add_execp("cat");
+
+    TestFunctionMD5 func;
+    ep.add_function(&func);
+
+    ep.add_execp("md5sum");
+
+    assert( ep.run().all_return_codes_zero() );
+
+    assert( HexString(func.m_digest) == "0b66fcadf3a46cce7184487c4dabaf0f" );
+    assert( output == "0b66fcadf3a46cce7184487c4dabaf0f  -\n" );
+
+    // the backend must not silently fall back if the kernel supports it
+    if (io_uring_supported())
+    {
+	assert( ep.get_poll_engine_used() == stx::ExecPipe::PE_IO_URING );
+	assert( ep.get_syscalls_saved() > 0 );
+    }
+}
+
+// Test pipe: string -> program -> function -> program -> string with io_uring,
+// whose reads and writes of the function's and output pipes are batched into
+// the submissions instead of being read() and written by the parent.
+
+/// Run the pipe with the given backend and return its data syscall count.
+unsigned long run_string_program_function_program_string(enum stx::ExecPipe::PollEngine pe,
+							 const std::string& input)
+{
+    stx::ExecPipe ep;
+    ep.set_poll_engine(pe);
+
+    ep.set_input_string(&input);
+
+    std::string output;
+    ep.set_output_string(&output);
+
+    ep.add_execp("cat");
+
+    TestFunctionMD5 func;
+    ep.add_function(&func);
+
+    ep.add_execp("cat");
+
+    assert( ep.run().all_return_codes_zero() );
+
+    assert( output == input );
+
+    MD5_CTX ctx;
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    MD5_Init(&ctx);
+    MD5_Update(&ctx, input.data(), input.size());
+    MD5_Final(digest, &ctx);
+
+    assert( func.m_digest == std::string(reinterpret_cast<char*>(digest), sizeof(digest)) );
+
+    return ep.get_syscall_count();
+}
+
+void test_io_uring_string_program_function_program_string()
+{
+    std::string input = pattern_string(8*1024*1024);
+
+    unsigned long epoll_count
+	= run_string_program_function_program_string(stx::ExecPipe::PE_EPOLL, input);
+
+    unsigned long io_uring_count
+	= run_string_program_function_program_string(stx::ExecPipe::PE_IO_URING, input);
+
+    // only the input string is still written by the parent.
+    if (io_uring_supported())
+	assert( io_uring_count * 2 < epoll_count );
+}
+
+// Test pipe: string -> program -> function -> string with all file descriptors
+// above FD_SETSIZE, which only works with the epoll() backend.
+
+void test_epoll_high_fds()
+{
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0) return;
+
+    if (rl.rlim_cur < FD_SETSIZE + 64)
+    {
+	if (rl.rlim_max < FD_SETSIZE + 64) return;
+	rl.rlim_cur = FD_SETSIZE + 64;
+	if (setrlimit(RLIMIT_NOFILE, &rl) != 0) return;
+    }
+
+    // occupy all file descriptors below FD_SETSIZE
+    std::vector<int> fillfds;
+    int fd;
+    while ((fd = open("/dev/null", O_RDONLY)) >= 0)
+    {
+	fillfds.push_back(fd);
+	if (fd >= FD_SETSIZE) break;
+    }
+
+    {
+	stx::ExecPipe ep;
+	ep.set_poll_engine(stx::ExecPipe::PE_EPOLL);
+
+	std::string input = "test123";
+	ep.set_input_string(&input);
+
+	std::string output;
+	ep.set_output_string(&output);
+
+	ep.add_execp("cat");
+
+	TestFunctionMD5 func;
+	ep.add_function(&func);
+
+	assert( ep.run().all_return_codes_zero() );
+
+	assert( output == input );
+	assert( HexString(func.m_digest) == "cc03e747a6afbbcbf8be7668acfebee5" );
+    }
+
+    for (unsigned int i = 0; i < fillfds.size(); ++i)
+	close(fillfds[i]);
+}
+
+void test_error_none_program_none()
+{
+    stx::ExecPipe ep;
+    ep.set_debug_level(stx::ExecPipe::DL_INFO);
+    ep.set_debug_output(test_error_debug_output_null);
+
+    ep.add_exec("xyz-non-existing-program");
+
+    ep.run();
+
+    assert( !ep.all_return_codes_zero() );
+
+    assert( ep.get_return_code(0) == 255 );
+}
+
+void test_error_abort_string_program_program_program_string()
+{
+    for (int engine = stx::ExecPipe::LE_FORK; engine <= stx::ExecPipe::LE_SPAWN; ++engine)
+    {
+	stx::ExecPipe ep;
+	ep.set_debug_level(stx::ExecPipe::DL_INFO);
+	ep.set_debug_output(test_error_debug_output_null);
+	ep.set_launch_engine((stx::ExecPipe::LaunchEngine)engine);
+
+	std::string input(4*1024*1024, 'x');
+	ep.set_input_string(&input);
+
+	ep.add_exec("/bin/sleep", "10");
+	ep.add_exec("xyz-non-existing-program");
+	ep.add_exec("/bin/cat");
+
+	std::string output;
+	ep.set_output_string(&output);
+
+	time_t start = time(NULL);
+
+	ep.run();
+
+	// sleep is terminated instead of waited for
+	assert( time(NULL) - start < 5 );
+
+	assert( ep.get_failed_stage() == 1 );
+	assert( ep.get_exec_error(0) == 0 );
+	assert( ep.get_exec_error(1) == ENOENT );
+	assert( ep.get_return_code(1) == 255 );
+	assert( ep.get_return_signal(0) == SIGTERM );
+	assert( ep.get_return_signal(2) == SIGTERM );
+	assert( output.size() == 0 );
+    }
+}
+
+void test_failure_policy_none_program_program_string()
+{
+    {
+	// a failing critical stage terminates the sleeping one
+	stx::ExecPipe ep;
+	ep.set_debug_level(stx::ExecPipe::DL_INFO);
+	ep.set_debug_output(test_error_debug_output_null);
+	ep.set_failure_policy(stx::ExecPipe::FP_ABORT);
+
+	ep.add_exec("/bin/sleep", "10");
+	ep.add_exec("/bin/sh", "-c", "exit 3");
+
+	std::string output;
+	ep.set_output_string(&output);
+
+	time_t start = time(NULL);
+
+	ep.run();
+
+	assert( time(NULL) - start < 5 );
+
+	assert( ep.get_failed_stage() == 1 );
+	assert( ep.get_return_code(1) == 3 );
+	assert( ep.get_return_signal(0) == SIGTERM );
+    }
+    {
+	// non-critical stages do not abort the pipe
+	stx::ExecPipe ep;
+	ep.set_failure_policy(stx::ExecPipe::FP_ABORT);
+
+	ep.add_exec("/bin/sleep", "1");
+	ep.add_exec("/bin/sh", "-c", "exit 3");
+	ep.set_stage_critical(1, false);
+
+	std::string output;
+	ep.set_output_string(&output);
+
+	ep.run();
+
+	assert( ep.get_failed_stage() == -1 );
+	assert( ep.get_return_code(0) == 0 );
+	assert( ep.get_return_code(1) == 3 );
+    }
+    {
+	// death by SIGPIPE is no failure
+	stx::ExecPipe ep;
+	ep.set_failure_policy(stx::ExecPipe::FP_ABORT);
+
+	ep.add_execp("yes");
+	ep.add_execp("head", "-c", "10");
+
+	std::string output;
+	ep.set_output_string(&output);
+
+	ep.run();
+
+	assert( ep.get_failed_stage() == -1 );
+	assert( ep.get_return_signal(0) == SIGPIPE );
+	assert( output == "y\ny\ny\ny\ny\n" );
+    }
+}
+
+void test_timeout_none_program_string()
+{
+    {
+	// the stage's deadline terminates it
+	stx::ExecPipe ep;
+	ep.set_debug_level(stx::ExecPipe::DL_INFO);
+	ep.set_debug_output(test_error_debug_output_null);
+
+	ep.add_exec("/bin/sleep", "10");
+	ep.set_stage_timeout(0, 200);
+
+	std::string output;
+	ep.set_output_string(&output);
+
+	time_t start = time(NULL);
+
+	ep.run();
+
+	assert( time(NULL) - start < 5 );
+
+	assert( !ep.get_timed_out() );
+	assert( ep.get_stage_timed_out(0) );
+	assert( ep.get_return_signal(0) == SIGTERM );
+    }
+    {
+	// the pipe's deadline escalates to SIGKILL
+	stx::ExecPipe ep;
+	ep.set_debug_level(stx::ExecPipe::DL_INFO);
+	ep.set_debug_output(test_error_debug_output_null);
+
+	ep.set_timeout(300);
+	ep.set_timeout_signal(SIGTERM, 200);
+
+	ep.add_exec("/bin/sh", "-c", "trap '' TERM; exec sleep 10");
+	ep.add_exec("/bin/cat");
+
+	std::string output;
+	ep.set_output_string(&output);
+
+	time_t start = time(NULL);
+
+	ep.run();
+
+	assert( time(NULL) - start < 5 );
+
+	assert( ep.get_timed_out() );
+	assert( ep.get_stage_timed_out(0) );
+	assert( ep.get_return_signal(0) == SIGKILL );
+    }
+}
+
+class TestEndlessSource : public stx::PipeSource
+{
+public:
+    unsigned long	m_wrote;
+
+    TestEndlessSource()
+	: m_wrote(0)
+    {
+    }
+
+    using stx::PipeSource::poll;
+
+    virtual bool poll(unsigned int hint)
+    {
+	std::string data(hint, 'x');
+	write(data.data(), data.size());
+	m_wrote += data.size();
+	return true;
+    }
+};
+
+class TestHeadFunction : public stx::PipeFunction
+{
+public:
+    unsigned int	m_left;
+
+    bool		m_eof;
+
+    TestHeadFunction(unsigned int limit)
+	: m_left(limit), m_eof(false)
+    {
+    }
+
+    virtual void process(const void* data, unsigned int datalen)
+    {
+	assert( m_left > 0 );
+
+	if (datalen > m_left) datalen = m_left;
+	write(data, datalen);
+
+	m_left -= datalen;
+	if (m_left == 0) done();
+    }
+
+    virtual void eof()
+    {
+	m_eof = true;
+    }
+};
+
+class TestHeadSink : public stx::PipeSink
+{
+public:
+    std::string		m_save;
+
+    unsigned int	m_limit;
+
+    TestHeadSink(unsigned int limit)
+	: m_limit(limit)
+    {
+    }
+
+    virtual void process(const void* data, unsigned int datalen)
+    {
+	m_save.append(reinterpret_cast<const char*>(data), datalen);
+
+	if (m_save.size() >= m_limit) done();
+    }
+
+    virtual void eof()
+    {
+    }
+};
+
+void test_early_end_object_program_function_program_object()
+{
+    {
+	// a function stage ends an endless stream
+	stx::ExecPipe ep;
+
+	TestEndlessSource source;
+	ep.set_input_source(&source);
+
+	ep.add_exec("/bin/cat");
+
+	TestHeadFunction head(1000);
+	ep.add_function(&head);
+
+	ep.add_exec("/bin/cat");
+
+	std::string output;
+	ep.set_output_string(&output);
+
+	ep.run();
+
+	assert( head.m_eof );
+	assert( output == std::string(1000, 'x') );
+	assert( ep.get_return_signal(0) == SIGPIPE );
+	assert( ep.get_return_code(2) == 0 );
+    }
+    {
+	// the output sink ends an endless program
+	stx::ExecPipe ep;
+
+	ep.add_execp("yes");
+
+	TestHeadSink sink(100);
+	ep.set_output_sink(&sink);
+
+	ep.run();
+
+	assert( sink.m_save.size() >= 100 );
+	assert( ep.get_return_signal(0) == SIGPIPE );
+    }
+    {
+	// writing into a closed input pipe does not raise SIGPIPE
+	stx::ExecPipe ep;
+
+	std::string input(1024*1024, 'x');
+	ep.set_input_string(&input);
+
+	ep.add_execp("head", "-c", "10");
+
+	std::string output;
+	ep.set_output_string(&output);
+
+	ep.run();
+
+	assert( output == "xxxxxxxxxx" );
+    }
+
+    // SIGPIPE is unblocked and not pending after run()
+    sigset_t mask, pending;
+    sigprocmask(SIG_SETMASK, NULL, &mask);
+    sigpending(&pending);
+
+    assert( !sigismember(&mask, SIGPIPE) );
+    assert( !sigismember(&pending, SIGPIPE) );
+}
+
+class TestFunctionThrow : public stx::PipeFunction
+{
+public:
+    virtual void process(const void*, unsigned int)
+    {
+	throw(std::runtime_error("test exception"));
+    }
+
+    virtual void eof()
+    {
+    }
+};
+
+class TestFunctionMD5State : public TestFunctionMD5
+{
+public:
+    virtual std::string save_state()
+    {
+	return m_digest;
+    }
+
+    virtual void restore_state(const std::string& state)
+    {
+	m_digest = state;
+    }
+};
+
+/// Run the pipe with debug output silenced, returns true if run() threw an
+/// exception whose message contains what.
+bool run_throws(stx::ExecPipe& ep, const char* what)
+{
+    ep.set_debug_level(stx::ExecPipe::DL_INFO);
+    ep.set_debug_output(test_error_debug_output_null);
+
+    try {
+	ep.run();
+    }
+    catch (std::runtime_error& e) {
+	return (std::string(e.what()).find(what) != std::string::npos);
+    }
+
+    return false;
+}
+
+/// Run string -> function -> program -> function -> string with both
+/// functions in the given mode, which must yield the same output and digests
+/// as inline functions.
+void test_function_mode_string_function_program_function_string(
+    enum stx::ExecPipe::FunctionMode mode, unsigned int size)
+{
+    std::string input = pattern_string(size);
+
+    std::string output[2], digest1[2], digest2[2];
+
+    for (unsigned int m = 0; m < 2; ++m)
+    {
+	stx::ExecPipe ep;
+
+	ep.set_input_string(&input);
+
+	TestFunctionMD5State func1, func2;
+	ep.add_function(&func1, m ? mode : stx::ExecPipe::FM_INLINE);
+	ep.add_exec("/bin/cat");
+	ep.add_function(&func2, m ? mode : stx::ExecPipe::FM_INLINE);
+
+	ep.set_output_string(&output[m]);
+
+	assert( ep.run().all_return_codes_zero() );
+
+	// worker processes report their exit status like exec stages.
+	if (m && mode == stx::ExecPipe::FM_PROCESS)
+	    assert( ep.get_return_code(0) == 0 && ep.get_return_code(2) == 0 );
+
+	digest1[m] = func1.m_digest;
+	digest2[m] = func2.m_digest;
+    }
+
+    assert( output[0] == input );
+    assert( output[1] == input );
+    assert( digest1[1] == digest1[0] && digest2[1] == digest2[0] );
+    assert( digest1[1].size() == 16 && digest1[1] == digest2[1] );
+}
+
+class TestFunctionSlowCount : public stx::PipeFunction
+{
+public:
+    unsigned long	m_processed;
+
+    bool		m_eof;
+
+    TestFunctionSlowCount()
+	: m_processed(0), m_eof(false)
+    {
+    }
+
+    virtual void process(const void* data, unsigned int datalen)
+    {
+	usleep(1000);
+	m_processed += datalen;
+	write(data, datalen);
+    }
+
+    virtual void eof()
+    {
+	m_eof = true;
+    }
+};
+
+void test_function_thread_string_function_program_function_string()
+{
+    test_function_mode_string_function_program_function_string(stx::ExecPipe::FM_THREAD, 8*1024*1024);
+
+    {
+	// done() on the worker thread ends an endless stream
+	stx::ExecPipe ep;
+
+	TestEndlessSource source;
+	ep.set_input_source(&source);
+
+	TestHeadFunction head(100000);
+	ep.add_function(&head, stx::ExecPipe::FM_THREAD);
+
+	ep.add_exec("/bin/cat");
+
+	std::string output;
+	ep.set_output_string(&output);
+
+	ep.run();
+
+	assert( head.m_eof );
+	assert( output == std::string(100000, 'x') );
+    }
+    {
+	// exceptions on the worker thread are thrown by run()
+	stx::ExecPipe ep;
+
+	std::string input = "data";
+	ep.set_input_string(&input);
+
+	TestFunctionThrow func;
+	ep.add_function(&func, stx::ExecPipe::FM_THREAD);
+
+	std::string output;
+	ep.set_output_string(&output);
+
+	assert( run_throws(ep, "test exception") );
+    }
+
+    // once its output broke or the pipe was aborted, a worker discards its
+    // queued input like an inline function.
+    for (unsigned int aborting = 0; aborting < 2; ++aborting)
+    {
+	std::string input = pattern_string(16*1024*1024);
+
+	unsigned long processed[2];
+
+	for (unsigned int mode = 0; mode < 2; ++mode)
+	{
+	    stx::ExecPipe ep;
+	    ep.set_debug_output(test_error_debug_output_null);
+	    ep.set_input_string(&input);
+
+	    TestFunctionSlowCount func;
+	    ep.add_function(&func, mode ? stx::ExecPipe::FM_THREAD : stx::ExecPipe::FM_INLINE);
+
+	    if (aborting)
+	    {
+		ep.set_failure_policy(stx::ExecPipe::FP_ABORT);
+		ep.add_exec("/bin/sh", "-c", "head -c 10 >/dev/null; exit 1");
+	    }
+	    else
+		ep.add_execp("head", "-c", "10");
+
+	    std::string output;
+	    ep.set_output_string(&output);
+
+	    ep.run();
+
+	    processed[mode] = func.m_processed;
+	    if (!aborting)
+		assert( output == input.substr(0, 10) );
+	}
+
+	assert( processed[0] < 1024*1024 && processed[1] < 1024*1024 );
+    }
+}
+
+// Test pipe: object on thread -> program -> object on thread
+
+class TestSourceThrow : public stx::PipeSource
+{
+public:
+    using stx::PipeSource::poll;
+
+    virtual bool poll(unsigned int)
+    {
+	throw(std::runtime_error("test exception"));
+    }
+};
+
+void test_source_sink_thread_object_program_object()
+{
+    for (unsigned int mode = 0; mode < 4; ++mode)
+    {
+	stx::ExecPipe ep;
+
+	TestSource source;
+	ep.set_input_source(&source, (mode & 1) ? stx::ExecPipe::FM_THREAD : stx::ExecPipe::FM_INLINE);
+
+	ep.add_execp("cat");
+
+	TestSink sink;
+	ep.set_output_sink(&sink, (mode & 2) ? stx::ExecPipe::FM_THREAD : stx::ExecPipe::FM_INLINE);
+
+	assert( ep.run().all_return_codes_zero() );
+
+	assert( sink.m_save.size() == 100*1024 );
+	assert( sink.m_save == source.m_wrote );
+    }
+
+    {
+	// done() on the sink's thread ends an endless threaded source
+	stx::ExecPipe ep;
+
+	TestEndlessSource source;
+	ep.set_input_source(&source, stx::ExecPipe::FM_THREAD);
+
+	ep.add_exec("/bin/cat");
+
+	TestHeadSink sink(100000);
+	ep.set_output_sink(&sink, stx::ExecPipe::FM_THREAD);
+
+	ep.run();
+
+	assert( sink.m_save.size() >= 100000 );
+	assert( sink.m_save.find_first_not_of('x') == std::string::npos );
+    }
+    {
+	// exceptions on the source's thread are thrown by run()
+	stx::ExecPipe ep;
+
+	TestSourceThrow source;
+	ep.set_input_source(&source, stx::ExecPipe::FM_THREAD);
+
+	ep.add_exec("/bin/cat");
+
+	std::string output;
+	ep.set_output_string(&output);
+
+	assert( run_throws(ep, "test exception") );
+    }
+}
+
+// Test pipe: string -> function in process -> program -> function in process -> string
+
+class TestFunctionCrash : public stx::PipeFunction
+{
+public:
+    virtual void process(const void*, unsigned int)
+    {
+	abort();
+    }
+
+    virtual void eof()
+    {
+    }
+};
+
+void test_function_process_string_function_program_function_string()
+{
+    // the digests are passed back by save_state() and restore_state().
+    test_function_mode_string_function_program_function_string(stx::ExecPipe::FM_PROCESS, 1024*1024);
+
+    {
+	// a crash of the function only fails its stage
+	stx::ExecPipe ep;
+
+	std::string input = "data";
+	ep.set_input_string(&input);
+
+	TestFunctionCrash crash;
+	ep.add_function(&crash, stx::ExecPipe::FM_PROCESS);
+
+	ep.add_exec("/bin/cat");
+
+	std::string output;
+	ep.set_output_string(&output);
+
+	ep.run();
+
+	assert( ep.get_return_signal(0) == SIGABRT );
+	assert( ep.get_return_code(1) == 0 );
+	assert( output.empty() );
+    }
+    {
+	// an exception in the worker is reported by its exit status
+	stx::ExecPipe ep;
+	ep.set_debug_level(stx::ExecPipe::DL_INFO);
+	ep.set_debug_output(test_error_debug_output_null);
+
+	std::string input = "data";
+	ep.set_input_string(&input);
+
+	TestFunctionThrow func;
+	ep.add_function(&func, stx::ExecPipe::FM_PROCESS);
+
+	std::string output;
+	ep.set_output_string(&output);
+
+	ep.run();
+
+	assert( ep.get_return_code(0) == 1 );
+    }
+}
+
+// Test pool: many string -> program -> program -> string pipes
+
+class TestPoolCallback : public stx::PipeCallback
+{
+public:
+    stx::ExecPipePool&	m_pool;
+
+    unsigned int	m_finished, m_errors, m_chained;
+
+    std::vector<std::string>	m_chain_output;
+
+    TestPoolCallback(stx::ExecPipePool& pool)
+	: m_pool(pool), m_finished(0), m_errors(0), m_chained(0),
+	  m_chain_output(10)
+    {
+    }
+
+    virtual void finished(stx::ExecPipe& ep, const std::string& error)
+    {
+	++m_finished;
+	if (!error.empty()) ++m_errors;
+
+	// chain further pipes from the callback
+	if (m_chained < m_chain_output.size() && error.empty() && ep.all_return_codes_zero())
+	{
+	    stx::ExecPipe next;
+	    next.add_exec("/bin/echo", "chained");
+	    next.set_output_string(&m_chain_output[m_chained++]);
+	    m_pool.add(next, this);
+	}
+    }
+};
+
+void test_pool_string_program_program_string()
+{
+    stx::ExecPipePool pool;
+    pool.set_max_children(6);
+
+    TestPoolCallback callback(pool);
+
+    const unsigned int n = 50;
+
+    std::vector<std::string> input(n), output(n);
+
+    // ExecPipe copies share the pipe, thus each is constructed separately.
+    std::vector<stx::ExecPipe> pipes;
+
+    for (unsigned int i = 0; i < n; ++i)
+    {
+	for (unsigned int j = 0; j < 1000 * (i + 1); ++j)
+	    input[i] += static_cast<char>('a' + (i + j) % 26);
+
+	stx::ExecPipe ep;
+	ep.set_input_string(&input[i]);
+	ep.add_exec("/bin/cat");
+	ep.add_exec("/bin/cat");
+	ep.set_output_string(&output[i]);
+
+	pipes.push_back(ep);
+	pool.add(ep, &callback);
+    }
+
+    // a failing pipe does not disturb the others
+    stx::ExecPipe failing;
+    failing.set_debug_level(stx::ExecPipe::DL_INFO);
+    failing.set_debug_output(test_error_debug_output_null);
+    failing.set_input_file("/nonexistent/input/file");
+    failing.add_exec("/bin/cat");
+    pool.add(failing, &callback);
+
+    assert( pool.size() == n + 1 );
+
+    // a queued pipe can neither run by itself nor be queued twice
+    for (unsigned int k = 0; k < 2; ++k)
+    {
+	bool thrown = false;
+	try {
+	    if (k) pool.add(pipes[0]);
+	    else pipes[0].run();
+	}
+	catch (std::runtime_error& e) {
+	    thrown = (std::string(e.what()) == "Exec pipe is still running.");
+	}
+	assert( thrown );
+    }
+
+    assert( pool.size() == n + 1 );
+
+    pool.run();
+
+    assert( pool.size() == 0 );
+    assert( callback.m_finished == n + 1 + callback.m_chain_output.size() );
+    assert( callback.m_errors == 1 );
+
+    for (unsigned int i = 0; i < n; ++i)
+    {
+	assert( pipes[i].all_return_codes_zero() );
+	assert( output[i] == input[i] );
+    }
+
+    for (unsigned int i = 0; i < callback.m_chain_output.size(); ++i)
+	assert( callback.m_chain_output[i] == "chained\n" );
+
+    // once finished, the pipe can be run again by itself
+    output[0].clear();
+    assert( pipes[0].run().all_return_codes_zero() );
+    assert( output[0] == input[0] );
+
+    {
+	// the cap on children serializes the pipes
+	stx::ExecPipePool pool;
+	pool.set_max_children(1);
+
+	stx::ExecPipe sleeps[3];
+	for (unsigned int i = 0; i < 3; ++i)
+	{
+	    sleeps[i].add_exec("/bin/sleep", "1");
+	    pool.add(sleeps[i]);
+	}
+
+	time_t start = time(NULL);
+
+	pool.run();
+
+	assert( time(NULL) - start >= 2 );
+
+	for (unsigned int i = 0; i < 3; ++i)
+	    assert( sleeps[i].all_return_codes_zero() );
+    }
+}
+
+void test_start_string_program_program_string()
+{
+    std::string input, output;
+
+    for (unsigned int i = 0; i < 300000; ++i)
+	input += static_cast<char>('a' + i % 26);
+
+    stx::ExecPipe pipes[3];
+
+    pipes[0].set_input_string(&input);
+    pipes[0].add_exec("/bin/cat");
+    pipes[0].add_exec("/bin/cat");
+    pipes[0].set_output_string(&output);
+
+    // the deadline must be kept without any file descriptor activity
+    pipes[1].add_exec("/bin/sleep", "10");
+    pipes[1].set_timeout(200);
+
+    pipes[2].add_exec("/bin/false");
+
+    for (unsigned int i = 0; i < 3; ++i)
+	pipes[i].start();
+
+    // while running, the pipe cannot be started again
+    try {
+	pipes[1].run();
+	assert(0);
+    }
+    catch (std::runtime_error& e) {
+    }
+
+    time_t start = time(NULL);
+
+    // a minimal external event loop using poll()
+    while (!pipes[0].is_finished() || !pipes[1].is_finished() || !pipes[2].is_finished())
+    {
+	std::vector<struct pollfd> pfds;
+	std::vector<unsigned int> owner;
+	int timeout = -1;
+
+	for (unsigned int i = 0; i < 3; ++i)
+	{
+	    std::vector<stx::ExecPipe::PollFd> fds;
+	    int t = pipes[i].get_poll_fds(fds);
+
+	    if (t >= 0 && (timeout < 0 || t < timeout))
+		timeout = t;
+
+	    for (unsigned int j = 0; j < fds.size(); ++j)
+	    {
+		struct pollfd pfd;
+		pfd.fd = fds[j].fd;
+		pfd.events = 0;
+		if (fds[j].events & stx::ExecPipe::PL_READ) pfd.events |= POLLIN;
+		if (fds[j].events & stx::ExecPipe::PL_WRITE) pfd.events |= POLLOUT;
+		pfds.push_back(pfd);
+		owner.push_back(i);
+	    }
+	}
+
+	int retval = poll(pfds.empty() ? NULL : &pfds[0], pfds.size(), timeout);
+	assert( retval >= 0 || errno == EINTR );
+
+	if (retval <= 0)
+	{
+	    for (unsigned int i = 0; i < 3; ++i)
+		pipes[i].on_ready(-1, 0);
+	    continue;
+	}
+
+	for (unsigned int j = 0; j < pfds.size(); ++j)
+	{
+	    if (!pfds[j].revents) continue;
+
+	    int events = 0;
+	    if (pfds[j].revents & (POLLIN | POLLHUP | POLLERR)) events |= stx::ExecPipe::PL_READ;
+	    if (pfds[j].revents & (POLLOUT | POLLHUP | POLLERR)) events |= stx::ExecPipe::PL_WRITE;
+
+	    pipes[owner[j]].on_ready(pfds[j].fd, events);
+	}
+    }
+
+    assert( time(NULL) - start < 5 );
+
+    assert( pipes[0].all_return_codes_zero() );
+    assert( output == input );
+
+    assert( pipes[1].get_timed_out() );
+    assert( pipes[1].get_return_signal(0) == SIGTERM );
+
+    assert( pipes[2].get_return_code(0) == 1 );
+
+    // a finished pipe is run again as usual
+    output.clear();
+    pipes[0].run();
+    assert( output == input );
+}
+
+void test_error_fork_none_program_none()
 {
     stx::ExecPipe ep;
     ep.set_debug_level(stx::ExecPipe::DL_INFO);
     ep.set_debug_output(test_error_debug_output_null);
+    ep.set_launch_engine(stx::ExecPipe::LE_FORK);
 
     ep.add_exec("xyz-non-existing-program");
 
@@ -334,15 +2307,49 @@ int main()
 {
     test_none_program_string();
     test_string_program_string();
+    test_string_zerocopy_program_string();
     test_string_program_program_string();
     test_file_program_string();
+    test_files_program_string();
     test_string_program_object();
     test_object_program_string();
+    test_hint_object_program_string();
+    test_pipe_capacity_string_program_program_string();
+    test_read_size_string_program_string();
+    test_syscall_count_string_program_function_string();
     test_object_program_object_program_string();
     test_object_program_object_string();
+    test_object_program_observer_program_string();
+    test_file_observer_program_file();
+    test_string_observer_string();
+    test_string_program_function_slow_string();
+    test_string_program_function_none();
     test_none_program_set_string();
+    test_launch_string_program_program_string();
+    test_exec_cache_string_program_string();
+    test_fd_leak_none_program_string();
+#ifndef STX_EXECPIPE_NO_THREADS
+    test_fd_leak_threads_none_program_program_string();
+#endif
+    test_foreign_child_string_program_program_string();
+    test_fork_server_string_program_program_string();
+    test_coprocess_string_program_coprocess_string();
+    test_select_object_program_object_program_string();
+    test_io_uring_object_program_object_program_string();
+    test_io_uring_string_program_function_program_string();
+    test_epoll_high_fds();
 
     test_error_none_program_none();
+    test_error_fork_none_program_none();
+    test_error_abort_string_program_program_program_string();
+    test_failure_policy_none_program_program_string();
+    test_timeout_none_program_string();
+    test_early_end_object_program_function_program_object();
+    test_function_thread_string_function_program_function_string();
+    test_source_sink_thread_object_program_object();
+    test_function_process_string_function_program_function_string();
+    test_pool_string_program_program_string();
+    test_start_string_program_program_string();
     test_segfault_none_program_none();
 
     return 0;
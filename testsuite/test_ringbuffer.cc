@@ -124,10 +124,43 @@ void test2()
     }
 }
 
+void test3()
+{
+    char buffer[1024];
+
+    for (unsigned int i = 0; i < sizeof(buffer); ++i)
+	buffer[i] = i;
+
+    // test both segments of a wrapped buffer
+    stx::RingBuffer rb;
+
+    rb.write(buffer, 768);
+    rb.advance(768);
+
+    assert(rb.wrappedsize() == 0);
+
+    rb.write(buffer, 512);
+
+    assert(rb.size() == 512);
+    assert(rb.bottomsize() == 256);
+    assert(rb.wrappedsize() == 256);
+    assert(rb.buffsize() == 1024);
+
+    assert(memcmp(rb.bottom(), buffer, 256) == 0);
+    assert(memcmp(rb.wrapped(), buffer + 256, 256) == 0);
+
+    rb.advance(256);
+
+    assert(rb.bottomsize() == 256);
+    assert(rb.wrappedsize() == 0);
+    assert(memcmp(rb.bottom(), buffer + 256, 256) == 0);
+}
+
 int main()
 {
     test1();
     test2();
+    test3();
 
     return 0;
 }